@@ -18,15 +18,39 @@
 #include "aks.h"
 #include "utility.h"
 #include "factor.h"
-#define _GMP_ECM_FACTOR(n, f, b1, ncurves) \
-   _GMP_ecm_factor_projective(n, f, b1, 0, ncurves)
-
+#include "lmo.h"
+#include "prime_iterator.h"
+#include "prime_tree.h"
+#include "checkpoint.h"
+
+/* ecm_factor on Edwards curves, on Suyama's Montgomery curves, or on affine
+ * Weierstrass curves run side by side (stage 1 only) */
+enum { ECM_EDWARDS, ECM_SUYAMA, ECM_AFFINE };
+#define ECM_ON(curves, n, f, b1, ncurves) \
+  ( ((curves) == ECM_EDWARDS) ? _GMP_ecm_factor_edwards(n, f, b1, 0, ncurves) \
+  : ((curves) == ECM_SUYAMA)  ? _GMP_ecm_factor_projective(n, f, b1, 0, ncurves) \
+  :                             _GMP_ecm_factor_affine(n, f, b1, ncurves) )
 
 /* Instead of trying to suck in lots of Math::BigInt::GMP and be terribly
  * clever (and brittle), just do all C<->Perl bigints via strings.  It's
  * crude but seems to work pretty well.
  */
 
+/* A scalar if <= min(ULONG_MAX,UV_MAX), a string otherwise */
+static SV* newSVmpz(mpz_t n)
+{
+  UV v = mpz_get_ui(n);
+  SV* sv;
+  char* str;
+  if (!mpz_cmp_ui(n, v))
+    return newSVuv(v);
+  New(0, str, mpz_sizeinbase(n, 10) + 2, char);
+  mpz_get_str(str, 10, n);
+  sv = newSVpv(str, 0);
+  Safefree(str);
+  return sv;
+}
+
 static void validate_string_number(const char* f, const char* s)
 {
   const char* p;
@@ -60,12 +84,33 @@ _GMP_set_verbose(IN int v)
   PPCODE:
      set_verbose_level(v);
 
+void
+set_effort_budget(IN UV seconds = 0, IN UV ops = 0)
+  PPCODE:
+     set_effort_budget(seconds, ops);
+
+int
+effort_exhausted()
+  CODE:
+     RETVAL = effort_exhausted();
+  OUTPUT:
+     RETVAL
+
 void
 _GMP_init()
 
 void
 _GMP_destroy()
 
+UV
+_GMP_primary_sieve_size(IN UV bytes = 0)
+  CODE:
+    if (bytes > 0)
+      prime_iterator_set_primary_size(bytes);
+    RETVAL = prime_iterator_get_primary_size();
+  OUTPUT:
+    RETVAL
+
 
 int
 _GMP_miller_rabin(IN char* strn, ...)
@@ -210,6 +255,7 @@ is_prime(IN char* strn)
     mpz_t n;
     int ret;
   CODE:
+    effort_begin();
     /* Returns arg for single-dig primes, 0 for multiples of 2, 3, 5, or neg */
     PRIMALITY_START("is_prime", 2, 1);
     switch (ix) {
@@ -239,6 +285,7 @@ _is_provable_prime(IN char* strn, IN int wantproof = 0)
     int result;
     mpz_t n;
   PPCODE:
+    effort_begin();
     PRIMALITY_START("is_provable_prime", 2, 1);
     if (ix == 1) {
       result = is_miller_prime(n, wantproof);  /* Assume GRH or not */
@@ -304,21 +351,7 @@ is_power(IN char* strn, IN UV a = 0)
     RETVAL
 
 
-#define XPUSH_MPZ(n) \
-  do { \
-    /* Push as a scalar if <= min(ULONG_MAX,UV_MAX), string otherwise */ \
-    UV _v = mpz_get_ui(n); \
-    if (!mpz_cmp_ui(n, _v)) { \
-      XPUSHs(sv_2mortal(newSVuv( _v ))); \
-    } else { \
-      char* str; \
-      int nsize = mpz_sizeinbase(n, 10) + 2; \
-      New(0, str, nsize, char); \
-      mpz_get_str(str, 10, n); \
-      XPUSHs(sv_2mortal(newSVpv(str, 0))); \
-      Safefree(str); \
-    } \
-  } while (0)
+#define XPUSH_MPZ(n)  XPUSHs(sv_2mortal(newSVmpz(n)))
 
 void
 next_prime(IN char* strn)
@@ -337,31 +370,58 @@ next_prime(IN char* strn)
 
 
 void
-prime_count(IN char* strlow, IN char* strhigh)
+prime_count(IN char* strlow, IN char* strhigh = 0)
   PREINIT:
     mpz_t low, high, count;
   PPCODE:
     VALIDATE_AND_SET("prime_count", low, strlow);
-    VALIDATE_AND_SET("prime_count", high, strhigh);
+    if (strhigh == 0) {
+      mpz_init_set(high, low);
+      mpz_set_ui(low, 0);
+    } else {
+      VALIDATE_AND_SET("prime_count", high, strhigh);
+    }
     mpz_init_set_ui(count, 0);
 
-    if (mpz_cmp(low, high) <= 0) {
-      mpz_t curprime;
-      mpz_init_set(curprime, low);
-      if (mpz_cmp_ui(curprime, 2) >= 0)
-        mpz_sub_ui(curprime, curprime, 1);  /* Make sure low gets included */
-      _GMP_next_prime(curprime);
-      while (mpz_cmp(curprime, high) <= 0) {
-        mpz_add_ui(count, count, 1);
-        _GMP_next_prime(curprime);
+    if (mpz_cmp(low, high) > 0) {
+      /* Empty range */
+    } else if (prime_count_use_lmo(low, high)) {
+      /* Analytic count:  pi(high) - pi(low-1) */
+      lmo_prime_count(count, high);
+      if (mpz_cmp_ui(low, 2) > 0) {
+        mpz_sub_ui(low, low, 1);
+        lmo_prime_count(high, low);
+        mpz_sub(count, count, high);
       }
-      mpz_clear(curprime);
+    } else {
+      /* Segmented sieve and BPSW, in chunks that fit the count in a UV */
+      mpz_t seghigh;
+      UV maxseg = ((UV_MAX > ULONG_MAX) ? ULONG_MAX : UV_MAX);
+      mpz_init(seghigh);
+      while (mpz_cmp(low, high) <= 0) {
+        mpz_add_ui(seghigh, low, maxseg - 1);
+        if (mpz_cmp(seghigh, high) > 0)
+          mpz_set(seghigh, high);
+        mpz_add_ui(count, count, sieve_primes_count(low, seghigh, 0));
+        mpz_add_ui(low, seghigh, 1);
+      }
+      mpz_clear(seghigh);
     }
     XPUSH_MPZ(count);
     mpz_clear(count);
     mpz_clear(high);
     mpz_clear(low);
 
+void
+nth_prime(IN char* strn)
+  PREINIT:
+    mpz_t n;
+  PPCODE:
+    VALIDATE_AND_SET("nth_prime", n, strn);
+    nth_prime(n, n);
+    XPUSH_MPZ(n);
+    mpz_clear(n);
+
 void
 primorial(IN char* strn)
   ALIAS:
@@ -379,6 +439,7 @@ primorial(IN char* strn)
     mpz_t res, n;
     UV un;
   PPCODE:
+    effort_begin();
     if (strn != 0 && strn[0] == '-') { /* If input is negative... */
       if (ix == 3)  XSRETURN_IV(1);    /* exp_mangoldt return 1 */
       if (ix == 9)  strn++;            /* znprimroot flip sign */
@@ -500,6 +561,7 @@ moebius(IN char* strn, IN char* stro = 0)
   PREINIT:
     mpz_t n;
   PPCODE:
+    effort_begin();
     VALIDATE_AND_SET("moebius", n, strn);
     if (stro == 0) {
       int result = moebius(n);
@@ -537,6 +599,7 @@ liouville(IN char* strn)
   PREINIT:
     mpz_t n;
   CODE:
+    effort_begin();
     VALIDATE_AND_SET("liouville", n, strn);
     RETVAL = liouville(n);
     mpz_clear(n);
@@ -556,6 +619,7 @@ invmod(IN char* stra, IN char* strb)
     mpz_t a, b, t;
     int retundef;
   PPCODE:
+    effort_begin();
     validate_string_number("invmod", (stra[0]=='-') ? stra+1 : stra);
     validate_string_number("invmod", (strb[0]=='-') ? strb+1 : strb);
     mpz_init_set_str(a, stra, 10);
@@ -762,42 +826,52 @@ sieve_prime_cluster(IN char* strlow, IN char* strhigh, ...)
   ALIAS:
     sieve_primes = 1
     sieve_twin_primes = 2
+    prime_cluster_count = 3
+    twin_prime_count = 4
   PREINIT:
-    mpz_t low, seghigh, high, t;
+    mpz_t low, seghigh, high, t, count;
     UV i, nc, nprimes, maxseg, *list;
+    uint32_t *cl = 0;
   PPCODE:
     VALIDATE_AND_SET("sieve_primes", low, strlow);
     VALIDATE_AND_SET("sieve_primes", high, strhigh);
     mpz_init(seghigh);
     mpz_init(t);
+    mpz_init_set_ui(count, 0);
 
     nc = items-1;
     maxseg = ((UV_MAX > ULONG_MAX) ? ULONG_MAX : UV_MAX);
 
+    if (ix == 0 || ix == 3) {
+      New(0, cl, nc, uint32_t);
+      cl[0] = 0;
+      for (i = 1; i < nc; i++) {
+        UV cval = SvUV(ST(1+i));
+        if (cval & 1) { Safefree(cl); croak("sieve_prime_cluster: values must be even"); }
+        if (cval > 2147483647UL) { Safefree(cl); croak("sieve_prime_cluster: values must be 31-bit"); }
+        if (cval <= cl[i-1]) { Safefree(cl); croak("sieve_prime_cluster: values must be increasing"); }
+        cl[i] = cval;
+      }
+    }
+
     /* Loop as needed */
     while (mpz_cmp(low, high) <= 0) {
       mpz_add_ui(seghigh, low, maxseg - 1);
       if (mpz_cmp(seghigh, high) > 0)
         mpz_set(seghigh, high);
       mpz_set(t, seghigh);  /* Save in case it is modified */
+      list = 0;
       if (ix == 1) {
         UV k = (nc <= 1) ? 0 : SvUV(ST(2));
         list = sieve_primes(low, seghigh, k, &nprimes);
       } else if (ix == 2) {
         list = sieve_twin_primes(low, seghigh, 2, &nprimes);
-      } else {
-        uint32_t *cl;
-        New(0, cl, nc, uint32_t);
-        cl[0] = 0;
-        for (i = 1; i < nc; i++) {
-          UV cval = SvUV(ST(1+i));
-          if (cval & 1) croak("sieve_prime_cluster: values must be even");
-          if (cval > 2147483647UL) croak("sieve_prime_cluster: values must be 31-bit");
-          if (cval <= cl[i-1]) croak("sieve_prime_cluster: values must be increasing");
-          cl[i] = cval;
-        }
+      } else if (ix == 0) {
         list = sieve_cluster(low, seghigh, cl, nc, &nprimes);
-        Safefree(cl);
+      } else if (ix == 3) {
+        mpz_add_ui(count, count, sieve_cluster_count(low, seghigh, cl, nc));
+      } else {
+        mpz_add_ui(count, count, sieve_twin_primes_count(low, seghigh, 2));
       }
       mpz_set(seghigh, t);  /* Restore the value we used */
 
@@ -810,6 +884,10 @@ sieve_prime_cluster(IN char* strlow, IN char* strhigh, ...)
       }
       mpz_add_ui(low, seghigh, 1);
     }
+    if (ix >= 3)
+      XPUSH_MPZ(count);
+    if (cl != 0) Safefree(cl);
+    mpz_clear(count);
     mpz_clear(t);
     mpz_clear(seghigh);
     mpz_clear(high);
@@ -884,15 +962,57 @@ lucas_sequence(IN char* strn, IN IV P, IN IV Q, IN char* strk)
     mpz_clear(U);  mpz_clear(V);  mpz_clear(Qk);  mpz_clear(t);
 
 
-#define SET_UV_VIA_MPZ_STRING(uva, sva, name) \
+#define SET_UV_VIA_STRING(uva, str, name) \
   { \
       mpz_t t; \
-      char* stra = SvPV_nolen(sva); \
+      const char* stra = str; \
       validate_string_number(name, stra); \
       mpz_init_set_str(t, stra, 10); \
       uva = mpz_get_ui(t); \
       mpz_clear(t); \
   }
+#define SET_UV_VIA_MPZ_STRING(uva, sva, name) \
+  SET_UV_VIA_STRING(uva, SvPV_nolen(sva), name)
+
+void
+smooth_parts(IN UV B, ...)
+  PROTOTYPE: $@
+  ALIAS:
+    smooth_factors = 1
+  PREINIT:
+    mpz_t* list;
+    int i, nn;
+  PPCODE:
+    effort_begin();
+    nn = items-1;
+    if (nn == 0) XSRETURN_EMPTY;
+    New(0, list, nn, mpz_t);
+    for (i = 0; i < nn; i++) {
+      char* strn = SvPV_nolen(ST(i+1));
+      validate_string_number("smooth_parts", (strn[0]=='+') ? strn+1 : strn);
+      mpz_init_set_str(list[i], (strn[0]=='+') ? strn+1 : strn, 10);
+    }
+    batch_smooth_parts(list, list, nn, B);
+    EXTEND(SP, nn);
+    for (i = 0; i < nn; i++) {
+      if (ix == 0) {
+        XPUSH_MPZ(list[i]);
+      } else {
+        AV* av = newAV();
+        if (mpz_cmp_ui(list[i], 1) > 0) {
+          mpz_t* factors;
+          int* exponents;
+          int j, k, nfactors = factor(list[i], &factors, &exponents);
+          for (j = 0; j < nfactors; j++)
+            for (k = 0; k < exponents[j]; k++)
+              av_push(av, newSVuv(mpz_get_ui(factors[j])));
+          clear_factors(nfactors, &factors, &exponents);
+        }
+        XPUSHs(sv_2mortal(newRV_noinc((SV*)av)));
+      }
+      mpz_clear(list[i]);
+    }
+    Safefree(list);
 
 void
 trial_factor(IN char* strn, ...)
@@ -908,10 +1028,12 @@ trial_factor(IN char* strn, ...)
   PREINIT:
     mpz_t n;
     UV arg1, arg2, uf;
+    int curves = ECM_EDWARDS;
     static const UV default_arg1[] =
        {0,    64000000,64000000,5000000,5000000,256000000,16000000,0,  0  };
      /* Trial,Rho,     Brent,   P-1,    P+1,    HOLF,     SQUFOF,  ECM,QS */
   PPCODE:
+    effort_begin();
     VALIDATE_AND_SET(" specific factor", n, strn);
     {
       int cmpr = mpz_cmp_ui(n,1);
@@ -924,6 +1046,13 @@ trial_factor(IN char* strn, ...)
     arg2 = 0;
     if (items >= 2) SET_UV_VIA_MPZ_STRING(arg1, ST(1), "specific factor arg 1");
     if (items >= 3) SET_UV_VIA_MPZ_STRING(arg2, ST(2), "specific factor arg 2");
+    if (items >= 4 && ix == 7) {
+      const char* name = SvPV_nolen(ST(3));
+      if      (!strcmp(name, "edwards"))  curves = ECM_EDWARDS;
+      else if (!strcmp(name, "suyama"))   curves = ECM_SUYAMA;
+      else if (!strcmp(name, "affine"))   curves = ECM_AFFINE;
+      else    croak("ecm_factor: unknown curves '%s'", name);
+    }
     while (mpz_even_p(n)) {
       XPUSHs(sv_2mortal(newSVuv(2)));
       mpz_divexact_ui(n, n, 2);
@@ -957,13 +1086,13 @@ trial_factor(IN char* strn, ...)
         case 6: success = _GMP_squfof_factor(n, f, arg1);         break;
         case 7: if (arg2 == 0) arg2 = 100;
                 if (arg1 == 0) {
-                  success =    _GMP_ECM_FACTOR(n, f,     1000, 40)
-                            || _GMP_ECM_FACTOR(n, f,    10000, 40)
-                            || _GMP_ECM_FACTOR(n, f,   100000, 40)
-                            || _GMP_ECM_FACTOR(n, f,  1000000, 40)
-                            || _GMP_ECM_FACTOR(n, f, 10000000,100);
+                  success =    ECM_ON(curves, n, f,     1000, 40)
+                            || ECM_ON(curves, n, f,    10000, 40)
+                            || ECM_ON(curves, n, f,   100000, 40)
+                            || ECM_ON(curves, n, f,  1000000, 40)
+                            || ECM_ON(curves, n, f, 10000000,100);
                 } else {
-                  success = _GMP_ECM_FACTOR(n, f, arg1, arg2);
+                  success = ECM_ON(curves, n, f, arg1, arg2);
                 }
                 break;
         case 8:
@@ -993,16 +1122,194 @@ trial_factor(IN char* strn, ...)
       XPUSH_MPZ(n);
     mpz_clear(n);
 
+void
+pminus1_save(IN char* strn, IN char* strB1, IN char* strparam = 0)
+  ALIAS:
+    ecm_save = 1
+  PREINIT:
+    mpz_t n, param, f;
+    UV B1;
+    factor_save_t s;
+    char* line;
+    int found;
+  PPCODE:
+    effort_begin();
+    VALIDATE_AND_SET("save", n, strn);
+    if (mpz_cmp_ui(n, 3) <= 0)
+      croak("%s: n must be larger than 3", (ix == 0) ? "pminus1_save" : "ecm_save");
+    SET_UV_VIA_STRING(B1, strB1, "save (B1)");
+    if (strparam != 0) {
+      VALIDATE_AND_SET("save (param)", param, strparam);
+    } else if (ix == 0) {
+      mpz_init_set_ui(param, 2);
+    } else {
+      mpz_init(param);
+      do {
+        mpz_urandomm(param, *get_randstate(), n);
+      } while (mpz_cmp_ui(param, 5) <= 0);
+    }
+    mpz_init(f);
+    factor_save_init(&s, (ix == 0) ? FACTOR_PMINUS1 : FACTOR_ECM, n, param);
+    found = factor_save_run(&s, f, B1, 0);
+    mpz_clear(param);  mpz_clear(n);
+    if (found < 0) {
+      mpz_clear(f);
+      factor_save_clear(&s);
+      croak("ecm_save: sigma gives no curve");
+    }
+    line = factor_save_string(&s);
+    XPUSHs(sv_2mortal(newSVpv(line, 0)));
+    Safefree(line);
+    if (found) {                    /* Stage 1 found a factor */
+      XPUSH_MPZ(f);
+      mpz_divexact(f, s.n, f);
+      XPUSH_MPZ(f);
+    }
+    mpz_clear(f);
+    factor_save_clear(&s);
+
+void
+resume_save(IN char* strline, IN char* strB = 0)
+  ALIAS:
+    resume_factor = 1
+  PREINIT:
+    mpz_t f;
+    UV B;
+    factor_save_t s;
+    char* line;
+    int found;
+  PPCODE:
+    effort_begin();
+    if (!factor_save_parse(&s, strline))
+      croak("%s: not a valid save line", (ix == 0) ? "resume_save" : "resume_factor");
+    if (strB == 0 && ix == 0)
+      croak("resume_save: no B1 given");
+    B = 0;
+    if (strB != 0) SET_UV_VIA_STRING(B, strB, "resume (bound)");
+    mpz_init(f);
+    if (ix == 0) {                  /* Extend stage 1 to B */
+      found = factor_save_run(&s, f, B, 0);
+    } else {                        /* Stage 2 to B */
+      if (B == 0)
+        B = s.B1 * ((s.method == FACTOR_ECM) ? 100 : 10);
+      found = factor_save_run(&s, f, s.B1, B);
+    }
+    if (found < 0) {
+      mpz_clear(f);
+      factor_save_clear(&s);
+      croak("resume: sigma gives no curve");
+    }
+    if (ix == 0) {
+      line = factor_save_string(&s);
+      XPUSHs(sv_2mortal(newSVpv(line, 0)));
+      Safefree(line);
+    }
+    if (found) {
+      XPUSH_MPZ(f);
+      mpz_divexact(f, s.n, f);
+      XPUSH_MPZ(f);
+    } else if (ix == 1) {
+      XPUSH_MPZ(s.n);
+    }
+    mpz_clear(f);
+    factor_save_clear(&s);
+
+void
+set_factor_strategy(...)
+  PREINIT:
+    factor_stage_t* stages;
+    int i, j;
+  PPCODE:
+    for (i = 0; i < items; i++) {
+      AV* av;
+      SV** svp;
+      if (!SvROK(ST(i)) || SvTYPE(SvRV(ST(i))) != SVt_PVAV)
+        croak("set_factor_strategy: stage %d is not an array reference", i);
+      av = (AV*) SvRV(ST(i));
+      svp = av_fetch(av, 0, 0);
+      if (svp == 0 || factor_method(SvPV_nolen(*svp)) < 0)
+        croak("set_factor_strategy: stage %d has an unknown method", i);
+      /* A sixth element (the cost from get_factor_strategy) is recomputed */
+      if (av_len(av) > 5)
+        croak("set_factor_strategy: stage %d has too many parameters", i);
+    }
+    New(0, stages, (items > 0) ? items : 1, factor_stage_t);
+    for (i = 0; i < items; i++) {
+      AV* av = (AV*) SvRV(ST(i));
+      UV v[4] = {0, 0, 0, 0};
+      for (j = 0; j < 4; j++) {
+        SV** svp = av_fetch(av, j+1, 0);
+        if (svp != 0 && SvOK(*svp))
+          SET_UV_VIA_MPZ_STRING(v[j], *svp, "set_factor_strategy");
+      }
+      stages[i].method  = factor_method(SvPV_nolen(*av_fetch(av, 0, 0)));
+      stages[i].minbits = v[0];
+      stages[i].maxbits = v[1];
+      stages[i].arg1    = v[2];
+      stages[i].arg2    = v[3];
+      stages[i].cost    = 0;
+    }
+    set_factor_strategy(stages, items);
+    Safefree(stages);
+    XSRETURN_EMPTY;
+
+void
+set_factor_cache(IN UV entries = 0)
+  PPCODE:
+    set_factor_cache(entries);
+
+void
+factor_cache_stats()
+  PREINIT:
+    UV hits, misses, entries;
+  PPCODE:
+    factor_cache_stats(&hits, &misses, &entries);
+    XPUSHs(sv_2mortal(newSVuv(hits)));
+    XPUSHs(sv_2mortal(newSVuv(misses)));
+    XPUSHs(sv_2mortal(newSVuv(entries)));
+
+int
+set_factor_threads(IN int nthreads = 1)
+  CODE:
+    set_factor_threads(nthreads);
+    RETVAL = get_factor_threads();
+  OUTPUT:
+    RETVAL
+
+void
+get_factor_strategy()
+  PREINIT:
+    factor_stage_t* stages;
+    UV i, nstages;
+  PPCODE:
+    stages = get_factor_strategy(&nstages);
+    EXTEND(SP, (IV)nstages);
+    for (i = 0; i < nstages; i++) {
+      AV* av = newAV();
+      av_push(av, newSVpv(factor_method_name(stages[i].method), 0));
+      av_push(av, newSVuv(stages[i].minbits));
+      av_push(av, newSVuv(stages[i].maxbits));
+      av_push(av, newSVuv(stages[i].arg1));
+      av_push(av, newSVuv(stages[i].arg2));
+      av_push(av, newSVuv(stages[i].cost));
+      PUSHs(sv_2mortal(newRV_noinc((SV*)av)));
+    }
+    Safefree(stages);
+
 void
 _GMP_factor(IN char* strn)
   PREINIT:
     mpz_t n;
     mpz_t* factors;
     int* exponents;
+    int* status;
     int nfactors, i, j;
   PPCODE:
+    effort_begin();
     VALIDATE_AND_SET("factor", n, strn);
-    nfactors = factor(n, &factors, &exponents);
+    /* Composites left when out of effort are returned as they are */
+    nfactors = factor_with_status(n, &factors, &exponents, &status);
+    if (nfactors > 0)  Safefree(status);
     for (i = 0; i < nfactors; i++) {
       for (j = 0; j < exponents[i]; j++) {
         XPUSH_MPZ(factors[i]);
@@ -1011,11 +1318,86 @@ _GMP_factor(IN char* strn)
     clear_factors(nfactors, &factors, &exponents);
     mpz_clear(n);
 
+void
+factor_with_status(IN char* strn)
+  PREINIT:
+    mpz_t n;
+    mpz_t* factors;
+    int* exponents;
+    int* status;
+    int nfactors, i;
+  PPCODE:
+    effort_begin();
+    VALIDATE_AND_SET("factor_with_status", n, strn);
+    nfactors = factor_with_status(n, &factors, &exponents, &status);
+    EXTEND(SP, nfactors);
+    for (i = 0; i < nfactors; i++) {
+      AV* av = newAV();
+      av_push(av, newSVmpz(factors[i]));
+      av_push(av, newSViv(exponents[i]));
+      av_push(av, newSViv(status[i]));
+      PUSHs(sv_2mortal(newRV_noinc((SV*)av)));
+    }
+    if (nfactors > 0)  Safefree(status);
+    clear_factors(nfactors, &factors, &exponents);
+    mpz_clear(n);
+
 void sigma(IN char* strn, IN UV k = 1)
   PREINIT:
     mpz_t n;
   PPCODE:
+    effort_begin();
     VALIDATE_AND_SET("sigma", n, strn);
     sigma(n, n, k);
     XPUSH_MPZ(n);
     mpz_clear(n);
+
+
+MODULE = Math::Prime::Util::GMP		PACKAGE = Math::Prime::Util::GMP::PrimeIterator
+
+#define GET_PRIME_WALK(w, sv) \
+  do { \
+    if (!sv_isobject(sv) || !sv_derived_from(sv, "Math::Prime::Util::GMP::PrimeIterator")) \
+      croak("PrimeIterator: not an iterator object"); \
+    w = INT2PTR(prime_walk_t*, SvIV(SvRV(sv))); \
+  } while (0)
+
+void
+new(IN char* class, IN char* strn = "2")
+  PREINIT:
+    prime_walk_t* w;
+    mpz_t n;
+  PPCODE:
+    VALIDATE_AND_SET("PrimeIterator::new", n, strn);
+    New(0, w, 1, prime_walk_t);
+    /* Start at the first prime >= n */
+    if (mpz_cmp_ui(n, 2) < 0) mpz_set_ui(n, 2);
+    mpz_sub_ui(n, n, 1);
+    prime_walk_init(w, n);
+    prime_walk_next(w);
+    mpz_clear(n);
+    ST(0) = sv_newmortal();
+    sv_setref_pv(ST(0), class, (void*)w);
+    XSRETURN(1);
+
+void
+value(IN SV* self)
+  ALIAS:
+    next = 1
+    prev = 2
+  PREINIT:
+    prime_walk_t* w;
+  PPCODE:
+    GET_PRIME_WALK(w, self);
+    if (ix == 1)  prime_walk_next(w);
+    if (ix == 2)  prime_walk_prev(w);
+    XPUSH_MPZ(w->p);
+
+void
+DESTROY(IN SV* self)
+  PREINIT:
+    prime_walk_t* w;
+  PPCODE:
+    GET_PRIME_WALK(w, self);
+    prime_walk_destroy(w);
+    Safefree(w);
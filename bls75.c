@@ -5,12 +5,11 @@
 #include "bls75.h"
 #include "primality.h"
 #include "prime_iterator.h"
+#include "prime_tree.h"
 #include "small_factor.h"
 #include "factor.h"
 #include "simpqs.h"
 #include "ecm.h"
-#define _GMP_ECM_FACTOR(n, f, b1, ncurves) \
-   _GMP_ecm_factor_projective(n, f, b1, 0, ncurves)
 #include "utility.h"
 
 /*
@@ -178,24 +177,6 @@ static int tfe(mpz_t f, mpz_t n, int effort)
   return success;
 }
 
-/* F*R = n, F is factored part, R is remainder */
-static void small_factor(mpz_t F, mpz_t R, UV B1)
-{
-  PRIME_ITERATOR(iter);
-  UV tf;
-  for (tf = 2; tf < B1; tf = prime_iterator_next(&iter)) {
-    if (mpz_cmp_ui(R, tf*tf) < 0) break;
-    if (mpz_divisible_ui_p(R, tf)) {
-      do {
-        mpz_mul_ui(F, F, tf);
-        mpz_divexact_ui(R, R, tf);
-      } while (mpz_divisible_ui_p(R, tf));
-    }
-  }
-  prime_iterator_destroy(&iter);
-}
-
-
 typedef struct {
   int    cur;
   int    max;
@@ -229,6 +210,66 @@ static void destroy_fstack(fstack_t* s) {
   s->stack = 0;
 }
 
+/* Composites from n-1 and n+1 waiting to be split.  Each remembers its side
+ * and the tfe effort it tries next, so a cofactor that waited while the other
+ * side was worked on picks up where it stopped. */
+typedef struct {
+  int    cur;
+  int    max;
+  mpz_t* c;
+  int*   side;
+  int*   effort;
+} cpool_t;
+
+#define COMPOSITE_POOL(name)  cpool_t name = {0, 0, 0, 0, 0}
+
+static void cpool_take(cpool_t* p, fstack_t* s, int side) {
+  while (s->cur > 0) {
+    if (p->c == 0) {
+      New(0, p->c, p->max = 10, mpz_t);
+      New(0, p->side, p->max, int);
+      New(0, p->effort, p->max, int);
+    }
+    if (p->cur == p->max) {
+      p->max += 10;
+      Renew(p->c, p->max, mpz_t);
+      Renew(p->side, p->max, int);
+      Renew(p->effort, p->max, int);
+    }
+    mpz_init(p->c[p->cur]);
+    pop_fstack(p->c[p->cur], s);
+    p->side[p->cur] = side;
+    p->effort[p->cur] = 0;
+    p->cur++;
+  }
+}
+/* The entry at the lowest effort, smallest first among equals */
+static int cpool_next(cpool_t* p) {
+  int i, best = 0;
+  for (i = 1; i < p->cur; i++)
+    if (p->effort[i] < p->effort[best] ||
+        (p->effort[i] == p->effort[best] &&
+         mpz_sizeinbase(p->c[i],2) < mpz_sizeinbase(p->c[best],2)))
+      best = i;
+  return best;
+}
+static void cpool_remove(mpz_t rv, cpool_t* p, int i) {
+  mpz_swap(rv, p->c[i]);
+  p->cur--;
+  mpz_swap(p->c[i], p->c[p->cur]);
+  mpz_clear(p->c[p->cur]);
+  p->side[i] = p->side[p->cur];
+  p->effort[i] = p->effort[p->cur];
+}
+static void destroy_cpool(cpool_t* p) {
+  while (p->cur > 0)
+    mpz_clear(p->c[--(p->cur)]);
+  Safefree(p->c);
+  Safefree(p->side);
+  Safefree(p->effort);
+  p->c = 0;
+}
+
 static void factor_out(mpz_t R, mpz_t F, mpz_t v) {
   int ndiv = mpz_remove(R, R, v);
   while (ndiv-- > 0)
@@ -241,13 +282,22 @@ static void factor_out_ui(mpz_t R, mpz_t F, unsigned long v) {
   }
 }
 
-static void factor_test_ui(unsigned long f, mpz_t R, mpz_t F, fstack_t* s) {
-  if (mpz_divisible_ui_p(R, f)) {
-    push_fstack_ui(s, f);
-    factor_out_ui(R, F, f);
+/* F*R = n, F is factored part, R is remainder.  Every prime below B1 that
+ * divides R is moved to F with its full power, and pushed on s if given.  The
+ * primes come from the cached product trees, where a gcd with R rules out a
+ * whole range of them at once. */
+static void small_factor(mpz_t F, mpz_t R, UV B1, fstack_t* s)
+{
+  UV i, np, *plist;
+  np = prime_tree_divisors(R, 2, B1-1, &plist);
+  for (i = 0; i < np; i++) {
+    if (s) push_fstack_ui(s, plist[i]);
+    factor_out_ui(R, F, plist[i]);
   }
+  Safefree(plist);
 }
 
+
 typedef int (*bls_func_t)(mpz_t, int, char**);
 typedef int (*limit_func_t)(mpz_t, mpz_t, mpz_t, UV, mpz_t,mpz_t,mpz_t,mpz_t);
 
@@ -654,15 +704,7 @@ int _GMP_primality_bls_nm1(mpz_t n, int effort, char** prooftextptr)
   mpz_init(r);
   mpz_init(s);
 
-  { /* Pull small factors out */
-    PRIME_ITERATOR(iter);
-    UV tf;
-    for (tf = 2; tf < B1; tf = prime_iterator_next(&iter)) {
-      if (mpz_cmp_ui(B, tf*tf) < 0) break;
-      factor_test_ui(tf, B, A, &fstack);
-    }
-    prime_iterator_destroy(&iter);
-  }
+  small_factor(A, B, B1, &fstack);
 
   if (success && mpz_cmp_ui(B,1) > 0) {
     mpz_set(f, B);
@@ -807,15 +849,7 @@ int _GMP_primality_bls_np1(mpz_t n, int effort, char** prooftextptr)
   mpz_init(r);
   mpz_init(s);
 
-  { /* Pull small factors out */
-    PRIME_ITERATOR(iter);
-    UV tf;
-    for (tf = 2; tf < B2; tf = prime_iterator_next(&iter)) {
-      if (mpz_cmp_ui(R2, tf*tf) < 0) break;
-      factor_test_ui(tf, R2, F2, &fstack);
-    }
-    prime_iterator_destroy(&iter);
-  }
+  small_factor(F2, R2, B2, &fstack);
 
   /* printf("trial  np1: %lu bits, %lu bits factored\n", mpz_sizeinbase(np1,2), mpz_sizeinbase(F2,2)); */
 
@@ -916,10 +950,10 @@ int _GMP_primality_bls_np1(mpz_t n, int effort, char** prooftextptr)
 int bls75_hybrid(mpz_t n, int effort, char** prooftextptr)
 {
   mpz_t nm1, np1, F1, F2, R1, R2;
-  mpz_t r, s, t, u, f, c1, c2;
+  mpz_t r, s, t, u, f;
   /* fstack:  definite prime factors
    * pstack:  probable prime factors   product of fstack and pstack = F
-   * mstack:  composite remainders     product of mstack = R
+   * mstack:  composite remainders     product of mstack and pool = R
    */
   FACTOR_STACK(f1stack);
   FACTOR_STACK(f2stack);
@@ -927,7 +961,8 @@ int bls75_hybrid(mpz_t n, int effort, char** prooftextptr)
   FACTOR_STACK(p2stack);
   FACTOR_STACK(m1stack);
   FACTOR_STACK(m2stack);
-  int pcount, e, success = 1;
+  COMPOSITE_POOL(pool);
+  int pcount, success = 1;
   int low_effort = (effort < 1) ? 0 : 1;
   UV B1 = (effort < 2 && mpz_sizeinbase(n,2) < 160) ?  6000 :
           (mpz_sizeinbase(n,2) < 1024)              ? 20000 : 200000;
@@ -949,21 +984,10 @@ int bls75_hybrid(mpz_t n, int effort, char** prooftextptr)
   mpz_init(s);
   mpz_init(u);
   mpz_init(t);
-  mpz_init(f); mpz_init(c1); mpz_init(c2);
+  mpz_init(f);
 
-  { /* Pull small factors out */
-    PRIME_ITERATOR(iter);
-    UV tf;
-    for (tf = 2; tf < B1; tf = prime_iterator_next(&iter)) {
-      /* Page 635 of BLS75 describes an optimization for divisibility
-       * testing.  It seems slower than just doing two UI div tests. */
-      if (mpz_cmp_ui(R1, tf*tf) >= 0)
-        factor_test_ui(tf, R1, F1, &f1stack);
-      if (mpz_cmp_ui(R2, tf*tf) >= 0)
-        factor_test_ui(tf, R2, F2, &f2stack);
-    }
-    prime_iterator_destroy(&iter);
-  }
+  small_factor(F1, R1, B1, &f1stack);
+  small_factor(F2, R2, B1, &f2stack);
 
 #if PRINT_PCT
   trial_pct = (100.0 * (mpz_sizeinbase(F1,2) + mpz_sizeinbase(F2,2))) / (mpz_sizeinbase(nm1,2) + mpz_sizeinbase(np1,2));
@@ -990,7 +1014,7 @@ int bls75_hybrid(mpz_t n, int effort, char** prooftextptr)
 #endif
 
   while (1) {
-    int d1, d2;
+    int i, side = 0;
 
     success = 1;
     if ( bls_theorem7_limit(n, F1, R1, B1, t, u, r, s) ||
@@ -998,40 +1022,28 @@ int bls75_hybrid(mpz_t n, int effort, char** prooftextptr)
          bls_theorem20_limit(n, R1, F1, F2, B1, m, t, u, r, s) )
       break;
 
+    /* Either side may finish the proof, so rather than work through one
+     * composite at every effort, always run the cheapest attempt left. */
     success = 0;
-    mpz_set_ui(c1, 0);
-    mpz_set_ui(c2, 0);
-    d1 = nstack(&m1stack) > 0;
-    d2 = nstack(&m2stack) > 0;
-    if (!d1 && !d2) break;
-
-    if (d1) pop_fstack(c1, &m1stack);
-    if (d2) pop_fstack(c2, &m2stack);
-    for (e = 0; !success && e <= effort; e++) {
-      if (d1 && tfe(f, c1, e)) {
-        if (d2) push_fstack(&m2stack, c2);
-        mpz_set(u, c1);
-        success = 1;
-      } else if (d2 && tfe(f, c2, e)) {
-        if (d1) push_fstack(&m1stack, c1);
-        mpz_set(u, c2);
-        success = 2;
+    cpool_take(&pool, &m1stack, 1);
+    cpool_take(&pool, &m2stack, 2);
+    while (!success && pool.cur > 0) {
+      i = cpool_next(&pool);
+      success = tfe(f, pool.c[i], pool.effort[i]);
+      if (success || ++pool.effort[i] > effort) {
+        side = pool.side[i];
+        cpool_remove(u, &pool, i);   /* Split, or out of effort */
       }
     }
+    if (!success) break;
 
-    /* No success for this set of composites.  Move on. */
-    if (!success) continue;
-
-    if (success == 1) {
-      mpz_divexact(u, u, f);
-      if (mpz_cmp(u, f) < 0)
-        mpz_swap(u, f);
+    mpz_divexact(u, u, f);
+    if (mpz_cmp(u, f) < 0)
+      mpz_swap(u, f);
+    if (side == 1) {
       handle_factor2(f, R1, F1, &f1stack, &p1stack, &m1stack, low_effort, prooftextptr, &bls75_hybrid);
       handle_factor2(u, R1, F1, &f1stack, &p1stack, &m1stack, low_effort, prooftextptr, &bls75_hybrid);
-    } else if (success == 2) {
-      mpz_divexact(u, u, f);
-      if (mpz_cmp(u, f) < 0)
-        mpz_swap(u, f);
+    } else {
       handle_factor2(f, R2, F2, &f2stack, &p2stack, &m2stack, low_effort, prooftextptr, &bls75_hybrid);
       handle_factor2(u, R2, F2, &f2stack, &p2stack, &m2stack, low_effort, prooftextptr, &bls75_hybrid);
     }
@@ -1195,6 +1207,7 @@ end_hybrid:
   destroy_fstack(&p2stack);
   destroy_fstack(&m1stack);
   destroy_fstack(&m2stack);
+  destroy_cpool(&pool);
   mpz_clear(nm1); mpz_clear(np1);
   mpz_clear(F1);  mpz_clear(F2);
   mpz_clear(R1);  mpz_clear(R2);
@@ -1202,7 +1215,7 @@ end_hybrid:
   mpz_clear(s);
   mpz_clear(u);
   mpz_clear(t);
-  mpz_clear(f); mpz_clear(c1); mpz_clear(c2);
+  mpz_clear(f);
   if (success < 0) return 0;
   if (success > 0) return 2;
   return 1;
@@ -1347,7 +1360,7 @@ int _GMP_primality_bls_np1_split(mpz_t n, int effort, mpz_t q, IV* lp, IV* lq)
   mpz_set(q, np1);
   mpz_sqrt(sqrtn, n);
 
-  small_factor(m, q, B1);
+  small_factor(m, q, B1, 0);
 
   while (success) {
     success = 0;
@@ -1396,7 +1409,7 @@ int _GMP_primality_bls_nm1_split(mpz_t n, int effort, mpz_t p, UV *reta)
   mpz_set(p, nm1);
   mpz_sqrt(sqrtn, n);
 
-  small_factor(m, p, B1);
+  small_factor(m, p, B1, 0);
 
   while (success) {
     success = 0;
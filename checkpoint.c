@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <string.h>
+#include <gmp.h>
+
+#include "ptypes.h"
+#include "checkpoint.h"
+#include "factor.h"
+#include "ecm.h"
+
+/* GMP-ECM uses the same modulus for its checksums */
+#define CHKSUM_MOD  4294967291UL
+
+void factor_save_init(factor_save_t* s, int method, mpz_t n, mpz_t param)
+{
+  s->method = method;
+  s->B1 = 0;
+  mpz_init_set(s->n, n);
+  mpz_init_set(s->param, param);
+  mpz_init_set(s->x, param);
+  mpz_init_set_ui(s->z, 1);
+}
+
+void factor_save_clear(factor_save_t* s)
+{
+  mpz_clear(s->n);
+  mpz_clear(s->param);
+  mpz_clear(s->x);
+  mpz_clear(s->z);
+}
+
+static unsigned long checksum(const factor_save_t* s)
+{
+  mpz_t c;
+  unsigned long r;
+  mpz_init_set_ui(c, (unsigned long)(s->B1 % CHKSUM_MOD));
+  mpz_mul_ui(c, c, mpz_fdiv_ui(s->param, CHKSUM_MOD));
+  mpz_mul_ui(c, c, mpz_fdiv_ui(s->n, CHKSUM_MOD));
+  mpz_mul_ui(c, c, mpz_fdiv_ui(s->x, CHKSUM_MOD));
+  mpz_mul_ui(c, c, mpz_fdiv_ui(s->z, CHKSUM_MOD));
+  r = mpz_fdiv_ui(c, CHKSUM_MOD);
+  mpz_clear(c);
+  return r;
+}
+
+char* factor_save_string(const factor_save_t* s)
+{
+  char *str, *p;
+  size_t len = 200 + mpz_sizeinbase(s->n, 10) + mpz_sizeinbase(s->param, 10)
+             + mpz_sizeinbase(s->x, 16) + mpz_sizeinbase(s->z, 16);
+
+  New(0, str, len, char);
+  p = str;
+  if (s->method == FACTOR_ECM)
+    p += gmp_sprintf(p, "METHOD=ECM; PARAM=0; SIGMA=%Zd; ", s->param);
+  else
+    p += gmp_sprintf(p, "METHOD=P-1; ");
+  p += gmp_sprintf(p, "B1=%lu; N=%Zd; X=%#Zx; ", (unsigned long)s->B1, s->n, s->x);
+  if (s->method == FACTOR_ECM && mpz_cmp_ui(s->z, 1) != 0)
+    p += gmp_sprintf(p, "Z=%#Zx; ", s->z);
+  if (s->method != FACTOR_ECM)
+    p += gmp_sprintf(p, "X0=%#Zx; ", s->param);
+  p += sprintf(p, "CHECKSUM=%lu; PROGRAM=Math::Prime::Util::GMP;", checksum(s));
+  return str;
+}
+
+/* Find "key=" as a whole field and return its value, up to the next ';' */
+static const char* field(const char* line, const char* key, size_t* vlen)
+{
+  size_t klen = strlen(key);
+  const char* p = line;
+  while (*p != '\0') {
+    while (*p == ' ' || *p == ';') p++;
+    if (strncmp(p, key, klen) == 0 && p[klen] == '=') {
+      p += klen + 1;
+      *vlen = strcspn(p, ";");
+      while (*vlen > 0 && p[*vlen-1] == ' ') (*vlen)--;
+      return p;
+    }
+    p += strcspn(p, ";");
+  }
+  return 0;
+}
+
+/* Parse the field as a non-negative integer, decimal or 0x hex */
+static int field_mpz(mpz_t r, const char* line, const char* key)
+{
+  size_t vlen;
+  const char* v = field(line, key, &vlen);
+  char* buf;
+  int ok;
+  if (v == 0 || vlen == 0 || *v == '-') return 0;
+  New(0, buf, vlen+1, char);
+  memcpy(buf, v, vlen);
+  buf[vlen] = '\0';
+  ok = (mpz_set_str(r, buf, 0) == 0);
+  Safefree(buf);
+  return ok;
+}
+
+int factor_save_parse(factor_save_t* s, const char* line)
+{
+  size_t vlen;
+  const char* method = field(line, "METHOD", &vlen);
+  mpz_t t;
+  int ok;
+
+  if (method == 0) return 0;
+  if      (vlen == 3 && !strncmp(method, "ECM", 3))  s->method = FACTOR_ECM;
+  else if (vlen == 3 && !strncmp(method, "P-1", 3))  s->method = FACTOR_PMINUS1;
+  else return 0;
+
+  mpz_init(s->n);  mpz_init(s->param);  mpz_init(s->x);  mpz_init_set_ui(s->z, 1);
+  mpz_init(t);
+  ok = field_mpz(s->n, line, "N") && mpz_cmp_ui(s->n, 1) > 0
+    && field_mpz(s->x, line, "X")
+    && field_mpz(t, line, "B1") && mpz_fits_ulong_p(t);
+  s->B1 = ok ? mpz_get_ui(t) : 0;
+  if (ok && s->method == FACTOR_ECM) {
+    ok = field_mpz(s->param, line, "SIGMA")
+      && (!field(line, "PARAM", &vlen) || (field_mpz(t, line, "PARAM") && mpz_sgn(t) == 0));
+    if (ok && field(line, "Z", &vlen))
+      ok = field_mpz(s->z, line, "Z");
+  } else if (ok) {
+    ok = field_mpz(s->param, line, "X0");
+  }
+  /* Every line we and GMP-ECM write has one */
+  if (ok)
+    ok = field_mpz(t, line, "CHECKSUM") && mpz_cmp_ui(t, checksum(s)) == 0;
+  mpz_clear(t);
+  if (!ok)
+    factor_save_clear(s);
+  return ok;
+}
+
+int factor_save_run(factor_save_t* s, mpz_t f, UV B1, UV B2)
+{
+  int found;
+  if (B1 < s->B1) B1 = s->B1;
+  if (s->method == FACTOR_ECM)
+    found = _GMP_ecm_resume(s->n, f, s->param, s->x, s->z, s->B1, B1, B2);
+  else
+    found = _GMP_pminus1_resume(s->n, f, s->x, s->B1, B1, B2);
+  if (found >= 0)
+    s->B1 = B1;
+  return found;
+}
@@ -0,0 +1,41 @@
+#ifndef MPU_CHECKPOINT_H
+#define MPU_CHECKPOINT_H
+
+#include <gmp.h>
+#include "ptypes.h"
+
+/* A p-1 or ECM run that can be saved as a line of text and continued with
+ * larger bounds.  The lines look like GMP-ECM save files:
+ *
+ *   METHOD=P-1; B1=...; N=...; X=0x...; X0=0x...; CHECKSUM=...; PROGRAM=...;
+ *   METHOD=ECM; PARAM=0; SIGMA=...; B1=...; N=...; X=0x...; CHECKSUM=...; ...
+ *
+ * ECM always uses Suyama's curves (GMP-ECM's parameterization 0), as only
+ * x of the point is kept.  A Z field follows X in the rare case that the
+ * point could not be normalized, which means Z shares a factor with N. */
+typedef struct {
+  int   method;       /* FACTOR_PMINUS1 or FACTOR_ECM */
+  UV    B1;           /* stage 1 is done to here, 0 if not started */
+  mpz_t n;
+  mpz_t x, z;         /* p-1: the residue x0^E(B1) in x.  ECM: the point. */
+  mpz_t param;        /* p-1: x0.  ECM: sigma. */
+} factor_save_t;
+
+/* A new run with stage 1 not started */
+extern void factor_save_init(factor_save_t* s, int method, mpz_t n, mpz_t param);
+extern void factor_save_clear(factor_save_t* s);
+
+/* Initializes s from a save line.  Returns 0 if the line is not one we
+ * wrote, or its checksum is missing or wrong, and s is then not
+ * initialized. */
+extern int factor_save_parse(factor_save_t* s, const char* line);
+
+/* The save line, allocated with New.  The caller must Safefree it. */
+extern char* factor_save_string(const factor_save_t* s);
+
+/* Run stage 1 on to B1 (nothing if it is already there), then stage 2 to
+ * B2 if B2 > B1.  Returns 1 with a factor in f, 0 if none was found, or -1
+ * if an ECM sigma gives no curve mod n. */
+extern int factor_save_run(factor_save_t* s, mpz_t f, UV B1, UV B2);
+
+#endif
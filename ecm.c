@@ -9,6 +9,7 @@
 #include "ecm.h"
 #include "utility.h"
 #include "prime_iterator.h"
+#include "prac.h"
 
 #define USE_PRAC
 
@@ -160,54 +161,137 @@ int ec_affine_multiply(mpz_t a, mpz_t k, mpz_t n, struct ec_affine_point P, stru
   return found;
 }
 
+/* Affine curves run side by side.  Every curve multiplies by the same k, so
+ * each ladder step is the same operation on all of them, and one batched
+ * inversion serves the whole step. */
+typedef struct {
+  UV    nc;                    /* curves still running */
+  mpz_t *a, *x, *y, *px, *py;  /* curve, current point, and the base point */
+  mpz_t *d, *c;                /* denominators, inversion temporaries */
+  mpz_t m, t;
+} ec_affine_batch_t;
+
+static void ec_affine_batch_drop(ec_affine_batch_t* E, UV i)
+{
+  UV l = --E->nc;
+  mpz_swap(E->a[i], E->a[l]);    mpz_swap(E->d[i], E->d[l]);
+  mpz_swap(E->x[i], E->x[l]);    mpz_swap(E->y[i], E->y[l]);
+  mpz_swap(E->px[i], E->px[l]);  mpz_swap(E->py[i], E->py[l]);
+}
+
+/* Double every point, or add its base point.  Returns 1 with the factor in
+ * f if an inversion failed.  A curve whose point reached the identity mod n
+ * is dropped, as it is of no further use. */
+static int ec_affine_batch_step(ec_affine_batch_t* E, int add, mpz_t n, mpz_t f)
+{
+  UV i;
+
+  for (i = 0; i < E->nc; i++) {
+    if (add)  mpz_sub(E->d[i], E->px[i], E->x[i]);
+    else      mpz_mul_2exp(E->d[i], E->y[i], 1);
+    mpz_mod(E->d[i], E->d[i], n);
+  }
+  while (!mpz_invert_batch(E->d, E->d, E->nc, n, E->c, f)) {
+    if (mpz_cmp(f, n) != 0)
+      return 1;
+    for (i = 0; i < E->nc; ) {
+      if (mpz_sgn(E->d[i]) == 0)  ec_affine_batch_drop(E, i);
+      else                        i++;
+    }
+  }
+  for (i = 0; i < E->nc; i++) {
+    mpz_t *x = &E->x[i], *y = &E->y[i];
+    if (add) {
+      /* m = (py - y) / (px - x),  x' = m^2 - x - px */
+      mpz_sub(E->t, E->py[i], *y);
+      mpz_mulmod(E->m, E->t, E->d[i], n, E->t);
+      mpz_mul(E->t, E->m, E->m);
+      mpz_sub(E->t, E->t, *x);
+      mpz_sub(E->t, E->t, E->px[i]);
+    } else {
+      /* m = (3x^2 + a) / 2y,  x' = m^2 - 2x */
+      mpz_mul(E->t, *x, *x);
+      mpz_mul_ui(E->t, E->t, 3);
+      mpz_add(E->t, E->t, E->a[i]);
+      mpz_mulmod(E->m, E->t, E->d[i], n, E->t);
+      mpz_mul(E->t, E->m, E->m);
+      mpz_submul_ui(E->t, *x, 2);
+    }
+    mpz_mod(E->t, E->t, n);
+    /* y' = m(x - x') - y */
+    mpz_sub(*x, *x, E->t);
+    mpz_mul(*x, *x, E->m);
+    mpz_sub(*y, *x, *y);
+    mpz_mod(*y, *y, n);
+    mpz_swap(*x, E->t);
+  }
+  return 0;
+}
+
 int _GMP_ecm_factor_affine(mpz_t n, mpz_t f, UV B1, UV ncurves)
 {
-  mpz_t a, mk;
-  struct ec_affine_point X, Y;
-  UV B, curve, q;
-  gmp_randstate_t* p_randstate = get_randstate();
+  ec_affine_batch_t E;
+  UV B, i, q, k, bit;
+  int found = 0;
+  gmp_randstate_t rand;
 
   TEST_FOR_2357(n, f);
+  if (ncurves == 0) return 0;
+  /* A private state, so factor() may run this on a worker thread */
+  gmp_randinit_default(rand);
+  gmp_randseed_ui(rand, get_random_seed());
+
+  CNew(E.a, ncurves, mpz_t);   CNew(E.x, ncurves, mpz_t);
+  CNew(E.y, ncurves, mpz_t);   CNew(E.px, ncurves, mpz_t);
+  CNew(E.py, ncurves, mpz_t);  CNew(E.d, ncurves, mpz_t);
+  CNew(E.c, ncurves, mpz_t);
+  if (E.a == 0 || E.x == 0 || E.y == 0 || E.px == 0 ||
+      E.py == 0 || E.d == 0 || E.c == 0)
+    ncurves = 0;               /* Out of memory:  run no curves */
+  for (i = 0; i < ncurves; i++) {
+    mpz_init(E.a[i]);   mpz_init(E.x[i]);   mpz_init(E.y[i]);
+    mpz_init(E.px[i]);  mpz_init(E.py[i]);  mpz_init(E.d[i]);
+    mpz_init(E.c[i]);
+  }
+  mpz_init(E.m);  mpz_init(E.t);
 
-  mpz_init(a);   mpz_init(mk);
-  mpz_init(X.x); mpz_init(X.y);
-  mpz_init(Y.x); mpz_init(Y.y);
-
-  for (B = 100; B < B1*5; B *= 5) {
+  for (B = 100; !found && ncurves > 0 && B < B1*5; B *= 5) {
+    PRIME_ITERATOR(iter);
     if (B*5 > 2*B1) B = B1;
-    for (curve = 0; curve < ncurves; curve++) {
-      PRIME_ITERATOR(iter);
-      mpz_urandomm(a, *p_randstate, n);
-      mpz_set_ui(X.x, 0); mpz_set_ui(X.y, 1);
-      for (q = 2; q < B; q = prime_iterator_next(&iter)) {
-        UV k = q;
-        UV kmin = B / q;
-
-        while (k <= kmin)
-          k *= q;
-
-        mpz_set_ui(mk, k);
-        if (ec_affine_multiply(a, mk, n, X, &Y, f)) {
-          prime_iterator_destroy(&iter);
-          mpz_clear(a);
-          mpz_clear(X.x); mpz_clear(X.y);
-          mpz_clear(Y.x); mpz_clear(Y.y);
-          return 1;
-        }
-        mpz_set(X.x, Y.x);  mpz_set(X.y, Y.y);
-        /* Check that we're not starting over */
-        if ( !mpz_cmp_ui(X.x, 0) && !mpz_cmp_ui(X.y, 1) )
-          break;
+    if (effort_spend(16*B*ncurves)) break;
+    /* y^2 = x^3 + ax + 1 through (0,1) */
+    E.nc = ncurves;
+    for (i = 0; i < E.nc; i++) {
+      mpz_urandomm(E.a[i], rand, n);
+      mpz_set_ui(E.x[i], 0);
+      mpz_set_ui(E.y[i], 1);
+    }
+    for (q = 2; !found && E.nc > 0 && q < B; q = prime_iterator_next(&iter)) {
+      for (k = q; k <= B/q; k *= q) ;
+      for (i = 0; i < E.nc; i++) {
+        mpz_set(E.px[i], E.x[i]);
+        mpz_set(E.py[i], E.y[i]);
+      }
+      for (bit = 1; bit <= k/2; bit <<= 1) ;
+      for (bit >>= 1; !found && bit > 0; bit >>= 1) {
+        found = ec_affine_batch_step(&E, 0, n, f);
+        if (!found && (k & bit))
+          found = ec_affine_batch_step(&E, 1, n, f);
       }
-      prime_iterator_destroy(&iter);
     }
+    prime_iterator_destroy(&iter);
   }
 
-  mpz_clear(a);   mpz_clear(mk);
-  mpz_clear(X.x); mpz_clear(X.y);
-  mpz_clear(Y.x); mpz_clear(Y.y);
-
-  return 0;
+  for (i = 0; i < ncurves; i++) {
+    mpz_clear(E.a[i]);   mpz_clear(E.x[i]);   mpz_clear(E.y[i]);
+    mpz_clear(E.px[i]);  mpz_clear(E.py[i]);  mpz_clear(E.d[i]);
+    mpz_clear(E.c[i]);
+  }
+  CFree(E.a);   CFree(E.x);   CFree(E.y);   CFree(E.px);
+  CFree(E.py);  CFree(E.d);   CFree(E.c);
+  mpz_clear(E.m);  mpz_clear(E.t);
+  gmp_randclear(rand);
+  return found;
 }
 
 
@@ -220,77 +304,116 @@ int _GMP_ecm_factor_affine(mpz_t n, mpz_t f, UV B1, UV ncurves)
  * other articles.
  */
 
-static mpz_t b, ecn;          /* used throughout ec mult */
-static mpz_t u, v, w;         /* temporaries */
-static mpz_t x1, z1, x2, z2;  /* used by ec_mult and stage2 */
-
-#define mpz_mulmod(r, a, b, n, t)  \
-  do { mpz_mul(t, a, b); mpz_mod(r, t, n); } while (0)
-
-/* (x2:z2) = (x1:z1) + (x2:z2) */
-static void ec_add(mpz_t x2, mpz_t z2, mpz_t x1, mpz_t z1, mpz_t xinit)
+#define ED_W      6                  /* NAF width */
+#define ED_TABLE  (1 << (ED_W-2))    /* P, 3P, ..., (2^(w-1)-1)P */
+#define ED_CHUNK  16384              /* bits of the stage 1 product at once */
+
+typedef struct { mpz_t X, Y, Z, T; } ed_point_t;
+
+/* Everything a call works on, passed to each helper so that separate
+ * calls can run at the same time in different threads. */
+typedef struct {
+  mpz_t n;                    /* the number being factored */
+  mpz_t b;                    /* (A+2)/4 of the Montgomery curve */
+  mpz_t u, v, w;              /* temporaries */
+  mpz_t x1, z1, x2, z2;       /* used by ec_mult and stage2 */
+  mpz_t x3, z3, x4, z4;       /* used by prac */
+  gmp_randstate_t rand;       /* curve choices */
+  int   edwards;
+  mpz_t d;                    /* Edwards curve parameter */
+  mpz_t t[5];                 /* Edwards temporaries */
+  ed_point_t tab[ED_TABLE];   /* affine (x, y, 1, dxy) once built */
+  mpz_t tz[ED_TABLE], tc[ED_TABLE];
+} ecm_ctx_t;
+
+static void ecm_ctx_init(ecm_ctx_t* ctx, mpz_t n, int edwards)
 {
-  mpz_sub(u, x2, z2);
-  mpz_add(v, x1, z1);
-  mpz_mulmod(u, u, v, ecn, w);   /* u = (x2 - z2) * (x1 + z1) % n */
-
-  mpz_add(v, x2, z2);
-  mpz_sub(w, x1, z1);
-  mpz_mulmod(v, v, w, ecn, x2);  /* v = (x2 + z2) * (x1 - z1) % n */
-
-  mpz_add(w, u, v);
-  mpz_mulmod(x2, w, w, ecn, z2); /* x2 = (u+v)^2 % n */
-
-  mpz_sub(w, u, v);
-  mpz_mulmod(z2, w, w, ecn, v);  /* z2 = (u-v)^2 % n */
+  int i;
+  mpz_init_set(ctx->n, n);
+  mpz_init(ctx->b);
+  mpz_init(ctx->u);   mpz_init(ctx->v);   mpz_init(ctx->w);
+  mpz_init(ctx->x1);  mpz_init(ctx->z1);  mpz_init(ctx->x2);  mpz_init(ctx->z2);
+  mpz_init(ctx->x3);  mpz_init(ctx->z3);  mpz_init(ctx->x4);  mpz_init(ctx->z4);
+  /* One draw from the shared state seeds a private one */
+  gmp_randinit_default(ctx->rand);
+  gmp_randseed_ui(ctx->rand, get_random_seed());
+  ctx->edwards = edwards;
+  if (edwards) {
+    mpz_init(ctx->d);
+    for (i = 0; i < 5; i++)  mpz_init(ctx->t[i]);
+    for (i = 0; i < ED_TABLE; i++) {
+      mpz_init(ctx->tab[i].X);  mpz_init(ctx->tab[i].Y);
+      mpz_init(ctx->tab[i].Z);  mpz_init(ctx->tab[i].T);
+      mpz_init(ctx->tz[i]);     mpz_init(ctx->tc[i]);
+    }
+  }
+}
 
-  mpz_mulmod(z2, xinit, z2, ecn, v); /* z2 *= X1. */
-  /* Per Montgomery 1987, we set Z1 to 1, so no need for x2 *= Z1 */
-  /* 5 mulmods, 6 adds */
+static void ecm_ctx_clear(ecm_ctx_t* ctx)
+{
+  int i;
+  mpz_clear(ctx->n);
+  mpz_clear(ctx->b);
+  mpz_clear(ctx->u);   mpz_clear(ctx->v);   mpz_clear(ctx->w);
+  mpz_clear(ctx->x1);  mpz_clear(ctx->z1);  mpz_clear(ctx->x2);  mpz_clear(ctx->z2);
+  mpz_clear(ctx->x3);  mpz_clear(ctx->z3);  mpz_clear(ctx->x4);  mpz_clear(ctx->z4);
+  gmp_randclear(ctx->rand);
+  if (ctx->edwards) {
+    mpz_clear(ctx->d);
+    for (i = 0; i < 5; i++)  mpz_clear(ctx->t[i]);
+    for (i = 0; i < ED_TABLE; i++) {
+      mpz_clear(ctx->tab[i].X);  mpz_clear(ctx->tab[i].Y);
+      mpz_clear(ctx->tab[i].Z);  mpz_clear(ctx->tab[i].T);
+      mpz_clear(ctx->tz[i]);     mpz_clear(ctx->tc[i]);
+    }
+  }
 }
 
+#define mpz_mulmod(r, a, b, n, t)  \
+  do { mpz_mul(t, a, b); mpz_mod(r, t, n); } while (0)
+
 /* This version assumes no normalization, so uses an extra mulmod. */
 /* (xout:zout) = (x1:z1) + (x2:z2) */
-static void ec_add3(mpz_t xout, mpz_t zout,
+static void ec_add3(ecm_ctx_t* ctx, mpz_t xout, mpz_t zout,
                     mpz_t x1, mpz_t z1,
                     mpz_t x2, mpz_t z2,
                     mpz_t xin, mpz_t zin)
 {
-  mpz_sub(u, x2, z2);
-  mpz_add(v, x1, z1);
-  mpz_mulmod(u, u, v, ecn, w);   /* u = (x2 - z2) * (x1 + z1) % n */
+  mpz_sub(ctx->u, x2, z2);
+  mpz_add(ctx->v, x1, z1);
+  mpz_mulmod(ctx->u, ctx->u, ctx->v, ctx->n, ctx->w);   /* u = (x2 - z2) * (x1 + z1) % n */
 
-  mpz_add(v, x2, z2);
-  mpz_sub(w, x1, z1);
-  mpz_mulmod(v, v, w, ecn, v);   /* v = (x2 + z2) * (x1 - z1) % n */
+  mpz_add(ctx->v, x2, z2);
+  mpz_sub(ctx->w, x1, z1);
+  mpz_mulmod(ctx->v, ctx->v, ctx->w, ctx->n, ctx->v);   /* v = (x2 + z2) * (x1 - z1) % n */
 
-  mpz_add(w, u, v);              /* w = u+v */
-  mpz_sub(v, u, v);              /* v = u-v */
+  mpz_add(ctx->w, ctx->u, ctx->v);              /* w = u+v */
+  mpz_sub(ctx->v, ctx->u, ctx->v);              /* v = u-v */
 
-  mpz_mulmod(w, w, w, ecn, u);   /* w = (u+v)^2 % n */
-  mpz_mulmod(v, v, v, ecn, u);   /* v = (u-v)^2 % n */
+  mpz_mulmod(ctx->w, ctx->w, ctx->w, ctx->n, ctx->u);   /* w = (u+v)^2 % n */
+  mpz_mulmod(ctx->v, ctx->v, ctx->v, ctx->n, ctx->u);   /* v = (u-v)^2 % n */
 
-  mpz_set(u, xin);
-  mpz_mulmod(xout, w, zin, ecn, w);
-  mpz_mulmod(zout, v, u,   ecn, w);
+  mpz_set(ctx->u, xin);
+  mpz_mulmod(xout, ctx->w, zin, ctx->n, ctx->w);
+  mpz_mulmod(zout, ctx->v, ctx->u,   ctx->n, ctx->w);
   /* 6 mulmods, 6 adds */
 }
 
 /* (x2:z2) = 2(x1:z1) */
-static void ec_double(mpz_t x2, mpz_t z2, mpz_t x1, mpz_t z1)
+static void ec_double(ecm_ctx_t* ctx, mpz_t x2, mpz_t z2, mpz_t x1, mpz_t z1)
 {
-  mpz_add(u, x1, z1);
-  mpz_mulmod(u, u, u, ecn, w);   /* u = (x1+z1)^2 % n */
+  mpz_add(ctx->u, x1, z1);
+  mpz_mulmod(ctx->u, ctx->u, ctx->u, ctx->n, ctx->w);   /* u = (x1+z1)^2 % n */
 
-  mpz_sub(v, x1, z1);
-  mpz_mulmod(v, v, v, ecn, w);   /* v = (x1-z1)^2 % n */
+  mpz_sub(ctx->v, x1, z1);
+  mpz_mulmod(ctx->v, ctx->v, ctx->v, ctx->n, ctx->w);   /* v = (x1-z1)^2 % n */
 
-  mpz_mulmod(x2, u, v, ecn, w);  /* x2 = uv % n */
+  mpz_mulmod(x2, ctx->u, ctx->v, ctx->n, ctx->w);  /* x2 = uv % n */
 
-  mpz_sub(w, u, v);              /* w = u-v = 4(x1 * z1) */
-  mpz_mulmod(u, b, w, ecn, z2);
-  mpz_add(u, u, v);              /* u = (v+b*w) mod n */
-  mpz_mulmod(z2, w, u, ecn, v);  /* z2 = (w*u) mod n */
+  mpz_sub(ctx->w, ctx->u, ctx->v);              /* w = u-v = 4(x1 * z1) */
+  mpz_mulmod(ctx->u, ctx->b, ctx->w, ctx->n, z2);
+  mpz_add(ctx->u, ctx->u, ctx->v);              /* u = (v+b*w) mod n */
+  mpz_mulmod(z2, ctx->w, ctx->u, ctx->n, ctx->v);  /* z2 = (w*u) mod n */
   /* 5 mulmods, 4 adds */
 }
 
@@ -300,34 +423,34 @@ static void ec_double(mpz_t x2, mpz_t z2, mpz_t x1, mpz_t z1)
 
 #ifndef USE_PRAC
 
-static void ec_mult(UV k, mpz_t x, mpz_t z)
+static void ec_mult(ecm_ctx_t* ctx, UV k, mpz_t x, mpz_t z)
 {
   int l, r;
 
   r = --k; l = -1; while (r != 1) { r >>= 1; l++; }
   if (k & ( UVCONST(1)<<l)) {
-    ec_double(x2, z2, x, z);
-    ec_add3(x1, z1, x2, z2, x, z, x, z);
-    ec_double(x2, z2, x2, z2);
+    ec_double(ctx, ctx->x2, ctx->z2, x, z);
+    ec_add3(ctx, ctx->x1, ctx->z1, ctx->x2, ctx->z2, x, z, x, z);
+    ec_double(ctx, ctx->x2, ctx->z2, ctx->x2, ctx->z2);
   } else {
-    ec_double(x1, z1, x, z);
-    ec_add3(x2, z2, x, z, x1, z1, x, z);
+    ec_double(ctx, ctx->x1, ctx->z1, x, z);
+    ec_add3(ctx, ctx->x2, ctx->z2, x, z, ctx->x1, ctx->z1, x, z);
   }
   l--;
   while (l >= 1) {
     if (k & ( UVCONST(1)<<l)) {
-      ec_add3(x1, z1, x1, z1, x2, z2, x, z);
-      ec_double(x2, z2, x2, z2);
+      ec_add3(ctx, ctx->x1, ctx->z1, ctx->x1, ctx->z1, ctx->x2, ctx->z2, x, z);
+      ec_double(ctx, ctx->x2, ctx->z2, ctx->x2, ctx->z2);
     } else {
-      ec_add3(x2, z2, x2, z2, x1, z1, x, z);
-      ec_double(x1, z1, x1, z1);
+      ec_add3(ctx, ctx->x2, ctx->z2, ctx->x2, ctx->z2, ctx->x1, ctx->z1, x, z);
+      ec_double(ctx, ctx->x1, ctx->z1, ctx->x1, ctx->z1);
     }
     l--;
   }
   if (k & 1) {
-    ec_double(x, z, x2, z2);
+    ec_double(ctx, x, z, ctx->x2, ctx->z2);
   } else {
-    ec_add3(x, z, x2, z2, x1, z1, x, z);
+    ec_add3(ctx, x, z, ctx->x2, ctx->z2, ctx->x1, ctx->z1, x, z);
   }
 }
 
@@ -346,132 +469,81 @@ static void ec_mult(UV k, mpz_t x, mpz_t z)
 
 /* PRAC, details from GMP-ECM, algorithm from Montgomery */
 /* See "20 years of ECM" by Paul Zimmermann for more info */
-static mpz_t x3, z3, x4, z4;  /* used by prac */
-#define ADD 6 /* number of multiplications in an addition */
-#define DUP 5 /* number of multiplications in a double */
-
-/* Returns the number of mulmods */
-static UV lucas_cost(UV n, double val)
-{
-  UV c, d, e, r;
-
-  d = n;
-  r = (UV) ( ((double)d / val) + 0.5 );
-  if (r >=n )
-    return(ADD*n);
-  d = n - r;
-  e = 2 * r - n;
-  c = DUP + ADD;  /* initial double and final add */
-  while (d != e) {
-    if (d < e) { r = d;  d = e;  e = r; }
-    if (4 * d <= 5 * e && ((d + e) % 3) == 0) {
- /*C1*/ d = (2 * d - e) / 3;  e = (e - d) / 2;  c += 3 * ADD; /* 3 adds */
-    } else if (4 * d <= 5 * e && (d - e) % 6 == 0) {
- /*C2*/ d = (d - e) / 2;  c += ADD + DUP; /* one add, one double */
-    } else if (d <= 4 * e) {
- /*C3*/ d -= e;  c += ADD; /* one add */
-    } else if ((d + e) % 2 == 0) {
- /*C4*/ d = (d - e) / 2;  c += ADD + DUP; /* one add, one double */
-    } else if (d % 2 == 0) {
- /*C5*/ d /= 2;  c += ADD + DUP; /* one add, one double */
-    } else if (d % 3 == 0) {
- /*C6*/ d = d / 3 - e;  c += 3 * ADD + DUP; /* three adds, one double */
-    } else if ((d + e) % 3 == 0) {
- /*C7*/ d = (d - 2 * e) / 3;  c += 3 * ADD + DUP; /* three adds, one double */
-    } else if ((d - e) % 3 == 0) {
- /*C8*/ d = (d - e) / 3;  c += 3 * ADD + DUP; /* three adds, one double */
-    } else {
- /*C9*/ e /= 2;  c += ADD + DUP; /* one add, one double */
-    }
-  }
-  return(c);
-}
-
 #define SWAP(a, b) \
   t = x##a; x##a = x##b; x##b = t;  t = z##a; z##a = z##b; z##b = t;
 
 /* PRAC: computes kP from P=(x:z) and puts the result in (x:z). Assumes k>2.*/
-static void ec_mult(UV k, mpz_t x, mpz_t z)
+static void ec_mult(ecm_ctx_t* ctx, UV k, mpz_t x, mpz_t z)
 {
-   unsigned int  d, e, r, i;
+   UV d, e, r;
+   int c;
    __mpz_struct *xA, *zA, *xB, *zB, *xC, *zC, *xT, *zT, *xT2, *zT2, *t;
 
-   static double const val[] =
-     {1.61803398875, 1.72360679775, 1.618347119656, 1.617914406529,
-      1.58017872826};
-
-   /* chooses the best value of val */
-   r = ADD * k;
-   i = 0;
-   for (d = 0; d < 5; d++) {
-     e = lucas_cost(k, val[d]);
-     if (e < r) { r = e;  i = d; }
-   }
-   r = (unsigned int)((double)k / val[i] + 0.5);
+   r = prac_start(k);
    /* A=(x:z) B=(x1:z1) C=(x2:z2) T=T1=(x3:z3) T2=(x4:z4) */
-   xA=x; zA=z; xB=x1; zB=z1; xC=x2; zC=z2; xT=x3; zT=z3; xT2=x4; zT2=z4;
+   xA=x; zA=z; xB=ctx->x1; zB=ctx->z1; xC=ctx->x2; zC=ctx->z2; xT=ctx->x3; zT=ctx->z3; xT2=ctx->x4; zT2=ctx->z4;
    /* first iteration always begins by Condition 3, then a swap */
    d = k - r;
    e = 2 * r - k;
    mpz_set(xB,xA); mpz_set(zB,zA); /* B=A */
    mpz_set(xC,xA); mpz_set(zC,zA); /* C=A */
-   ec_double(xA,zA,xA,zA);         /* A=2*A */
+   ec_double(ctx, xA,zA,xA,zA);         /* A=2*A */
    while (d != e) {
-      if (d < e) {
-         r = d;  d = e;  e = r;
+      c = prac_step(&d, &e);
+      if (c & PRAC_SWAP) {
          SWAP(A,B);
       }
       /* do the first line of Table 4 whose condition qualifies */
-      if (4 * d <= 5 * e && ((d + e) % 3) == 0) { /* condition 1 */
-         d = (2 * d - e) / 3;
-         e = (e - d) / 2;
-         ec_add3(xT,zT,xA,zA,xB,zB,xC,zC);   /* T = f(A,B,C) */
-         ec_add3(xT2,zT2,xT,zT,xA,zA,xB,zB); /* T2= f(T,A,B) */
-         ec_add3(xB,zB,xB,zB,xT,zT,xA,zA);   /* B = f(B,T,A) */
+      switch (c & 15) {
+      case 1:
+         ec_add3(ctx, xT,zT,xA,zA,xB,zB,xC,zC);   /* T = f(A,B,C) */
+         ec_add3(ctx, xT2,zT2,xT,zT,xA,zA,xB,zB); /* T2= f(T,A,B) */
+         ec_add3(ctx, xB,zB,xB,zB,xT,zT,xA,zA);   /* B = f(B,T,A) */
          SWAP(A,T2);
-      } else if (4 * d <= 5 * e && (d - e) % 6 == 0) { /* condition 2 */
-         d = (d - e) / 2;
-         ec_add3(xB,zB,xA,zA,xB,zB,xC,zC);   /* B = f(A,B,C) */
-         ec_double(xA,zA,xA,zA);             /* A = 2*A */
-      } else if (d <= (4 * e)) { /* condition 3 */
-         d -= e;
-         ec_add3(xC,zC,xB,zB,xA,zA,xC,zC);   /* C = f(B,A,C) */
+         break;
+      case 2:
+         ec_add3(ctx, xB,zB,xA,zA,xB,zB,xC,zC);   /* B = f(A,B,C) */
+         ec_double(ctx, xA,zA,xA,zA);             /* A = 2*A */
+         break;
+      case 3:
+         ec_add3(ctx, xC,zC,xB,zB,xA,zA,xC,zC);   /* C = f(B,A,C) */
          SWAP(B,C);
-      } else if ((d + e) % 2 == 0) { /* condition 4 */
-         d = (d - e) / 2;
-         ec_add3(xB,zB,xB,zB,xA,zA,xC,zC);   /* B = f(B,A,C) */
-         ec_double(xA,zA,xA,zA);             /* A = 2*A */
-      } else if (d % 2 == 0) { /* condition 5 */
-         d /= 2;
-         ec_add3(xC,zC,xC,zC,xA,zA,xB,zB);   /* C = f(C,A,B) */
-         ec_double(xA,zA,xA,zA);             /* A = 2*A */
-      } else if (d % 3 == 0) { /* condition 6 */
-         d = d / 3 - e;
-         ec_double(xT,zT,xA,zA);             /* T = 2*A */
-         ec_add3(xT2,zT2,xA,zA,xB,zB,xC,zC); /* T2= f(A,B,C) */
-         ec_add3(xA,zA,xT,zT,xA,zA,xA,zA);   /* A = f(T,A,A) */
-         ec_add3(xC,zC,xT,zT,xT2,zT2,xC,zC); /* C = f(T,T2,C) */
+         break;
+      case 4:
+         ec_add3(ctx, xB,zB,xB,zB,xA,zA,xC,zC);   /* B = f(B,A,C) */
+         ec_double(ctx, xA,zA,xA,zA);             /* A = 2*A */
+         break;
+      case 5:
+         ec_add3(ctx, xC,zC,xC,zC,xA,zA,xB,zB);   /* C = f(C,A,B) */
+         ec_double(ctx, xA,zA,xA,zA);             /* A = 2*A */
+         break;
+      case 6:
+         ec_double(ctx, xT,zT,xA,zA);             /* T = 2*A */
+         ec_add3(ctx, xT2,zT2,xA,zA,xB,zB,xC,zC); /* T2= f(A,B,C) */
+         ec_add3(ctx, xA,zA,xT,zT,xA,zA,xA,zA);   /* A = f(T,A,A) */
+         ec_add3(ctx, xC,zC,xT,zT,xT2,zT2,xC,zC); /* C = f(T,T2,C) */
          SWAP(B,C);
-      } else if ((d + e) % 3 == 0) { /* condition 7 */
-         d = (d - 2 * e) / 3;
-         ec_add3(xT,zT,xA,zA,xB,zB,xC,zC);   /* T = f(A,B,C) */
-         ec_add3(xB,zB,xT,zT,xA,zA,xB,zB);   /* B = f(T1,A,B) */
-         ec_double(xT,zT,xA,zA);
-         ec_add3(xA,zA,xA,zA,xT,zT,xA,zA);   /* A = 3*A */
-      } else if ((d - e) % 3 == 0) { /* condition 8 */
-         d = (d - e) / 3;
-         ec_add3(xT,zT,xA,zA,xB,zB,xC,zC);   /* T = f(A,B,C) */
-         ec_add3(xC,zC,xC,zC,xA,zA,xB,zB);   /* C = f(A,C,B) */
+         break;
+      case 7:
+         ec_add3(ctx, xT,zT,xA,zA,xB,zB,xC,zC);   /* T = f(A,B,C) */
+         ec_add3(ctx, xB,zB,xT,zT,xA,zA,xB,zB);   /* B = f(T1,A,B) */
+         ec_double(ctx, xT,zT,xA,zA);
+         ec_add3(ctx, xA,zA,xA,zA,xT,zT,xA,zA);   /* A = 3*A */
+         break;
+      case 8:
+         ec_add3(ctx, xT,zT,xA,zA,xB,zB,xC,zC);   /* T = f(A,B,C) */
+         ec_add3(ctx, xC,zC,xC,zC,xA,zA,xB,zB);   /* C = f(A,C,B) */
          SWAP(B,T);
-         ec_double(xT,zT,xA,zA);
-         ec_add3(xA,zA,xA,zA,xT,zT,xA,zA);   /* A = 3*A */
-      } else { /* condition 9 */
-         e /= 2;
-         ec_add3(xC,zC,xC,zC,xB,zB,xA,zA);   /* C = f(C,B,A) */
-         ec_double(xB,zB,xB,zB);             /* B = 2*B */
+         ec_double(ctx, xT,zT,xA,zA);
+         ec_add3(ctx, xA,zA,xA,zA,xT,zT,xA,zA);   /* A = 3*A */
+         break;
+      default:
+         ec_add3(ctx, xC,zC,xC,zC,xB,zB,xA,zA);   /* C = f(C,B,A) */
+         ec_double(ctx, xB,zB,xB,zB);             /* B = 2*B */
+         break;
       }
    }
-   ec_add3(xA,zA,xA,zA,xB,zB,xC,zC);
+   ec_add3(ctx, xA,zA,xA,zA,xB,zB,xC,zC);
    if (x!=xA) { mpz_set(x,xA); mpz_set(z,zA); }
 }
 
@@ -484,188 +556,591 @@ static void ec_mult(UV k, mpz_t x, mpz_t z)
     mpz_mulmod(x, x, u, n, v); \
     mpz_set_ui(z, 1);
 
-static int ec_stage2(UV B1, UV B2, mpz_t x, mpz_t z, mpz_t f)
+/* Giant steps made and normalized together */
+#define GIANT_BLOCK 256
+
+/* Scale each (x[i]:z[i]) to z[i] = 1 with a single inversion.  c is nz
+ * temporaries.  On failure f holds the gcd found. */
+static int ec_normalize_batch(ecm_ctx_t* ctx, mpz_t* x, mpz_t* z, UV nz, mpz_t* c, mpz_t f)
 {
-  UV D, i, m;
-  mpz_t* nqx = 0;
+  UV i;
+  if (!mpz_invert_batch(z, z, nz, ctx->n, c, f))
+    return 0;
+  for (i = 0; i < nz; i++) {
+    mpz_mulmod(x[i], x[i], z[i], ctx->n, ctx->w);
+    mpz_set_ui(z[i], 1);
+  }
+  return 1;
+}
+
+static int ec_stage2(ecm_ctx_t* ctx, UV B1, UV B2, mpz_t x, mpz_t z, mpz_t f)
+{
+  UV D, i, m, t, nb, ntmp;
+  mpz_t *nqx = 0, *nqz, *gx, *gz, *tmp;
   mpz_t g, one;
   int found;
   PRIME_ITERATOR(iter);
 
   do {
-    NORMALIZE(f, u, v, x, z, ecn);
+    NORMALIZE(f, ctx->u, ctx->v, x, z, ctx->n);
 
     D = sqrt( (double)B2 / 2.0 );
     if (D%2) D++;
 
-    /* We really only need half of these. Only even values used. */
-    Newz(0, nqx, 2*D+1, mpz_t);
-    mpz_init_set(nqx[1], x);
+    /* We really only need half of these. Only even values used.
+     * Build them all projectively, then normalize with one inversion. */
+    ntmp = (2*D > GIANT_BLOCK) ? 2*D : GIANT_BLOCK;
+    CNew(nqx, 2*D+1, mpz_t);
+    CNew(nqz, 2*D+1, mpz_t);
+    CNew(gx, GIANT_BLOCK+2, mpz_t);
+    CNew(gz, GIANT_BLOCK+2, mpz_t);
+    CNew(tmp, ntmp, mpz_t);
+    if (nqx == 0 || nqz == 0 || gx == 0 || gz == 0 || tmp == 0) {
+      CFree(nqx);  CFree(nqz);  CFree(gx);  CFree(gz);  CFree(tmp);
+      nqx = 0;
+      found = 0;
+      break;
+    }
+    for (i = 1; i <= 2*D; i++) { mpz_init(nqx[i]);  mpz_init(nqz[i]); }
+    for (i = 0; i < GIANT_BLOCK+2; i++) { mpz_init(gx[i]);  mpz_init(gz[i]); }
+    for (i = 0; i < ntmp; i++) mpz_init(tmp[i]);
     mpz_init_set_ui(g, 1);
     mpz_init_set_ui(one, 1);
 
+    mpz_set(nqx[1], x);
+    mpz_set_ui(nqz[1], 1);
     for (i = 2; i <= 2*D; i++) {
-      if (i % 2) {
-        mpz_set(x2, nqx[(i+1)/2]);  mpz_set_ui(z2, 1);
-        ec_add(x2, z2, nqx[(i-1)/2], one, x);
-      } else {
-        ec_double(x2, z2, nqx[i/2], one);
-      }
-      mpz_init_set(nqx[i], x2);
-      NORMALIZE(f, u, v, nqx[i], z2, ecn);
+      if (i % 2)
+        ec_add3(ctx, nqx[i], nqz[i], nqx[(i+1)/2], nqz[(i+1)/2],
+                nqx[(i-1)/2], nqz[(i-1)/2], x, one);
+      else
+        ec_double(ctx, nqx[i], nqz[i], nqx[i/2], nqz[i/2]);
     }
+    found = !ec_normalize_batch(ctx, nqx+2, nqz+2, 2*D-1, tmp, f);
     if (found) break;
 
-    mpz_set(x1, x);
-    mpz_set(z1, z);
-    mpz_set(x, nqx[2*D-1]);
-    mpz_set_ui(z, 1);
+    /* gx[t] is (m-2D(2-t)) Q, starting from (2D-1)Q and Q */
+    mpz_set(gx[0], nqx[2*D-1]);  mpz_set_ui(gz[0], 1);
+    mpz_set(gx[1], x);           mpz_set_ui(gz[1], 1);
 
     /* See Zimmermann, "20 Years of ECM" slides, 2006, page 11-12 */
-    for (m = 1; m < B2+D; m += 2*D) {
-      if (m != 1) {
-        mpz_set(x2, x1);
-        mpz_set(z2, z1);
-        ec_add(x1, z1, nqx[2*D], one, x);
-        NORMALIZE(f, u, v, x1, z1, ecn);
-        mpz_set(x, x2);  mpz_set(z, z2);
-      }
-      if (m+D > B1 && m >= D) {
-        prime_iterator_setprime(&iter, m-D-1);
-        for (i = prime_iterator_next(&iter); i < m; i = prime_iterator_next(&iter)) {
-          /* if (m+D-i<1 || m+D-i>2*D) croak("index %lu range\n",i-(m-D)); */
-          mpz_sub(w, x1, nqx[m+D-i]);
-          mpz_mulmod(g, g, w, ecn, u);
-        }
-        for ( ; i <= m+D; i = prime_iterator_next(&iter)) {
-          if (i > m && !prime_iterator_isprime(&iter, m+m-i)) {
-            /* if (i-m<1 || i-m>2*D) croak("index %lu range\n",i-(m-D)); */
-            mpz_sub(w, x1, nqx[i-m]);
-            mpz_mulmod(g, g, w, ecn, u);
+    for (m = 1; !found && m+2*D < B2+D; ) {
+      for (nb = 0; nb < GIANT_BLOCK && m+2*D*(nb+1) < B2+D; nb++)
+        ec_add3(ctx, gx[nb+2], gz[nb+2], gx[nb+1], gz[nb+1],
+                nqx[2*D], one, gx[nb], gz[nb]);
+      found = !ec_normalize_batch(ctx, gx+2, gz+2, nb, tmp, f);
+      if (found) break;
+      /* Adds and an inversion share, then a mulmod per prime */
+      if (effort_spend(nb * (10 + D/6))) break;
+      for (t = 2; t < nb+2; t++) {
+        m += 2*D;
+        if (m+D > B1 && m >= D) {
+          prime_iterator_setprime(&iter, m-D-1);
+          for (i = prime_iterator_next(&iter); i < m; i = prime_iterator_next(&iter)) {
+            /* if (m+D-i<1 || m+D-i>2*D) croak("index %lu range\n",i-(m-D)); */
+            mpz_sub(ctx->w, gx[t], nqx[m+D-i]);
+            mpz_mulmod(g, g, ctx->w, ctx->n, ctx->u);
+          }
+          for ( ; i <= m+D; i = prime_iterator_next(&iter)) {
+            if (i > m && !prime_iterator_isprime(&iter, m+m-i)) {
+              /* if (i-m<1 || i-m>2*D) croak("index %lu range\n",i-(m-D)); */
+              mpz_sub(ctx->w, gx[t], nqx[i-m]);
+              mpz_mulmod(g, g, ctx->w, ctx->n, ctx->u);
+            }
           }
+          mpz_gcd(f, g, ctx->n);
+          found = mpz_cmp_ui(f, 1);
+          if (found) break;
         }
-        mpz_gcd(f, g, ecn);
-        found = mpz_cmp_ui(f, 1);
-        if (found) break;
       }
+      mpz_swap(gx[0], gx[nb]);    mpz_swap(gz[0], gz[nb]);
+      mpz_swap(gx[1], gx[nb+1]);  mpz_swap(gz[1], gz[nb+1]);
     }
   } while (0);
   prime_iterator_destroy(&iter);
 
   if (nqx != 0) {
-    for (i = 1; i <= 2*D; i++) {
-      if (nqx[i] != 0)
-        mpz_clear(nqx[i]);
-    }
-    Safefree(nqx);
+    for (i = 1; i <= 2*D; i++) { mpz_clear(nqx[i]);  mpz_clear(nqz[i]); }
+    for (i = 0; i < GIANT_BLOCK+2; i++) { mpz_clear(gx[i]);  mpz_clear(gz[i]); }
+    for (i = 0; i < ntmp; i++) mpz_clear(tmp[i]);
+    CFree(nqx);  CFree(nqz);  CFree(gx);  CFree(gz);  CFree(tmp);
     mpz_clear(g);
     mpz_clear(one);
   }
-  if (found && !mpz_cmp(f, ecn)) found = 0;
+  if (found && !mpz_cmp(f, ctx->n)) found = 0;
   return (found) ? 2 : 0;
 }
 
-int _GMP_ecm_factor_projective(mpz_t n, mpz_t f, UV B1, UV B2, UV ncurves)
+/******************************************************************************/
+/* Edwards curves x^2 + y^2 = 1 + d x^2 y^2 in extended coordinates
+ * (X:Y:Z:T) with x = X/Z, y = Y/Z, xy = T/Z.  See "Twisted Edwards Curves
+ * Revisited" by Hisil, Wong, Carter and Dawson, and "ECM using Edwards
+ * curves" by Bernstein, Birkner, Lange and Peters.
+ *
+ * Stage 1 takes the product of the prime powers below B1 in chunks, each
+ * written in width-w NAF and run against a table of odd multiples of the
+ * point in affine form.  That is a doubling (7 mulmods) per bit and a mixed
+ * addition (8 mulmods) every w+1 bits, against about 10 per bit for PRAC on
+ * Montgomery curves.  The curves have rational torsion Z/12, which finds
+ * a few more factors per curve than Suyama's family.  Stage 2 moves the
+ * point to the equivalent Montgomery curve and uses ec_stage2.
+ */
+
+/* R = 2P.  T is only made when ext is set, as an addition comes next. */
+static void ed_double(ecm_ctx_t* ctx, ed_point_t* R, ed_point_t* P, int ext)
 {
-  mpz_t sigma, a, x, z;
-  UV i, curve, q, k;
-  int found = 0;
-  gmp_randstate_t* p_randstate = get_randstate();
-  int _verbose = get_verbose_level();
+  mpz_t *A = ctx->t+0, *B = ctx->t+1, *E = ctx->t+2, *F = ctx->t+3, *G = ctx->t+4;
+  mpz_mulmod(*A, P->X, P->X, ctx->n, ctx->u);
+  mpz_mulmod(*B, P->Y, P->Y, ctx->n, ctx->u);
+  mpz_add(*E, P->X, P->Y);
+  mpz_mulmod(*E, *E, *E, ctx->n, ctx->u);
+  mpz_add(*G, *A, *B);           /* G = A+B */
+  mpz_sub(*E, *E, *G);           /* E = 2XY */
+  mpz_mulmod(*F, P->Z, P->Z, ctx->n, ctx->u);
+  mpz_mul_2exp(*F, *F, 1);
+  mpz_sub(*F, *G, *F);           /* F = G-2Z^2 */
+  mpz_sub(*A, *A, *B);           /* H = A-B */
+  mpz_mulmod(R->X, *E, *F, ctx->n, ctx->u);
+  mpz_mulmod(R->Y, *G, *A, ctx->n, ctx->u);
+  mpz_mulmod(R->Z, *F, *G, ctx->n, ctx->u);
+  if (ext)
+    mpz_mulmod(R->T, *E, *A, ctx->n, ctx->u);
+  /* 7 mulmods (8 with T), 6 adds */
+}
 
-  TEST_FOR_2357(n, f);
+/* R = P + Q, with Q->T holding dxy.  If Q is affine, set zq to skip Z.
+ * The sign s = -1 adds -Q = (-x,y) instead.  T is made when ext is set. */
+static void ed_add(ecm_ctx_t* ctx, ed_point_t* R, ed_point_t* P, ed_point_t* Q, int s, int zq, int ext)
+{
+  mpz_t *A = ctx->t+0, *B = ctx->t+1, *C = ctx->t+2, *E = ctx->t+3, *F = ctx->t+4;
+  mpz_mulmod(*A, P->X, Q->X, ctx->n, ctx->u);
+  mpz_mulmod(*B, P->Y, Q->Y, ctx->n, ctx->u);
+  mpz_mulmod(*C, P->T, Q->T, ctx->n, ctx->u);
+  if (s < 0) {
+    mpz_neg(*A, *A);
+    mpz_neg(*C, *C);
+    mpz_sub(*F, Q->Y, Q->X);
+  } else {
+    mpz_add(*F, Q->X, Q->Y);
+  }
+  mpz_add(*E, P->X, P->Y);
+  mpz_mulmod(*E, *E, *F, ctx->n, ctx->u);
+  mpz_sub(*E, *E, *A);
+  mpz_sub(*E, *E, *B);           /* E = (X1+Y1)(X2+Y2)-A-B */
+  mpz_sub(*B, *B, *A);           /* H = B-A */
+  if (zq) mpz_set(*A, P->Z);
+  else    mpz_mulmod(*A, P->Z, Q->Z, ctx->n, ctx->u);
+  mpz_sub(*F, *A, *C);           /* F = D-C */
+  mpz_add(*C, *A, *C);           /* G = D+C */
+  mpz_mulmod(R->X, *E, *F, ctx->n, ctx->u);
+  mpz_mulmod(R->Y, *C, *B, ctx->n, ctx->u);
+  mpz_mulmod(R->Z, *F, *C, ctx->n, ctx->u);
+  if (ext)
+    mpz_mulmod(R->T, *E, *B, ctx->n, ctx->u);
+  /* 7 mulmods mixed, 9 with both Z and T */
+}
 
-  if (B2 < B1)  B2 = 100*B1;  /* time(S1) == time(S2) ~ 125 */
+/* Fill the table with the odd multiples of P, made affine with one inversion.
+ * P has no T, and is left as 2P.  Returns 0 with the gcd in f on failure. */
+static int ed_make_table(ecm_ctx_t* ctx, ed_point_t* P, mpz_t f)
+{
+  int i;
+  ed_point_t* tab = ctx->tab;
+
+  mpz_mulmod(tab[0].T, P->X, P->Y, ctx->n, ctx->u);
+  mpz_mulmod(tab[0].X, P->X, P->Z, ctx->n, ctx->u);
+  mpz_mulmod(tab[0].Y, P->Y, P->Z, ctx->n, ctx->u);
+  mpz_mulmod(tab[0].Z, P->Z, P->Z, ctx->n, ctx->u);
+  ed_double(ctx, P, tab+0, 1);
+  mpz_mulmod(P->T, P->T, ctx->d, ctx->n, ctx->u);
+  for (i = 1; i < ED_TABLE; i++)
+    ed_add(ctx, tab+i, tab+i-1, P, 1, 0, 1);
+
+  for (i = 0; i < ED_TABLE; i++)
+    mpz_swap(ctx->tz[i], tab[i].Z);
+  if (!mpz_invert_batch(ctx->tz, ctx->tz, ED_TABLE, ctx->n, ctx->tc, f))
+    return 0;
+  for (i = 0; i < ED_TABLE; i++) {
+    mpz_mulmod(tab[i].X, tab[i].X, ctx->tz[i], ctx->n, ctx->u);
+    mpz_mulmod(tab[i].Y, tab[i].Y, ctx->tz[i], ctx->n, ctx->u);
+    mpz_mulmod(tab[i].T, tab[i].T, ctx->tz[i], ctx->n, ctx->u);
+    mpz_mulmod(tab[i].T, tab[i].T, ctx->d, ctx->n, ctx->u);
+    mpz_set_ui(tab[i].Z, 1);
+  }
+  return 1;
+}
 
-  mpz_init_set(ecn, n);
-  mpz_init(x);   mpz_init(z);   mpz_init(a);   mpz_init(b);
-  mpz_init(u);   mpz_init(v);   mpz_init(w);   mpz_init(sigma);
-  mpz_init(x1);  mpz_init(z1);  mpz_init(x2);  mpz_init(z2);
-#ifdef USE_PRAC
-  mpz_init(x3);  mpz_init(z3);  mpz_init(x4);  mpz_init(z4);
-#endif
+/* P = kP, for k > 0.  naf has room for the bits of k plus ED_W+1. */
+static int ed_mult(ecm_ctx_t* ctx, mpz_t k, ed_point_t* P, signed char* naf, mpz_t f)
+{
+  UV bits = mpz_sizeinbase(k, 2), bit, top = 0;
+  int carry = 0, word, j;
+
+  /* Width-w NAF, reading w bits at a time with the carry. */
+  memset(naf, 0, bits + ED_W + 1);
+  for (bit = 0; bit <= bits; ) {
+    if (mpz_tstbit(k, bit) == carry) { bit++; continue; }
+    for (word = 0, j = ED_W-1; j >= 0; j--)
+      word = 2*word + mpz_tstbit(k, bit+j);
+    word += carry;
+    carry = (word >> (ED_W-1)) & 1;
+    word -= carry << ED_W;
+    naf[bit] = word;
+    top = bit;
+    bit += ED_W;
+  }
 
-  if (_verbose>2) gmp_printf("# ecm trying %Zd (B1=%lu B2=%lu ncurves=%lu)\n", n, (unsigned long)B1, (unsigned long)B2, (unsigned long)ncurves);
+  if (!ed_make_table(ctx, P, f))
+    return 1;
+  word = naf[top];
+  mpz_set(P->X, ctx->tab[word/2].X);
+  mpz_set(P->Y, ctx->tab[word/2].Y);
+  mpz_set_ui(P->Z, 1);
+  while (top-- > 0) {
+    word = naf[top];
+    ed_double(ctx, P, P, word != 0);
+    if (word > 0)       ed_add(ctx, P, P, ctx->tab + word/2, 1, 1, 0);
+    else if (word < 0)  ed_add(ctx, P, P, ctx->tab + (-word)/2, -1, 1, 0);
+  }
+  return 0;
+}
 
-  for (curve = 0; curve < ncurves; curve++) {
-    PRIME_ITERATOR(iter);
-    do {
-      mpz_urandomm(sigma, *p_randstate, n);
-    } while (mpz_cmp_ui(sigma, 5) <= 0);
-    mpz_mul_ui(w, sigma, 4);
-    mpz_mod(v, w, n);             /* v = 4σ */
+/* 1/a mod n.  Returns 0 if it exists, 1 with a factor in f, -1 if not. */
+static int ed_invert(ecm_ctx_t* ctx, mpz_t r, mpz_t a, mpz_t f)
+{
+  if (mpz_invert(r, a, ctx->n))
+    return 0;
+  mpz_gcd(f, a, ctx->n);
+  return (mpz_cmp_ui(f, 1) && mpz_cmp(f, ctx->n)) ? 1 : -1;
+}
 
-    mpz_mul(x, sigma, sigma);
-    mpz_sub_ui(w, x, 5);
-    mpz_mod(u, w, n);             /* u = σ^2-5 */
+/* The Z/12 curve from (u,v) = k(-2,4) on v^2 = u^3-12u, k >= 2.  With
+ * t = v/2u, and w = (u^2+12)/4u so that w^2 = t^4+3,
+ *   d = 1 - (t^2-1)^3 (t^2+3) / 16t^2
+ *   P = (4tw / (t^2+1)(t^2+3), (3-t^2) / t^2(t^2+1))
+ * Montgomery's family, in Edwards form as BBLP section 5.  P is left in
+ * extended form without T.  Returns 0, or as ed_invert on failure. */
+static int ed_curve_z12(ecm_ctx_t* ctx, UV k, ed_point_t* P, mpz_t f)
+{
+  mpz_t *X = &P->X, *Y = &P->Y, *Z = &P->Z;
+  mpz_t *a = ctx->t+0, *b = ctx->t+1, *c = ctx->t+2, *e = ctx->t+3, *g = ctx->t+4;
+  int bit, r;
+
+  /* k(-2,4) in Jacobian coordinates, X/Z^2 and Y/Z^3 */
+  mpz_sub_ui(*X, ctx->n, 2);
+  mpz_set_ui(*Y, 4);
+  mpz_set_ui(*Z, 1);
+  for (bit = BITS_PER_WORD-1; !((k >> bit) & 1); bit--) ;
+  while (bit-- > 0) {
+    mpz_mulmod(*a, *X, *X, ctx->n, ctx->u);         /* XX */
+    mpz_mulmod(*b, *Y, *Y, ctx->n, ctx->u);         /* YY */
+    mpz_mulmod(*c, *Z, *Z, ctx->n, ctx->u);
+    mpz_mulmod(*c, *c, *c, ctx->n, ctx->u);         /* Z^4 */
+    mpz_mul_ui(*a, *a, 3);
+    mpz_submul_ui(*a, *c, 12);              /* M = 3XX - 12Z^4 */
+    mpz_mulmod(*Z, *Y, *Z, ctx->n, ctx->u);
+    mpz_mul_2exp(*Z, *Z, 1);                /* Z3 = 2YZ */
+    mpz_mulmod(*e, *X, *b, ctx->n, ctx->u);
+    mpz_mul_2exp(*e, *e, 2);                /* S = 4 X YY */
+    mpz_mulmod(*X, *a, *a, ctx->n, ctx->u);
+    mpz_submul_ui(*X, *e, 2);
+    mpz_mod(*X, *X, ctx->n);                   /* X3 = M^2 - 2S */
+    mpz_sub(*e, *e, *X);
+    mpz_mulmod(*Y, *a, *e, ctx->n, ctx->u);
+    mpz_mulmod(*b, *b, *b, ctx->n, ctx->u);
+    mpz_submul_ui(*Y, *b, 8);
+    mpz_mod(*Y, *Y, ctx->n);                   /* Y3 = M(S-X3) - 8YYYY */
+    if ((k >> bit) & 1) {                   /* add (-2,4) */
+      mpz_mulmod(*a, *Z, *Z, ctx->n, ctx->u);       /* ZZ */
+      mpz_mulmod(*b, *a, *Z, ctx->n, ctx->u);
+      mpz_mul_2exp(*b, *b, 2);
+      mpz_sub(*b, *b, *Y);                  /* r = 4Z^3 - Y */
+      mpz_mul_2exp(*a, *a, 1);
+      mpz_add(*a, *a, *X);
+      mpz_neg(*a, *a);                      /* H = -2ZZ - X */
+      mpz_mulmod(*c, *a, *a, ctx->n, ctx->u);       /* HH */
+      mpz_mulmod(*e, *X, *c, ctx->n, ctx->u);       /* V = X HH */
+      mpz_mulmod(*c, *c, *a, ctx->n, ctx->u);       /* HHH */
+      mpz_mulmod(*Z, *Z, *a, ctx->n, ctx->u);       /* Z3 = Z H */
+      mpz_mulmod(*g, *Y, *c, ctx->n, ctx->u);       /* Y HHH */
+      mpz_mulmod(*X, *b, *b, ctx->n, ctx->u);
+      mpz_sub(*X, *X, *c);
+      mpz_submul_ui(*X, *e, 2);
+      mpz_mod(*X, *X, ctx->n);                 /* X3 = r^2 - HHH - 2V */
+      mpz_sub(*e, *e, *X);
+      mpz_mulmod(*Y, *b, *e, ctx->n, ctx->u);
+      mpz_sub(*Y, *Y, *g);                  /* Y3 = r(V-X3) - Y HHH */
+    }
+  }
 
-    mpz_mul(x, u, u);
-    mpz_mulmod(x, x, u, n, w);    /* x = u^3 */
+  /* 1/4u = Z^2/4X, so t = 2YZ g and w = (X^2+12Z^4) g with g = 1/4XZ^2 */
+  mpz_mulmod(*c, *Z, *Z, ctx->n, ctx->u);
+  mpz_mulmod(*a, *X, *c, ctx->n, ctx->u);
+  mpz_mul_2exp(*a, *a, 2);
+  if ((r = ed_invert(ctx, *g, *a, f)) != 0)  return r;
+  mpz_mulmod(*a, *Y, *Z, ctx->n, ctx->u);
+  mpz_mul_2exp(*a, *a, 1);
+  mpz_mulmod(*a, *a, *g, ctx->n, ctx->u);           /* t */
+  mpz_mulmod(*b, *X, *X, ctx->n, ctx->u);
+  mpz_mulmod(*c, *c, *c, ctx->n, ctx->u);
+  mpz_addmul_ui(*b, *c, 12);
+  mpz_mulmod(*b, *b, *g, ctx->n, ctx->u);           /* w */
+
+  /* One inversion of 16 t^2 (t^2+1) (t^2+3) gives the rest */
+  mpz_mulmod(*c, *a, *a, ctx->n, ctx->u);           /* t^2 */
+  mpz_add_ui(*e, *c, 1);
+  mpz_add_ui(*Z, *c, 3);
+  mpz_mulmod(*Z, *Z, *e, ctx->n, ctx->u);           /* (t^2+1)(t^2+3) */
+  mpz_mulmod(*Y, *Z, *c, ctx->n, ctx->u);
+  mpz_mul_2exp(*Y, *Y, 4);
+  if ((r = ed_invert(ctx, *g, *Y, f)) != 0)  return r;
+
+  mpz_mulmod(*e, *Z, *g, ctx->n, ctx->u);           /* 1/16t^2 */
+  mpz_sub_ui(*Z, *c, 1);
+  mpz_mulmod(*X, *Z, *Z, ctx->n, ctx->u);
+  mpz_mulmod(*X, *X, *Z, ctx->n, ctx->u);
+  mpz_add_ui(*Z, *c, 3);
+  mpz_mulmod(*X, *X, *Z, ctx->n, ctx->u);
+  mpz_mulmod(*X, *X, *e, ctx->n, ctx->u);
+  mpz_ui_sub(ctx->d, 1, *X);
+  mpz_mod(ctx->d, ctx->d, ctx->n);                 /* d */
+
+  mpz_mulmod(*g, *g, *c, ctx->n, ctx->u);
+  mpz_mul_2exp(*g, *g, 4);                  /* 1/(t^2+1)(t^2+3) */
+  mpz_mulmod(*Y, *Z, *g, ctx->n, ctx->u);           /* 1/(t^2+1), Z = t^2+3 */
+  mpz_mulmod(*Y, *Y, *e, ctx->n, ctx->u);
+  mpz_mul_2exp(*Y, *Y, 4);                  /* 1/t^2(t^2+1) */
+  mpz_ui_sub(*e, 3, *c);
+  mpz_mulmod(*Y, *Y, *e, ctx->n, ctx->u);           /* y */
+  mpz_mulmod(*X, *a, *b, ctx->n, ctx->u);
+  mpz_mul_2exp(*X, *X, 2);
+  mpz_mulmod(*X, *X, *g, ctx->n, ctx->u);           /* x */
+  mpz_set_ui(*Z, 1);
+  return 0;
+}
+
+/* Stage 1 on a new Edwards curve, leaving (x:z) on the Montgomery curve
+ * with b = (A+2)/4 for stage 2.  Returns 1 with a factor in f, 0 if none
+ * was found, and -1 if the curve was no good. */
+static int ed_stage1(ecm_ctx_t* ctx, UV B1, mpz_t x, mpz_t z, mpz_t f)
+{
+  ed_point_t P;
+  mpz_t s;
+  signed char* naf;
+  UV q, k;
+  int found;
+  PRIME_ITERATOR(iter);
 
-    mpz_mul(z, v, v);
-    mpz_mulmod(z, z, v, n, w);    /* z = v^3 */
+  mpz_init(P.X);  mpz_init(P.Y);  mpz_init(P.Z);  mpz_init(P.T);
+  do {
+    k = gmp_urandomb_ui(ctx->rand, 31);
+  } while (k < 2);
+  found = ed_curve_z12(ctx, k, &P, f);
+
+  if (found == 0) {
+    mpz_init_set_ui(s, 1);
+    CNew(naf, ED_CHUNK + BITS_PER_WORD + ED_W + 1, signed char);
+    if (naf == 0) {            /* Out of memory */
+      mpz_clear(s);
+      prime_iterator_destroy(&iter);
+      mpz_clear(P.X);  mpz_clear(P.Y);  mpz_clear(P.Z);  mpz_clear(P.T);
+      return -1;
+    }
+    for (q = 2; !found && q < B1; q = prime_iterator_next(&iter)) {
+      for (k = q; k <= B1/q; k *= q) ;
+      mpz_mul_ui(s, s, k);
+      if (mpz_sizeinbase(s, 2) >= ED_CHUNK) {
+        if (effort_spend(8*ED_CHUNK)) break;
+        found = ed_mult(ctx, s, &P, naf, f);
+        mpz_set_ui(s, 1);
+      }
+    }
+    if (!found && mpz_cmp_ui(s, 1) && !effort_exhausted())
+      found = ed_mult(ctx, s, &P, naf, f);
+    CFree(naf);
+    mpz_clear(s);
 
-    mpz_mul(b, x, v);
-    mpz_mul_ui(w, b, 4);
-    mpz_mod(b, w, n);             /* b = 4 u^3 v */
+    /* The identity is (0,1), so X collects p */
+    if (!found) {
+      mpz_gcd(f, P.X, ctx->n);
+      found = mpz_cmp_ui(f, 1);
+    }
+    /* u = (1+y)/(1-y) on Bv^2 = u^3+Au^2+u, A = 2(1+d)/(1-d) */
+    if (!found) {
+      mpz_add(x, P.Z, P.Y);
+      mpz_sub(z, P.Z, P.Y);
+      mpz_ui_sub(ctx->w, 1, ctx->d);
+      found = ed_invert(ctx, ctx->b, ctx->w, f);
+    }
+  }
+  prime_iterator_destroy(&iter);
+  mpz_clear(P.X);  mpz_clear(P.Y);  mpz_clear(P.Z);  mpz_clear(P.T);
+  return found;
+}
 
-    mpz_sub(a, v, u);
-    mpz_mul(w, a, a);
-    mpz_mulmod(w, w, a, n, w);
+/* Suyama's curve for sigma, setting b and the start point (x:z).  Returns
+ * 0, or 1 with a factor in f, or -1 if sigma gives no curve mod n. */
+static int mont_curve(ecm_ctx_t* ctx, mpz_t sigma, mpz_t x, mpz_t z, mpz_t f)
+{
+  mpz_t a;
+  int found;
 
-    mpz_mul_ui(a, u, 3);
-    mpz_add(a, a, v);
-    mpz_mul(w, w, a);
-    mpz_mod(a, w, n);             /* a = ((v-u)^3 * (3*u + v)) % n */
+  mpz_init(a);
+  mpz_mul_ui(ctx->w, sigma, 4);
+  mpz_mod(ctx->v, ctx->w, ctx->n);              /* v = 4σ */
 
-    mpz_gcdext(f, u, NULL, b, n);
-    found = mpz_cmp_ui(f, 1);
-    if (found) { if (!mpz_cmp(f, n)) { found = 0; continue; } break; }
-    mpz_mul(a, a, u);
+  mpz_mul(x, sigma, sigma);
+  mpz_sub_ui(ctx->w, x, 5);
+  mpz_mod(ctx->u, ctx->w, ctx->n);              /* u = σ^2-5 */
+
+  mpz_mul(x, ctx->u, ctx->u);
+  mpz_mulmod(x, x, ctx->u, ctx->n, ctx->w);     /* x = u^3 */
+
+  mpz_mul(z, ctx->v, ctx->v);
+  mpz_mulmod(z, z, ctx->v, ctx->n, ctx->w);     /* z = v^3 */
+
+  mpz_mul(ctx->b, x, ctx->v);
+  mpz_mul_ui(ctx->w, ctx->b, 4);
+  mpz_mod(ctx->b, ctx->w, ctx->n);              /* b = 4 u^3 v */
+
+  mpz_sub(a, ctx->v, ctx->u);
+  mpz_mul(ctx->w, a, a);
+  mpz_mulmod(ctx->w, ctx->w, a, ctx->n, ctx->w);
+
+  mpz_mul_ui(a, ctx->u, 3);
+  mpz_add(a, a, ctx->v);
+  mpz_mul(ctx->w, ctx->w, a);
+  mpz_mod(a, ctx->w, ctx->n);                   /* a = ((v-u)^3 * (3*u + v)) % n */
+
+  mpz_gcdext(f, ctx->u, NULL, ctx->b, ctx->n);
+  found = mpz_cmp_ui(f, 1);
+  if (found) {
+    if (!mpz_cmp(f, ctx->n)) found = -1;
+  } else {
+    mpz_mul(a, a, ctx->u);
 
     mpz_sub_ui(a, a, 2);
-    mpz_mod(a, a, n);
-
-    mpz_add_ui(b, a, 2);
-    if (mpz_mod_ui(w, b, 2)) mpz_add(b, b, n);
-    mpz_tdiv_q_2exp(b, b, 1);
-    if (mpz_mod_ui(w, b, 2)) mpz_add(b, b, n);
-    mpz_tdiv_q_2exp(b, b, 1);
-
-    /* Use sigma to collect possible factors */
-    mpz_set_ui(sigma, 1);
-
-    /* Stage 1 */
-    for (q = 2; q < B1; q *= 2)
-      ec_double(x, z, x, z);
-    mpz_mulmod(sigma, sigma, x, ecn, w);
-    i = 15;
-    for (q = prime_iterator_next(&iter); q < B1; q = prime_iterator_next(&iter)) {
-      /* PRAC is a little faster with:
-       *     for (k = 1; k <= B1/q; k *= q)
-       *       ec_mult(q, x, z);
-       * but binary multiplication is much slower that way. */
-      for (k = q; k <= B1/q; k *= q) ;
-      ec_mult(k, x, z);
-      mpz_mulmod(sigma, sigma, x, ecn, w);
+    mpz_mod(a, a, ctx->n);
+
+    mpz_add_ui(ctx->b, a, 2);
+    if (mpz_mod_ui(ctx->w, ctx->b, 2)) mpz_add(ctx->b, ctx->b, ctx->n);
+    mpz_tdiv_q_2exp(ctx->b, ctx->b, 1);
+    if (mpz_mod_ui(ctx->w, ctx->b, 2)) mpz_add(ctx->b, ctx->b, ctx->n);
+    mpz_tdiv_q_2exp(ctx->b, ctx->b, 1);
+  }
+  mpz_clear(a);
+  return found;
+}
+
+/* Multiply (x:z) by the prime powers up to B1 that are not in the product
+ * to B0, leaving it unnormalized.  With early set, a gcd every 32 primes
+ * may stop it as soon as a factor shows, with a last one at the end, and
+ * it also stops if the effort budget runs out.  Returns 1 with the gcd in
+ * f if one was not 1. */
+static int mont_stage1_range(ecm_ctx_t* ctx, UV B0, UV B1, mpz_t x, mpz_t z, mpz_t f, int early)
+{
+  mpz_t g;
+  UV i = 15, q, k, qlast = 0;
+#ifndef USE_PRAC
+  UV m;
+#endif
+  int found = 0;
+  PRIME_ITERATOR(iter);
+
+  /* Use g to collect possible factors */
+  mpz_init_set_ui(g, 1);
+  for (q = 2; q <= B1; q = prime_iterator_next(&iter)) {
+    if (q <= B0 && q > B1/q) {          /* no new powers until past B0 */
+      prime_iterator_setprime(&iter, B0);
+      continue;
+    }
+#ifdef USE_PRAC
+    /* One chain per power of q, so every chain comes from the table */
+    for (k = 1; k <= B1/q; k *= q)
+      if (k*q > B0) {
+        if (q == 2)  ec_double(ctx, x, z, x, z);
+        else         ec_mult(ctx, q, x, z);
+      }
+#else
+    /* Binary multiplication is much slower one power at a time */
+    for (m = 1, k = 1; k <= B1/q; k *= q)
+      if (k*q > B0) {
+        if (q == 2)  ec_double(ctx, x, z, x, z);
+        else         m *= q;
+      }
+    if (m > 1)
+      ec_mult(ctx, m, x, z);
+#endif
+    if (early) {
+      mpz_mulmod(g, g, x, ctx->n, ctx->w);
       if (i++ % 32 == 0) {
-        mpz_gcd(f, sigma, ecn);
-        if (mpz_cmp_ui(f, 1))  break;
+        mpz_gcd(f, g, ctx->n);
+        if (mpz_cmp_ui(f, 1)) { found = 1; break; }
+        /* About 10 mulmods per bit, and 1.44 bits per unit of B1 */
+        if (effort_spend(16*(q-qlast))) break;
+        qlast = q;
       }
     }
-    prime_iterator_destroy(&iter);
+  }
+  if (early && !found) {
+    mpz_gcd(f, g, ctx->n);
+    found = (mpz_cmp_ui(f, 1) != 0);
+  }
+  prime_iterator_destroy(&iter);
+  mpz_clear(g);
+  return found;
+}
 
-    /* Find factor in S1 */
-    do { NORMALIZE(f, u, v, x, z, n); } while (0);
-    if (!found) {
-      mpz_gcd(f, sigma, ecn);
-      found = mpz_cmp_ui(f, 1);
-    }
+/* Stage 1 on a new Suyama curve, with returns as ed_stage1. */
+static int mont_stage1(ecm_ctx_t* ctx, UV B1, mpz_t x, mpz_t z, mpz_t f)
+{
+  mpz_t sigma;
+  int found;
+
+  mpz_init(sigma);
+  do {
+    mpz_urandomm(sigma, ctx->rand, ctx->n);
+  } while (mpz_cmp_ui(sigma, 5) <= 0);
+  found = mont_curve(ctx, sigma, x, z, f);
+  mpz_clear(sigma);
+  if (found)
+    return found;
+
+  found = mont_stage1_range(ctx, 0, B1, x, z, f, 1);
+
+  /* Find factor in S1 */
+  if (!found)
+    do { NORMALIZE(f, ctx->u, ctx->v, x, z, ctx->n); } while (0);
+  return found;
+}
+
+static int ecm_factor(mpz_t n, mpz_t f, UV B1, UV B2, UV ncurves, int edwards)
+{
+  ecm_ctx_t context, *ctx = &context;
+  mpz_t x, z;
+  UV curve;
+  int found = 0;
+  int _verbose = get_verbose_level();
+
+  TEST_FOR_2357(n, f);
+
+  if (B2 < B1)  B2 = 100*B1;  /* time(S1) == time(S2) ~ 125 */
+
+  ecm_ctx_init(ctx, n, edwards);
+  mpz_init(x);   mpz_init(z);
+
+  if (_verbose>2) gmp_printf("# ecm trying %Zd (B1=%lu B2=%lu ncurves=%lu%s)\n", n, (unsigned long)B1, (unsigned long)B2, (unsigned long)ncurves, edwards ? " edwards" : "");
+
+  /* Both stages charge the effort budget as they go */
+  for (curve = 0; curve < ncurves && !effort_spend(0); curve++) {
+    found = (edwards) ? ed_stage1(ctx, B1, x, z, f) : mont_stage1(ctx, B1, x, z, f);
+    if (found < 0) { found = 0; continue; }
     if (found) { if (!mpz_cmp(f, n)) { found = 0; continue; } break; }
+    if (effort_exhausted()) break;
 
     /* Stage 2 */
-    if (!found && B2 > B1)
-      found = ec_stage2(B1, B2, x, z, f);
+    if (B2 > B1)
+      found = ec_stage2(ctx, B1, B2, x, z, f);
 
     if (found) { if (!mpz_cmp(f, n)) { found = 0; continue; } break; }
   }
@@ -674,13 +1149,56 @@ int _GMP_ecm_factor_projective(mpz_t n, mpz_t f, UV B1, UV B2, UV ncurves)
     else       gmp_printf("# ecm: no factor\n");
   }
 
-  mpz_clear(ecn);
-  mpz_clear(x);   mpz_clear(z);   mpz_clear(a);   mpz_clear(b);
-  mpz_clear(u);   mpz_clear(v);   mpz_clear(w);   mpz_clear(sigma);
-  mpz_clear(x1);  mpz_clear(z1);  mpz_clear(x2);  mpz_clear(z2);
-#ifdef USE_PRAC
-  mpz_clear(x3);  mpz_clear(z3);  mpz_clear(x4);  mpz_clear(z4);
-#endif
+  mpz_clear(x);   mpz_clear(z);
+  ecm_ctx_clear(ctx);
+
+  return found;
+}
 
+int _GMP_ecm_factor_projective(mpz_t n, mpz_t f, UV B1, UV B2, UV ncurves)
+{
+  return ecm_factor(n, f, B1, B2, ncurves, 0);
+}
+
+int _GMP_ecm_factor_edwards(mpz_t n, mpz_t f, UV B1, UV B2, UV ncurves)
+{
+  return ecm_factor(n, f, B1, B2, ncurves, 1);
+}
+
+/* Continue ECM on Suyama's curve for sigma from (x:z), the start point
+ * times the prime powers up to B0, or from the start point if B0 is 0.
+ * Stage 1 runs on to B1 without stopping, and (x:z) is left there, with
+ * z = 1 unless it shares a factor with n.  Stage 2 to B2 follows if
+ * B2 > B1.  Returns 1 with a factor in f, 0 if none was found, and -1 if
+ * sigma gives no curve mod n. */
+int _GMP_ecm_resume(mpz_t n, mpz_t f, mpz_t sigma, mpz_t x, mpz_t z, UV B0, UV B1, UV B2)
+{
+  ecm_ctx_t context, *ctx = &context;
+  mpz_t x0, z0;
+  int found;
+
+  ecm_ctx_init(ctx, n, 0);
+  mpz_init(x0);  mpz_init(z0);
+  found = mont_curve(ctx, sigma, x0, z0, f);
+  if (found == 0) {
+    if (B0 > 0) {
+      mpz_mod(x0, x, n);
+      mpz_mod(z0, z, n);
+    }
+    mont_stage1_range(ctx, B0, B1, x0, z0, f, 0);
+    mpz_gcd(f, z0, n);
+    if (!mpz_cmp_ui(f, 1)) {
+      mpz_invert(ctx->u, z0, n);
+      mpz_mulmod(x0, x0, ctx->u, n, ctx->v);
+      mpz_set_ui(z0, 1);
+    }
+    mpz_set(x, x0);
+    mpz_set(z, z0);
+    found = mpz_cmp_ui(f, 1) && mpz_cmp(f, n);
+    if (!mpz_cmp_ui(f, 1) && B2 > B1)
+      found = (ec_stage2(ctx, B1, B2, x0, z0, f) != 0);
+  }
+  mpz_clear(x0);  mpz_clear(z0);
+  ecm_ctx_clear(ctx);
   return found;
 }
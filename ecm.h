@@ -12,5 +12,13 @@ extern int ec_affine_multiply(
 
 extern int  _GMP_ecm_factor_affine(mpz_t n, mpz_t f, UV BMax, UV ncurves);
 extern int  _GMP_ecm_factor_projective(mpz_t n, mpz_t f, UV B1, UV B2, UV ncurves);
+/* The same on Edwards curves with torsion Z/12, faster in stage 1 */
+extern int  _GMP_ecm_factor_edwards(mpz_t n, mpz_t f, UV B1, UV B2, UV ncurves);
+/* The curves used when no family is asked for, by factor() and the proofs */
+#define _GMP_ECM_FACTOR(n, f, b1, ncurves) \
+   _GMP_ecm_factor_edwards(n, f, b1, 0, ncurves)
+/* One Suyama curve from a saved point at B0, to B1 then B2 */
+extern int  _GMP_ecm_resume(mpz_t n, mpz_t f, mpz_t sigma, mpz_t x, mpz_t z,
+                            UV B0, UV B1, UV B2);
 
 #endif
@@ -659,6 +659,8 @@ static int ecpp_down(int i, mpz_t Ni, int facstage, int *pmaxH, int* dilist, mpz
       int poly_degree;
       int allq = (nidigits < 400);  /* Do all q values together, or not */
 
+      if (effort_spend(0))  break;   /* Out of effort, N stays probable */
+
       if (dindex == -1) {   /* n-1 and n+1 tests */
         int nm1_success = 0;
         int np1_success = 0;
@@ -923,7 +925,7 @@ int _GMP_ecpp(mpz_t N, char** prooftextptr)
   dilist = poly_class_nums();
   nsfacs = 0;
   result = 1;
-  for (fstage = 1; fstage < 20; fstage++) {
+  for (fstage = 1; fstage < 20 && !effort_spend(0); fstage++) {
     int maxH = 0;
     if (fstage == 3 && get_verbose_level())
       gmp_printf("Working hard on: %Zd\n", N);
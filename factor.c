@@ -1,16 +1,39 @@
+#include <string.h>
 #include <gmp.h>
 #include "ptypes.h"
 
 #include "factor.h"
 #include "primality.h"
 #include "prime_iterator.h"
+#include "prime_tree.h"
+#include "prac.h"
+#define FUNC_gcd_ui 1
 #include "utility.h"
 #include "small_factor.h"
 #include "ecm.h"
 #include "simpqs.h"
 
-#define _GMP_ECM_FACTOR(n, f, b1, ncurves) \
-   _GMP_ecm_factor_projective(n, f, b1, 0, ncurves)
+/* Guards the factorization cache */
+#if defined(USE_ITHREADS) && !defined(STANDALONE)
+  static perl_mutex fcache_mutex;
+  #define FCACHE_LOCK    MUTEX_LOCK(&fcache_mutex)
+  #define FCACHE_UNLOCK  MUTEX_UNLOCK(&fcache_mutex)
+#else
+  #define FCACHE_LOCK
+  #define FCACHE_UNLOCK
+#endif
+
+/* Guards the strategy pointer and the tables it replaced */
+#if defined(USE_ITHREADS) && !defined(STANDALONE)
+  static perl_mutex strategy_mutex;
+  #define STRATEGY_LOCK    MUTEX_LOCK(&strategy_mutex)
+  #define STRATEGY_UNLOCK  MUTEX_UNLOCK(&strategy_mutex)
+#else
+  #define STRATEGY_LOCK
+  #define STRATEGY_UNLOCK
+#endif
+
+static void fill_default_strategy(void);
 
 #define NPRIMES_SMALL 2000
 static unsigned short primes_small[NPRIMES_SMALL];
@@ -23,337 +46,899 @@ void _init_factor(void) {
     primes_small[pn] = prime_iterator_next(&iter);
   }
   prime_iterator_destroy(&iter);
+  fill_default_strategy();
+#if defined(USE_ITHREADS) && !defined(STANDALONE)
+  MUTEX_INIT(&fcache_mutex);
+  MUTEX_INIT(&strategy_mutex);
+#endif
 }
 
-/* Max number of factors on the unfactored stack, not the max total factors.
- * This is used when we split n into two or more composites.  Since we work
- * on the smaller of the composites first, this rarely goes above 10 even
- * with thousands of non-trivial factors. */
-#define MAX_FACTORS 128
+/*****************************************************************************/
+/*                           Factoring strategy                              */
+/*****************************************************************************/
 
-static int add_factor(int nfactors, mpz_t f, mpz_t** pfactors, int** pexponents)
+/*
+ * The default is meant to provide good performance for "random" numbers as
+ * input.  Hence we stack lots of effort up front looking for small factors:
+ * prho and pbrent are ~ O(f^1/2) where f is the smallest factor.  SQUFOF is
+ * O(N^1/4), so arguably not any better.  p-1 and ECM are quite useful for
+ * pulling out small factors (6-20 digits).  ECM bounds scale with the size
+ * of n, with few curves where QS will do the job better.
+ *
+ * Factoring a 778-digit number consisting of 101 8-digit factors should
+ * complete in under 3 seconds.  Factoring numbers consisting of many
+ * 12-digit or 14-digit primes should take under 10 seconds.
+ *
+ * Inputs with known structure may do better with a different table, see
+ * set_factor_strategy.
+ */
+#define ECM_BY_SIZE(mult, curves) \
+  {FACTOR_ECM,   0,  99, mult*  5000, curves, 0}, \
+  {FACTOR_ECM, 100, 127, mult* 10000, curves, 0}, \
+  {FACTOR_ECM, 128, 159, mult* 20000, curves, 0}, \
+  {FACTOR_ECM, 160, 191, mult* 30000, curves, 0}, \
+  {FACTOR_ECM, 192, 223, mult* 40000, curves, 0}, \
+  {FACTOR_ECM, 224, 255, mult* 80000, curves, 0}, \
+  {FACTOR_ECM, 256, 511, mult*160000, curves, 0}, \
+  {FACTOR_ECM, 512,   0, mult*320000, curves, 0}
+
+static factor_stage_t default_stages[] = {
+  {FACTOR_SQUFOF,   0, BITS_PER_WORD-4, 200000,      0, 0},
+  {FACTOR_POWER,    0,   0,      0,       0, 0},
+  {FACTOR_PMINUS1,  0,   0,  15000,  150000, 0},
+  {FACTOR_ECM,      0,   0,    200,       4, 0},   /* tiny ECM */
+  {FACTOR_ECM,      0,   0,    600,      20, 0},
+  {FACTOR_ECM,      0,   0,   2000,      10, 0},
+  {FACTOR_PMINUS1,  0,  99, 200000, 3000000, 0},   /* QS does 100-159 */
+  {FACTOR_PMINUS1,160,   0, 200000, 3000000, 0},
+  {FACTOR_ECM,      0,  99,   5000,      20, 0},   /* small ECM */
+  {FACTOR_ECM,    100, 127,  10000,       2, 0},
+  {FACTOR_ECM,    128, 159,  20000,       2, 0},
+  {FACTOR_ECM,    160, 191,  30000,      20, 0},
+  {FACTOR_ECM,    192, 223,  40000,      40, 0},
+  {FACTOR_ECM,    224, 255,  80000,      40, 0},
+  {FACTOR_ECM,    256, 511, 160000,      80, 0},
+  {FACTOR_ECM,    512,   0, 320000,     160, 0},
+  /* QS (30+ digits).  Fantastic if it is a semiprime, but can be slow and
+   * a memory hog if not (compared to ECM).  Restrict to < 91 digits. */
+  {FACTOR_QS,      97, 299,      0,       0, 0},
+  ECM_BY_SIZE(2, 20),
+  {FACTOR_PBRENT,   0,   0, 1*1024*1024,  0, 0},
+  ECM_BY_SIZE(4, 20),
+  ECM_BY_SIZE(8, 20),
+  /* HOLF in case it's a near-ratio-of-perfect-square */
+  {FACTOR_HOLF,     0,   0, 1*1024*1024,  0, 0},
+  {FACTOR_PMINUS1,  0,   0, 5000000, 5000000*200, 0},
+  ECM_BY_SIZE(32, 40),
+  /* Our method of last resort: ECM with high B1 and many curves */
+  ECM_BY_SIZE(8, 100),   ECM_BY_SIZE(16, 100),   ECM_BY_SIZE(32, 100),
+  ECM_BY_SIZE(64, 100),  ECM_BY_SIZE(128, 100),  ECM_BY_SIZE(256, 100),
+  ECM_BY_SIZE(512, 100), ECM_BY_SIZE(1024, 100), ECM_BY_SIZE(2048, 100),
+  ECM_BY_SIZE(4096, 100),
+};
+#define NDEFAULT_STAGES (sizeof(default_stages)/sizeof(default_stages[0]))
+
+typedef struct factor_strategy_s {
+  UV nstages;
+  factor_stage_t* stages;
+  struct factor_strategy_s* prev;
+} factor_strategy_t;
+
+static factor_strategy_t  default_strategy = {NDEFAULT_STAGES, default_stages, 0};
+static factor_strategy_t* strategy = &default_strategy;
+
+/* factor() holds on to the table it started with, so one replaced while
+ * calls are running waits on the retired list until the last of them
+ * finishes.  The default table is never freed. */
+static factor_strategy_t* retired_strategies = 0;
+static int strategy_users = 0;
+
+static const char* const method_names[FACTOR_NMETHODS] =
+  {"squfof", "power", "pminus1", "pplus1", "ecm", "qs", "pbrent", "prho", "holf",
+   "ecm_suyama", "ecm_affine"};
+/* Used when arg1 is 0, matching the single-method functions */
+static const UV method_default_arg1[FACTOR_NMETHODS] =
+  {16000000, 0, 5000000, 5000000, 100000, 0, 64000000, 64000000, 256000000,
+   100000, 100000};
+
+int factor_method(const char* name)
 {
-  int i, j, cmp = 0;
-  if (nfactors == 0) {                      /* First factor */
-    mpz_t *factors;
-    int* exponents;
-    New(0, factors, 10, mpz_t);
-    New(0, exponents, 10, int);
-    mpz_init_set(factors[0], f);
-    exponents[0] = 1;
-    *pfactors = factors;
-    *pexponents = exponents;
-    return 1;
-  } else if (mpz_cmp((*pfactors)[nfactors-1],f) < 0) {  /* New biggest factor */
-    if (!(nfactors % 10)) {
-      Renew(*pfactors, nfactors+10, mpz_t);
-      Renew(*pexponents, nfactors+10, int);
-    }
-    mpz_init_set((*pfactors)[nfactors], f);
-    (*pexponents)[nfactors] = 1;
-    return nfactors+1;
-  }
-  /* Insert in sorted order.  Find out where we will put it. */
-  for (i = 0; i < nfactors; i++)
-    if ((cmp = mpz_cmp((*pfactors)[i], f)) >= 0)
-      break;
-  if (cmp == 0) {                           /* Duplicate factor */
-    (*pexponents)[i]++;
-    return nfactors;
+  int m;
+  for (m = 0; m < FACTOR_NMETHODS; m++)
+    if (!strcmp(name, method_names[m]))
+      return m;
+  return -1;
+}
+const char* factor_method_name(int method)
+{
+  return (method >= 0 && method < FACTOR_NMETHODS) ? method_names[method] : 0;
+}
+
+/* The polynomial stage 2 for p-1 and p+1 is faster once B2-B1 is a few
+ * million.  Below that it is about one mulmod per prime, or per pair of
+ * primes, and above it grows far more slowly. */
+#define STAGE2_POLY_MIN  4000000
+
+static UV stage2_cost(UV B1, UV B2)
+{
+  UV range = (B2 > B1) ? B2 - B1 : 0;
+  return (range < STAGE2_POLY_MIN) ? range/16 : STAGE2_POLY_MIN/16 + range/256;
+}
+
+/* Rough number of modular multiplications a stage costs.  Worked out in
+ * double, as ECM with a large B1 and many curves overflows a 32-bit UV, and
+ * saturated at UV_MAX. */
+static UV stage_cost(const factor_stage_t* s)
+{
+  double B1 = (double) s->arg1, c;
+  switch (s->method) {
+    case FACTOR_SQUFOF:   c = B1;  break;
+    case FACTOR_POWER:    c = 1;   break;
+    /* 1.44*B1 squarings for stage 1, plus stage 2 */
+    case FACTOR_PMINUS1:  c = 1.5*B1 + stage2_cost(s->arg1, s->arg2);  break;
+    case FACTOR_PPLUS1:   c = 3*B1 + stage2_cost(s->arg1, s->arg2);    break;
+    /* ~10 mulmods per bit of the stage 1 multiplier, plus stage 2 */
+    case FACTOR_ECM:      c = 16 * B1 * (double) s->arg2;  break;
+    /* Montgomery curves take about 20% more in stage 1 */
+    case FACTOR_ECM_SUYAMA: c = 19 * B1 * (double) s->arg2;  break;
+    /* stage 1 only, each bound from 100 up to B1 in turn */
+    case FACTOR_ECM_AFFINE: c = 20 * B1 * (double) s->arg2;  break;
+    case FACTOR_PBRENT:
+    case FACTOR_PRHO:     c = 2*B1;  break;
+    case FACTOR_HOLF:     c = 4*B1;  break;
+    case FACTOR_QS:
+    default:              c = 0;     break;
   }
-  /* factor[i] > f.  Move everything from i to nfactors up. */
-  if (!(nfactors % 10)) {
-    Renew(*pfactors, nfactors+10, mpz_t);
-    Renew(*pexponents, nfactors+10, int);
+  return (c >= (double) UV_MAX) ? UV_MAX : (UV) c;
+}
+
+static void fill_stage(factor_stage_t* s)
+{
+  if (s->arg1 == 0)
+    s->arg1 = method_default_arg1[s->method];
+  if (s->arg2 == 0) {
+    if (s->method == FACTOR_PMINUS1 || s->method == FACTOR_PPLUS1)
+      s->arg2 = 10*s->arg1;
+    else if (s->method == FACTOR_ECM || s->method == FACTOR_ECM_SUYAMA ||
+             s->method == FACTOR_ECM_AFFINE)
+      s->arg2 = 100;
   }
-  mpz_init((*pfactors)[nfactors]);
-  for (j = nfactors; j > i; j--) {
-    mpz_set( (*pfactors)[j], (*pfactors)[j-1] );
-    (*pexponents)[j] = (*pexponents)[j-1];
+  s->cost = stage_cost(s);
+}
+
+static void fill_default_strategy(void)
+{
+  UV i;
+  for (i = 0; i < NDEFAULT_STAGES; i++)
+    fill_stage(default_stages+i);
+}
+
+/* Call with the lock held */
+static void free_retired_strategies(void)
+{
+  while (retired_strategies != 0) {
+    factor_strategy_t* st = retired_strategies;
+    retired_strategies = st->prev;
+    Safefree(st->stages);
+    Safefree(st);
   }
-  mpz_set((*pfactors)[i], f);
-  (*pexponents)[i] = 1;
-  return nfactors+1;
 }
 
-#define ADD_FACTOR_UI(f, t) \
-  do { \
-    mpz_set_ui(f, t); \
-    nfactors = add_factor(nfactors, f, &factors, &exponents); \
-  } while (0)
+static const factor_strategy_t* strategy_acquire(void)
+{
+  const factor_strategy_t* st;
+  STRATEGY_LOCK;
+  strategy_users++;
+  st = strategy;
+  STRATEGY_UNLOCK;
+  return st;
+}
 
-#define ADD_FACTOR(f) \
-  do { nfactors = add_factor(nfactors, f, &factors, &exponents); } while (0)
+static void strategy_release(void)
+{
+  STRATEGY_LOCK;
+  if (--strategy_users == 0)
+    free_retired_strategies();
+  STRATEGY_UNLOCK;
+}
 
-int factor(mpz_t input_n, mpz_t* pfactors[], int* pexponents[])
+void set_factor_strategy(const factor_stage_t* stages, UV nstages)
 {
-  mpz_t tofac_stack[MAX_FACTORS];
-  int ntofac = 0;
-  mpz_t* factors = 0;
-  int* exponents = 0;
-  int nfactors = 0;
-  mpz_t f, n;
-  UV tf, tlim;
+  factor_strategy_t* st = &default_strategy;
+  UV i;
 
-  mpz_init_set(n, input_n);
-  mpz_init(f);
-  if (mpz_cmp_ui(n, 4) < 0) {
-    if (mpz_cmp_ui(n, 1) != 0)    /* 1 should return no results */
-      ADD_FACTOR(n);
-    goto DONE;
+  if (stages != 0 && nstages > 0) {
+    for (i = 0; i < nstages; i++)
+      if (factor_method_name(stages[i].method) == 0)
+        croak("set_factor_strategy: unknown method %d", stages[i].method);
+    New(0, st, 1, factor_strategy_t);
+    New(0, st->stages, nstages, factor_stage_t);
+    memcpy(st->stages, stages, nstages * sizeof(factor_stage_t));
+    for (i = 0; i < nstages; i++)
+      fill_stage(st->stages+i);
+    st->nstages = nstages;
   }
+  STRATEGY_LOCK;
+  if (strategy != &default_strategy) {
+    strategy->prev = retired_strategies;
+    retired_strategies = strategy;
+  }
+  strategy = st;
+  if (strategy_users == 0)
+    free_retired_strategies();
+  STRATEGY_UNLOCK;
+}
 
-  /* Trial factor to small limit */
-  while (mpz_even_p(n)) {
-    ADD_FACTOR_UI(f, 2);
-    mpz_divexact_ui(n, n, 2);
+factor_stage_t* get_factor_strategy(UV* nstages)
+{
+  const factor_strategy_t* st = strategy_acquire();
+  factor_stage_t* stages;
+  New(0, stages, (st->nstages > 0) ? st->nstages : 1, factor_stage_t);
+  memcpy(stages, st->stages, st->nstages * sizeof(factor_stage_t));
+  *nstages = st->nstages;
+  strategy_release();
+  return stages;
+}
+
+static void destroy_pm1_exponents(void);
+
+void _destroy_factor(void)
+{
+  set_factor_cache(0);
+  destroy_pm1_exponents();
+  STRATEGY_LOCK;
+  if (strategy != &default_strategy) {
+    strategy->prev = retired_strategies;
+    retired_strategies = strategy;
   }
-  tlim = (mpz_sizeinbase(n,2) > 80)  ?  4001  :  16001;
-  {
-    UV sp, p, un;
-    un = (mpz_cmp_ui(n,2*tlim*tlim) >= 0) ? 2*tlim*tlim : mpz_get_ui(n);
+  strategy = &default_strategy;
+  free_retired_strategies();
+  STRATEGY_UNLOCK;
+}
 
-    for (sp = 2, p = primes_small[sp];
-         p < tlim && p*p <= un;
-         p = primes_small[++sp]) {
-      while (mpz_divisible_ui_p(n, p)) {
-        ADD_FACTOR_UI(f, p);
-        mpz_divexact_ui(n, n, p);
-        un = (mpz_cmp_ui(n,2*tlim*tlim) > 0) ? 2*tlim*tlim : mpz_get_ui(n);
+/* Lists of factors with multiplicity, used both for the numbers still to be
+ * factored and for the results.  Results are appended as found and sorted
+ * once at the end.  On the work list status is instead the next strategy
+ * stage to run, or -1 for a piece not yet tested. */
+typedef struct {
+  mpz_t f;
+  int e;
+  int status;    /* 2 proven prime, 1 probable prime, 0 composite */
+} fentry_t;
+
+typedef struct {
+  fentry_t* list;
+  int n, alloc;
+} flist_t;
+
+static void flist_init(flist_t* L)
+{
+  L->n = 0;
+  L->alloc = 16;
+  New(0, L->list, L->alloc, fentry_t);
+}
+
+static void flist_push(flist_t* L, mpz_t f, int e, int status)
+{
+  if (L->n >= L->alloc) {
+    L->alloc *= 2;
+    Renew(L->list, L->alloc, fentry_t);
+  }
+  mpz_init_set(L->list[L->n].f, f);
+  L->list[L->n].e = e;
+  L->list[L->n].status = status;
+  L->n++;
+}
+
+/* Take off the entry with the lowest status, the latest one of those */
+static void flist_pop(flist_t* L, mpz_t f, int* e, int* status)
+{
+  int i, best = L->n-1;
+  for (i = best-1; i >= 0; i--)
+    if (L->list[i].status < L->list[best].status)
+      best = i;
+  L->n--;
+  mpz_swap(f, L->list[best].f);
+  mpz_clear(L->list[best].f);
+  *e = L->list[best].e;
+  *status = L->list[best].status;
+  if (best != L->n)
+    L->list[best] = L->list[L->n];
+}
+
+static int fentry_cmp(const void* a, const void* b)
+{
+  return mpz_cmp( ((const fentry_t*)a)->f, ((const fentry_t*)b)->f );
+}
+
+/* Sort, merge equal factors, and hand the results over as arrays. */
+static int flist_results(flist_t* L, mpz_t** pfactors, int** pexponents, int** pstatus)
+{
+  int i, nfactors = 0;
+  *pfactors = 0;
+  *pexponents = 0;
+  *pstatus = 0;
+  if (L->n > 0) {
+    qsort(L->list, L->n, sizeof(fentry_t), fentry_cmp);
+    New(0, *pfactors, L->n, mpz_t);
+    New(0, *pexponents, L->n, int);
+    New(0, *pstatus, L->n, int);
+    for (i = 0; i < L->n; i++) {
+      if (nfactors > 0 && mpz_cmp((*pfactors)[nfactors-1], L->list[i].f) == 0) {
+        (*pexponents)[nfactors-1] += L->list[i].e;
+        if (L->list[i].status > (*pstatus)[nfactors-1])
+          (*pstatus)[nfactors-1] = L->list[i].status;
+      } else {
+        mpz_init((*pfactors)[nfactors]);
+        mpz_swap((*pfactors)[nfactors], L->list[i].f);
+        (*pexponents)[nfactors] = L->list[i].e;
+        (*pstatus)[nfactors] = L->list[i].status;
+        nfactors++;
       }
     }
+  }
+  for (i = 0; i < L->n; i++)
+    mpz_clear(L->list[i].f);
+  Safefree(L->list);
+  return nfactors;
+}
 
-    if (un < p*p) {
-      if (un > 1)
-        ADD_FACTOR(n);
-      goto DONE;
+/*****************************************************************************/
+/*                          Factorization cache                              */
+/*****************************************************************************/
+
+/* An LRU cache of complete factorizations of inputs larger than a word.  It
+ * is off until set_factor_cache gives it a size.  Entries are chained in a
+ * hash table on the limbs of n, and kept in a list from most to least
+ * recently used. */
+typedef struct fcache_entry_s {
+  mpz_t n;
+  UV hash;
+  int nfactors;
+  mpz_t* factors;
+  int* exponents;
+  int* status;
+  struct fcache_entry_s *hnext, *prev, *next;
+} fcache_entry_t;
+
+static fcache_entry_t** fcache_table = 0;
+static fcache_entry_t* fcache_head = 0;
+static fcache_entry_t* fcache_tail = 0;
+static UV fcache_max = 0;
+static UV fcache_mask = 0;
+static UV fcache_count = 0;
+static UV fcache_hits = 0;
+static UV fcache_misses = 0;
+
+#define FCACHE_MINBITS 64
+
+static UV fcache_hash(mpz_t n)
+{
+  size_t i, nlimbs = mpz_size(n);
+#if BITS_PER_WORD == 64
+  UV h = UVCONST(14695981039346656037);
+  const UV prime = UVCONST(1099511628211);
+#else
+  UV h = UVCONST(2166136261);
+  const UV prime = UVCONST(16777619);
+#endif
+  for (i = 0; i < nlimbs; i++)
+    h = (h ^ (UV)mpz_getlimbn(n, i)) * prime;
+  return h ^ (h >> 17);
+}
+
+static void copy_factors(int nfactors, mpz_t* factors, int* exponents, int* status,
+                         mpz_t** pfactors, int** pexponents, int** pstatus)
+{
+  int i;
+  New(0, *pfactors, nfactors, mpz_t);
+  New(0, *pexponents, nfactors, int);
+  New(0, *pstatus, nfactors, int);
+  for (i = 0; i < nfactors; i++) {
+    mpz_init_set((*pfactors)[i], factors[i]);
+    (*pexponents)[i] = exponents[i];
+    (*pstatus)[i] = status[i];
+  }
+}
+
+static void fcache_unlink(fcache_entry_t* e)
+{
+  if (e->prev) e->prev->next = e->next;  else fcache_head = e->next;
+  if (e->next) e->next->prev = e->prev;  else fcache_tail = e->prev;
+}
+static void fcache_push_front(fcache_entry_t* e)
+{
+  e->prev = 0;
+  e->next = fcache_head;
+  if (fcache_head) fcache_head->prev = e;  else fcache_tail = e;
+  fcache_head = e;
+}
+
+static void fcache_evict_lru(void)
+{
+  fcache_entry_t* e = fcache_tail;
+  fcache_entry_t** pe = &fcache_table[e->hash & fcache_mask];
+  while (*pe != e)
+    pe = &(*pe)->hnext;
+  *pe = e->hnext;
+  fcache_unlink(e);
+  mpz_clear(e->n);
+  clear_factors(e->nfactors, &e->factors, &e->exponents);
+  Safefree(e->status);
+  Safefree(e);
+  fcache_count--;
+}
+
+void set_factor_cache(UV entries)
+{
+  UV size;
+  FCACHE_LOCK;
+  while (fcache_count > 0)
+    fcache_evict_lru();
+  if (fcache_table != 0)
+    Safefree(fcache_table);
+  fcache_table = 0;
+  fcache_max = fcache_mask = 0;
+  fcache_hits = fcache_misses = 0;
+  if (entries > 0) {
+    for (size = 16; size < entries && size < (UV_MAX >> 2); size <<= 1)
+      ;
+    Newz(0, fcache_table, size, fcache_entry_t*);
+    fcache_mask = size-1;
+    fcache_max = entries;
+  }
+  FCACHE_UNLOCK;
+}
+
+void factor_cache_stats(UV* hits, UV* misses, UV* entries)
+{
+  FCACHE_LOCK;
+  *hits = fcache_hits;
+  *misses = fcache_misses;
+  *entries = fcache_count;
+  FCACHE_UNLOCK;
+}
+
+/* Returns the number of factors, or -1 if n is not cached */
+static int fcache_lookup(mpz_t n, UV hash, mpz_t** pfactors, int** pexponents, int** pstatus)
+{
+  fcache_entry_t* e;
+  int nfactors = -1;
+  FCACHE_LOCK;
+  if (fcache_table != 0) {
+    for (e = fcache_table[hash & fcache_mask]; e != 0; e = e->hnext)
+      if (e->hash == hash && mpz_cmp(e->n, n) == 0)
+        break;
+    if (e != 0) {
+      fcache_hits++;
+      fcache_unlink(e);
+      fcache_push_front(e);
+      nfactors = e->nfactors;
+      copy_factors(nfactors, e->factors, e->exponents, e->status, pfactors, pexponents, pstatus);
+    } else {
+      fcache_misses++;
     }
   }
+  FCACHE_UNLOCK;
+  return nfactors;
+}
 
-  /* Power factor */
-  tf = power_factor(n, f);
-  if (tf) {
-    mpz_t* pow_factors;
-    int* pow_exponents;
-    int pow_nfactors, i, j;
-
-    pow_nfactors = factor(f, &pow_factors, &pow_exponents);
-    for (i = 0; i < pow_nfactors; i++)
-      pow_exponents[i] *= tf;
-    for (i = 0; i < pow_nfactors; i++)
-      for (j = 0; j < pow_exponents[i]; j++)
-        ADD_FACTOR(pow_factors[i]);
-    clear_factors(pow_nfactors, &pow_factors, &pow_exponents);
-    goto DONE;
+static void fcache_store(mpz_t n, UV hash, int nfactors, mpz_t* factors, int* exponents, int* status)
+{
+  fcache_entry_t* e;
+  FCACHE_LOCK;
+  if (fcache_table != 0) {
+    for (e = fcache_table[hash & fcache_mask]; e != 0; e = e->hnext)
+      if (e->hash == hash && mpz_cmp(e->n, n) == 0)
+        break;
+    if (e == 0) {   /* Another thread may have stored it meanwhile */
+      if (fcache_count >= fcache_max)
+        fcache_evict_lru();
+      New(0, e, 1, fcache_entry_t);
+      mpz_init_set(e->n, n);
+      e->hash = hash;
+      e->nfactors = nfactors;
+      copy_factors(nfactors, factors, exponents, status, &e->factors, &e->exponents, &e->status);
+      e->hnext = fcache_table[hash & fcache_mask];
+      fcache_table[hash & fcache_mask] = e;
+      fcache_push_front(e);
+      fcache_count++;
+    }
   }
+  FCACHE_UNLOCK;
+}
 
-  do { /* loop over each remaining factor */
-    while ( mpz_cmp_ui(n, tlim*tlim) > 0 && !_GMP_is_prob_prime(n) ) {
-      int success = 0;
-      int o = get_verbose_level();
-      UV nbits, B1 = 5000;
-
-      /*
-       * This set of operations is meant to provide good performance for
-       * "random" numbers as input.  Hence we stack lots of effort up front
-       * looking for small factors: prho and pbrent are ~ O(f^1/2) where
-       * f is the smallest factor.  SQUFOF is O(N^1/4), so arguable not
-       * any better.  p-1 and ECM are quite useful for pulling out small
-       * factors (6-20 digits).
-       *
-       * Factoring a 778-digit number consisting of 101 8-digit factors
-       * should complete in under 3 seconds.  Factoring numbers consisting
-       * of many 12-digit or 14-digit primes should take under 10 seconds.
-       */
+static int _factor_with_status(mpz_t input_n, mpz_t* pfactors[], int* pexponents[], int* pstatus[]);
 
-      if (mpz_cmp_ui(n, (unsigned long)(UV_MAX>>4)) < 0) {
-        UV ui_n = mpz_get_ui(n);
-        UV ui_factors[2];
-        if (!mpz_cmp_ui(n, ui_n)) {
-          success = racing_squfof_factor(ui_n, ui_factors, 200000)-1;
-          if (success) {
-            mpz_set_ui(f, ui_factors[0]);
-          } else {
-            if (o > 2) {gmp_printf("UV SQUFOF failed %Zd\n", n);}
-          }
-        }
-        if (success&&o) {gmp_printf("UV SQUFOF found factor %Zd\n", f);o=0;}
-      }
+int factor_with_status(mpz_t n, mpz_t* pfactors[], int* pexponents[], int* pstatus[])
+{
+  int i, nfactors;
+  UV hash;
 
-      /* Make sure it isn't a perfect power */
-      if (!success)  success = (int)power_factor(n, f);
-      if (success&&o) {gmp_printf("perfect power found factor %Zd\n", f);o=0;}
-
-      if (!success)  success = _GMP_pminus1_factor(n, f, 15000, 150000);
-      if (success&&o) {gmp_printf("p-1 (15k) found factor %Zd\n", f);o=0;}
-
-      /* Small ECM to find small factors */
-      if (!success)  success = _GMP_ECM_FACTOR(n, f, 200, 4);
-      if (success&&o) {gmp_printf("tiny ecm (200) found factor %Zd\n", f);o=0;}
-      if (!success)  success = _GMP_ECM_FACTOR(n, f, 600, 20);
-      if (success&&o) {gmp_printf("tiny ecm (600) found factor %Zd\n", f);o=0;}
-      if (!success)  success = _GMP_ECM_FACTOR(n, f, 2000, 10);
-      if (success&&o) {gmp_printf("tiny ecm (2000) found factor %Zd\n", f);o=0;}
-
-      /* Small p-1 */
-      if (!success) {
-        nbits = mpz_sizeinbase(n, 2);
-        if (nbits < 100 || nbits >= 160) {
-          success = _GMP_pminus1_factor(n, f, 200000, 3000000);
-          if (success&&o) {gmp_printf("p-1 (200k) found factor %Zd\n", f);o=0;}
-        }
-      }
+  if (fcache_max == 0 || mpz_sizeinbase(n, 2) <= FCACHE_MINBITS)
+    return _factor_with_status(n, pfactors, pexponents, pstatus);
 
-      /* Set ECM parameters that have a good chance of success */
-      if (!success) {
-        UV curves;
-        if      (nbits < 100){ B1 =   5000; curves =  20; }
-        else if (nbits < 128){ B1 =  10000; curves =   2; } /* go to QS */
-        else if (nbits < 160){ B1 =  20000; curves =   2; } /* go to QS */
-        else if (nbits < 192){ B1 =  30000; curves =  20; }
-        else if (nbits < 224){ B1 =  40000; curves =  40; }
-        else if (nbits < 256){ B1 =  80000; curves =  40; }
-        else if (nbits < 512){ B1 = 160000; curves =  80; }
-        else                 { B1 = 320000; curves = 160; }
-        if (curves > 0) {
-          success = _GMP_ECM_FACTOR(n, f, B1, curves);
-          if (success&&o) {gmp_printf("small ecm (%luk,%lu) found factor %Zd\n", B1/1000, curves, f);o=0;}
-        }
-      }
+  hash = fcache_hash(n);
+  nfactors = fcache_lookup(n, hash, pfactors, pexponents, pstatus);
+  if (nfactors >= 0)
+    return nfactors;
+  nfactors = _factor_with_status(n, pfactors, pexponents, pstatus);
+  /* Only keep complete factorizations */
+  for (i = 0; i < nfactors; i++)
+    if ((*pstatus)[i] == 0)
+      break;
+  if (i == nfactors)
+    fcache_store(n, hash, nfactors, *pfactors, *pexponents, *pstatus);
+  return nfactors;
+}
+
+int factor(mpz_t input_n, mpz_t* pfactors[], int* pexponents[])
+{
+  int* fstatus;
+  int i, nfactors = factor_with_status(input_n, pfactors, pexponents, &fstatus);
+  for (i = 0; i < nfactors; i++)
+    if (fstatus[i] == 0)
+      break;
+  if (nfactors > 0)  Safefree(fstatus);
+  if (i < nfactors) {
+    clear_factors(nfactors, pfactors, pexponents);
+    croak("unable to completely factor input%s", effort_exhausted() ? " (effort budget exhausted)" : "");
+  }
+  return nfactors;
+}
+
+/* The first stage of the strategy st at or after *stage that applies
+ * to the composite n, setting *stage to it and charging its cost to the
+ * effort budget.  NULL if no stages are left or the budget has run out. */
+static const factor_stage_t* next_stage(const factor_strategy_t* st, mpz_t n, int* stage)
+{
+  const factor_stage_t* s;
+  UV i, nbits = mpz_sizeinbase(n, 2);
+
+  for (i = *stage; i < st->nstages; i++)
+    if (nbits >= st->stages[i].minbits && (st->stages[i].maxbits == 0 || nbits <= st->stages[i].maxbits))
+      break;
+  *stage = i;
+  if (i >= st->nstages)
+    return 0;
+  s = st->stages + i;
+  /* ECM, p-1, and QS charge the effort budget as they go */
+  if (effort_spend( (s->method == FACTOR_ECM || s->method == FACTOR_ECM_SUYAMA ||
+                     s->method == FACTOR_ECM_AFFINE || s->method == FACTOR_PMINUS1 ||
+                     s->method == FACTOR_QS) ? 0 : s->cost ))
+    return 0;
+  return s;
+}
+
+/* Methods that factor() may run on worker threads.  Nothing they reach may
+ * croak or use perl's allocator:  ECM and the prac and prime iterator tables
+ * it builds use CNew, and rho needs no memory outside GMP.  p-1 and p+1
+ * stay on the calling thread, as their stage 2 uses the polynomial code. */
+#define WORKER_METHOD(m) \
+  ((m) == FACTOR_ECM || (m) == FACTOR_ECM_SUYAMA || (m) == FACTOR_ECM_AFFINE || \
+   (m) == FACTOR_PBRENT || (m) == FACTOR_PRHO)
+
+/* Run stage s on the composite n, returning 1 and a factor in f if it
+ * splits n.  QS may put extra factors of n on the work list, dividing them
+ * out of n. */
+static int run_method(const factor_stage_t* s, mpz_t n, mpz_t f, flist_t* work, int e)
+{
+  int success = 0;
+  int o = get_verbose_level();
 
-      /* QS (30+ digits).  Fantastic if it is a semiprime, but can be
-       * slow and a memory hog if not (compared to ECM).  Restrict to
-       * reasonable size numbers (< 91 digits).  Because of the way it
-       * works, it will generate (possibly) multiple factors for the same
-       * amount of work.  Go to some trouble to use them. */
-      if (!success && mpz_sizeinbase(n,10) >= 30 && nbits < 300) {
+  if (o > 2) gmp_printf("%s (%lu,%lu) on %Zd\n", method_names[s->method], s->arg1, s->arg2, n);
+  switch (s->method) {
+    case FACTOR_SQUFOF:
+      if (mpz_cmp_ui(n, (unsigned long)(UV_MAX>>4)) < 0) {
+        UV ui_factors[2];
+        success = racing_squfof_factor(mpz_get_ui(n), ui_factors, s->arg1)-1;
+        if (success)  mpz_set_ui(f, ui_factors[0]);
+      } else {
+        success = _GMP_squfof_factor(n, f, s->arg1);
+      }
+      break;
+    case FACTOR_POWER:
+      success = (int)power_factor(n, f);
+      break;
+    case FACTOR_PMINUS1:
+      success = _GMP_pminus1_factor(n, f, s->arg1, s->arg2);
+      break;
+    case FACTOR_PPLUS1:
+      success = _GMP_pplus1_factor(n, f, 0, s->arg1, s->arg2);
+      break;
+    case FACTOR_ECM:
+      success = _GMP_ECM_FACTOR(n, f, s->arg1, s->arg2);
+      break;
+    case FACTOR_ECM_SUYAMA:
+      success = _GMP_ecm_factor_projective(n, f, s->arg1, 0, s->arg2);
+      break;
+    case FACTOR_ECM_AFFINE:
+      success = _GMP_ecm_factor_affine(n, f, s->arg1, s->arg2);
+      break;
+    case FACTOR_PBRENT:
+      success = _GMP_pbrent_factor(n, f, 1, s->arg1);
+      break;
+    case FACTOR_PRHO:
+      success = _GMP_prho_factor(n, f, 3, s->arg1);
+      break;
+    case FACTOR_HOLF:
+      success = _GMP_holf_factor(n, f, s->arg1);
+      break;
+    case FACTOR_QS:
+    default:
+      /* Because of the way it works, QS will (possibly) generate
+       * multiple factors for the same amount of work.  Use them. */
+      if (mpz_sizeinbase(n,10) >= 30) {
         mpz_t farray[66];
-        int i, qs_nfactors;
-        for (i = 0; i < 66; i++)
-          mpz_init(farray[i]);
+        int j, qs_nfactors;
+        for (j = 0; j < 66; j++)
+          mpz_init(farray[j]);
         qs_nfactors = _GMP_simpqs(n, farray);
         mpz_set(f, farray[0]);
         if (qs_nfactors > 2) {
           /* We found multiple factors */
-          for (i = 2; i < qs_nfactors; i++) {
-            if (o){gmp_printf("SIMPQS found extra factor %Zd\n",farray[i]);}
-            if (ntofac >= MAX_FACTORS-1) croak("Too many factors\n");
-            mpz_init_set(tofac_stack[ntofac], farray[i]);
-            ntofac++;
-            mpz_divexact(n, n, farray[i]);
+          for (j = 2; j < qs_nfactors; j++) {
+            if (o){gmp_printf("SIMPQS found extra factor %Zd\n",farray[j]);}
+            flist_push(work, farray[j], e, -1);
+            mpz_divexact(n, n, farray[j]);
           }
           /* f = farray[0], n = farray[1], farray[2..] pushed */
         }
-        for (i = 0; i < 66; i++)
-          mpz_clear(farray[i]);
+        for (j = 0; j < 66; j++)
+          mpz_clear(farray[j]);
         success = qs_nfactors > 1;
-        if (success&&o) {gmp_printf("SIMPQS found factor %Zd\n", f);o=0;}
       }
+      break;
+  }
+  if (success&&o) gmp_printf("%s (%lu,%lu) found factor %Zd\n", method_names[s->method], s->arg1, s->arg2, f);
+  return success;
+}
+
+static void check_factor(mpz_t n, mpz_t f)
+{
+  if (!mpz_divisible_p(n, f) || !mpz_cmp_ui(f, 1) || !mpz_cmp(f, n)) {
+    gmp_printf("n = %Zd  f = %Zd\n", n, f);
+    croak("Incorrect factoring");
+  }
+}
+
+/* Put the composite n back after a stage: its pieces if it split, itself
+ * for the next stage if not, and as an unfactored composite if nothing is
+ * left to try (success < 0). */
+static void stage_done(flist_t* work, flist_t* found, mpz_t n, mpz_t f, int e, int stage, int success)
+{
+  if (success < 0) {
+    /* Composites we can't factor are returned marked as composite */
+    if (get_verbose_level()) gmp_printf("%s on %Zd\n", effort_exhausted() ? "out of effort" : "gave up", n);
+    flist_push(found, n, e, 0);
+  } else if (!success) {
+    flist_push(work, n, e, stage+1);
+  } else {
+    int ndiv = mpz_remove(n, n, f);
+    if (mpz_cmp_ui(n, 1) > 0)
+      flist_push(work, n, e, -1);
+    flist_push(work, f, e * ndiv, -1);   /* Usually smaller, so next */
+  }
+}
+
+/*****************************************************************************/
+/*                              Worker threads                               */
+/*****************************************************************************/
 
-      if (!success)  success = _GMP_ECM_FACTOR(n, f, 2*B1, 20);
-      if (success&&o) {gmp_printf("ecm (%luk,20) found factor %Zd\n",2*B1/1000,f);o=0;}
+/* With more than one thread, factor() gives every composite on the work
+ * list its next stage at once.  The stages in WORKER_METHOD are claimed by
+ * the workers and by this thread, which first runs the others itself.
+ * The results are checked and the list updated here after all are done, so
+ * only this thread croaks or touches the list.  Threads are started for
+ * each round, which is cheap next to the stages worth sharing. */
+#if HAVE_WORKER_THREADS
+#include <pthread.h>
+#endif
 
-      if (!success)  success = _GMP_pbrent_factor(n, f, 1, 1*1024*1024);
-      if (success&&o) {gmp_printf("pbrent (1,1M) found factor %Zd\n", f);o=0;}
+static int factor_threads = 1;
 
-      if (!success)  success = _GMP_ECM_FACTOR(n, f, 4*B1, 20);
-      if (success&&o) {gmp_printf("ecm (%luk,20) ecm found factor %Zd\n", 4*B1,f);o=0;}
+void set_factor_threads(int nthreads)
+{
+  ATOMIC_STORE(factor_threads, (!HAVE_WORKER_THREADS || nthreads < 1) ? 1
+                             : (nthreads > MAX_FACTOR_THREADS) ? MAX_FACTOR_THREADS
+                             : nthreads);
+}
+int get_factor_threads(void) { return ATOMIC_LOAD(factor_threads); }
+
+typedef struct {
+  mpz_t n, f;
+  int e, stage, success;
+  const factor_stage_t* s;
+} fjob_t;
+
+typedef struct {
+  fjob_t** jobs;
+  int njobs;
+  int next;            /* the next job to claim */
+  void* budget;        /* the caller's effort budget */
+} fpool_t;
+
+static void pool_work(fpool_t* P)
+{
+  fjob_t* J;
+  int i;
+  while (1) {
+    do {
+      i = ATOMIC_LOAD(P->next);
+      if (i >= P->njobs)  return;
+    } while (!ATOMIC_CAS(P->next, i, i+1));
+    J = P->jobs[i];
+    J->success = run_method(J->s, J->n, J->f, 0, J->e);
+  }
+}
 
-      if (!success)  success = _GMP_ECM_FACTOR(n, f, 8*B1, 20);
-      if (success&&o) {gmp_printf("ecm (%luk,20) ecm found factor %Zd\n", 8*B1,f);o=0;}
+#if HAVE_WORKER_THREADS
+static void* pool_thread(void* arg)
+{
+  fpool_t* P = (fpool_t*) arg;
+  effort_adopt(P->budget);
+  pool_work(P);
+  effort_adopt(0);
+  return 0;
+}
+#endif
 
-      /* HOLF in case it's a near-ratio-of-perfect-square */
-      if (!success)  success = _GMP_holf_factor(n, f, 1*1024*1024);
-      if (success&&o) {gmp_printf("holf found factor %Zd\n", f);o=0;}
+static void run_round(const factor_strategy_t* st, flist_t* work, flist_t* found)
+{
+  fjob_t* jobs;
+  fpool_t P;
+  int i, nj = work->n;
+#if HAVE_WORKER_THREADS
+  pthread_t tid[MAX_FACTOR_THREADS];
+  int nthreads = 0, maxthreads = get_factor_threads();
+#endif
+
+  New(0, jobs, nj, fjob_t);
+  New(0, P.jobs, nj, fjob_t*);
+  P.njobs = P.next = 0;
+  P.budget = effort_share();
+  for (i = 0; i < nj; i++) {
+    fjob_t* J = jobs + i;
+    mpz_init(J->n);  mpz_init(J->f);
+    flist_pop(work, J->n, &J->e, &J->stage);
+    J->s = next_stage(st, J->n, &J->stage);
+    J->success = -1;
+    if (J->s != 0 && WORKER_METHOD(J->s->method))
+      P.jobs[P.njobs++] = J;
+  }
 
-      /* Large p-1 with stage 2: B2 = 20*B1 */
-      if (!success)  success = _GMP_pminus1_factor(n,f,5000000,5000000*20);
-      if (success&&o) {gmp_printf("p-1 (5M) found factor %Zd\n", f);o=0;}
+#if HAVE_WORKER_THREADS
+  while (nthreads < maxthreads-1 && nthreads < P.njobs-1) {
+    if (pthread_create(tid + nthreads, 0, pool_thread, &P) != 0)
+      break;
+    nthreads++;
+  }
+#endif
+  for (i = 0; i < nj; i++)
+    if (jobs[i].s != 0 && !WORKER_METHOD(jobs[i].s->method))
+      jobs[i].success = run_method(jobs[i].s, jobs[i].n, jobs[i].f, work, jobs[i].e);
+  pool_work(&P);
+#if HAVE_WORKER_THREADS
+  while (nthreads > 0)
+    pthread_join(tid[--nthreads], 0);
+#endif
+
+  for (i = 0; i < nj; i++) {
+    fjob_t* J = jobs + i;
+    if (J->success > 0)
+      check_factor(J->n, J->f);
+    stage_done(work, found, J->n, J->f, J->e, J->stage, J->success);
+    mpz_clear(J->n);  mpz_clear(J->f);
+  }
+  Safefree(P.jobs);
+  Safefree(jobs);
+}
 
-      if (!success)  success = _GMP_ECM_FACTOR(n, f, 32*B1, 40);
-      if (success&&o) {gmp_printf("ecm (%luk,40) ecm found factor %Zd\n", 32*B1,f);o=0;}
+static int _factor_with_status(mpz_t input_n, mpz_t* pfactors[], int* pexponents[], int* pstatus[])
+{
+  flist_t found, work;
+  const factor_strategy_t* st;
+  int e, status, stage, success;
+  mpz_t f, n;
+  UV tf, tlim;
 
-      /*
-      if (!success)  success = _GMP_pbrent_factor(n, f, 2, 512*1024*1024);
-      if (success&&o) {gmp_printf("pbrent (2,512M) found factor %Zd\n", f);o=0;}
+  flist_init(&found);
+  flist_init(&work);
+  mpz_init_set(n, input_n);
+  mpz_init(f);
+  if (mpz_cmp_ui(n, 4) < 0) {
+    if (mpz_cmp_ui(n, 1) != 0)    /* 1 should return no results */
+      flist_push(&found, n, 1, mpz_sgn(n) ? 2 : 0);
+    goto DONE;
+  }
 
-      if (!success)  success = _GMP_squfof_factor(n, f, 256*1024*1024);
-      if (success&&o) {gmp_printf("squfof found factor %Zd\n", f);o=0;}
-      */
+  /* Trial factor to small limit */
+  e = mpz_scan1(n, 0);
+  if (e > 0) {
+    mpz_tdiv_q_2exp(n, n, e);
+    mpz_set_ui(f, 2);
+    flist_push(&found, f, e, 2);
+  }
+  tlim = (mpz_sizeinbase(n,2) > 80)  ?  4001  :  16001;
+  {
+    UV sp, p, un;
+    un = (mpz_cmp_ui(n,2*tlim*tlim) >= 0) ? 2*tlim*tlim : mpz_get_ui(n);
 
-      /* Our method of last resort: ECM with high bmax and many curves*/
-      if (!success) {
-        UV i;
-        if (get_verbose_level()) gmp_printf("starting large ECM on %Zd\n",n);
-        B1 *= 8;
-        for (i = 0; i < 10; i++) {
-          success = _GMP_ECM_FACTOR(n, f, B1, 100);
-          if (success) break;
-          B1 *= 2;
-        }
-        if (success&&o) {gmp_printf("ecm (%luk,100) ecm found factor %Zd\n", B1,f);o=0;}
+    for (sp = 2, p = primes_small[sp];
+         p < tlim && p*p <= un;
+         p = primes_small[++sp]) {
+      for (e = 0; mpz_divisible_ui_p(n, p); e++)
+        mpz_divexact_ui(n, n, p);
+      if (e > 0) {
+        mpz_set_ui(f, p);
+        flist_push(&found, f, e, 2);
+        un = (mpz_cmp_ui(n,2*tlim*tlim) > 0) ? 2*tlim*tlim : mpz_get_ui(n);
       }
+    }
 
-      if (success) {
-        if (!mpz_divisible_p(n, f) || !mpz_cmp_ui(f, 1) || !mpz_cmp(f, n)) {
-          gmp_printf("n = %Zd  f = %Zd\n", n, f);
-          croak("Incorrect factoring");
-        }
-      }
+    if (un < p*p) {
+      if (un > 1)
+        flist_push(&found, n, 1, 2);
+      goto DONE;
+    }
+  }
+
+  /* Large inputs may have many more small factors than splitting one at a
+   * time can handle well.  Pull out all primes below a few times the size
+   * of n with the product trees, skipping subtrees with no divisor. */
+  if (mpz_sizeinbase(n, 2) >= 1024) {
+    UV i, np, *plist;
+    np = prime_tree_divisors(n, tlim, 4*mpz_sizeinbase(n, 2), &plist);
+    for (i = 0; i < np; i++) {
+      mpz_set_ui(f, plist[i]);
+      e = mpz_remove(n, n, f);
+      flist_push(&found, f, e, 2);
+    }
+    Safefree(plist);
+    if (mpz_cmp_ui(n, 1) == 0)
+      goto DONE;
+  }
 
-      if (!success) {
-        /* TODO: What to do with composites we can't factor?
-         *       Push them as "C#####" ?
-         *       For now, just push them as if we factored.
-         */
-        if (get_verbose_level()) gmp_printf("gave up on %Zd\n", n);
-        ADD_FACTOR(n);
-        mpz_set_ui(n, 1);
+  /* Everything left has no factors below tlim.  Work on the pieces of n
+   * breadth first: each new piece is tested, and then every composite gets
+   * a stage of the strategy before any gets the next one, so one hard
+   * cofactor does not hold up the others. */
+  st = strategy_acquire();
+  e = 1;
+  stage = -1;
+  while (1) {
+    if (stage < 0) {
+      /* tlim is prime and was not tried, so tlim^2 is the first composite */
+      int small = (mpz_cmp_ui(n, tlim*tlim) < 0);
+      if (!small && (tf = power_factor(n, f)) ) {
+        flist_push(&work, f, e * (int)tf, -1);
+      } else if ( (status = small ? 2 : _GMP_is_prob_prime(n)) ) {
+        flist_push(&found, n, e, status);
       } else {
-        int ndiv = mpz_remove(n, n, f);
-        if (_GMP_is_prob_prime(f)) { /* prime factor */
-          while (ndiv-- > 0)
-            ADD_FACTOR(f);
-        } else if (ndiv > 1) {       /* Repeated non-trivial composite factor */
-          mpz_t* pow_factors;
-          int* pow_exponents;
-          int pow_nfactors, i, j;
-          pow_nfactors = factor(f, &pow_factors, &pow_exponents);
-          for (i = 0; i < pow_nfactors; i++)
-            pow_exponents[i] *= ndiv;
-          for (i = 0; i < pow_nfactors; i++)
-            for (j = 0; j < pow_exponents[i]; j++)
-              ADD_FACTOR(pow_factors[i]);
-          clear_factors(pow_nfactors, &pow_factors, &pow_exponents);
-        } else {                     /* One non-trivial composite factor */
-          if (ntofac >= MAX_FACTORS-1) croak("Too many factors\n");
-          /* If f < n and both are composites, put n on stack and work on f */
-          if (mpz_cmp(f, n) < 0 && !_GMP_is_prob_prime(n)) {
-            mpz_init_set(tofac_stack[ntofac++], n);
-            mpz_set(n, f);
-          } else {
-            mpz_init_set(tofac_stack[ntofac++], f);
-          }
-        }
+        flist_push(&work, n, e, 0);
       }
+    } else if (work.n > 0 && get_factor_threads() > 1) {
+      /* Everything on the list is waiting for a stage too */
+      flist_push(&work, n, e, stage);
+      run_round(st, &work, &found);
+    } else {
+      const factor_stage_t* s = next_stage(st, n, &stage);
+      success = (s == 0) ? -1 : run_method(s, n, f, &work, e);
+      if (success > 0)
+        check_factor(n, f);
+      stage_done(&work, &found, n, f, e, stage, success);
     }
-    /* n is now prime or 1 */
-    if (mpz_cmp_ui(n, 1) > 0) {
-      ADD_FACTOR(n);
-      mpz_set_ui(n, 1);
-    }
-    if (ntofac-- > 0) {
-      mpz_set(n, tofac_stack[ntofac]);
-      mpz_clear(tofac_stack[ntofac]);
-    }
-  } while (mpz_cmp_ui(n, 1) > 0);
+    if (work.n == 0)
+      break;
+    flist_pop(&work, n, &e, &stage);
+  }
+  strategy_release();
 
 DONE:
   mpz_clear(f);
   mpz_clear(n);
-  *pfactors = factors;
-  *pexponents = exponents;
-  return nfactors;
+  Safefree(work.list);   /* always empty here */
+  return flist_results(&found, pfactors, pexponents, pstatus);
 }
 
 void clear_factors(int nfactors, mpz_t* pfactors[], int* pexponents[])
@@ -803,9 +1388,9 @@ UV _GMP_trial_factor(mpz_t n, UV from_n, UV to_n)
     return (p <= to_n) ? p : 0;
   }
 
-  /* For "small" numbers, this simple method is best. */
+  /* Simple division for the smallest primes */
   {
-    UV small_to = (log2n < 3000)  ?  to_n  :  30000;
+    UV small_to = (to_n < 2048)  ?  to_n  :  2048;
     while (p <= small_to) {
       if (mpz_divisible_ui_p(n, p))
         break;
@@ -817,6 +1402,29 @@ UV _GMP_trial_factor(mpz_t n, UV from_n, UV to_n)
     }
   }
 
+  /* Then gcds with the cached prime product trees */
+  if (p < PRIME_TREE_LIMIT) {
+    UV tree_to = (to_n < PRIME_TREE_LIMIT) ? to_n : PRIME_TREE_LIMIT-1;
+    UV f = prime_tree_factor(n, p, tree_to);
+    if (f != 0 || tree_to == to_n) {
+      prime_iterator_destroy(&iter);
+      return f;
+    }
+    prime_iterator_setprime(&iter, tree_to);
+    p = prime_iterator_next(&iter);
+  }
+
+  /* Past the trees, simple division is best for "small" numbers. */
+  if (log2n < 3000) {
+    while (p <= to_n) {
+      if (mpz_divisible_ui_p(n, p))
+        break;
+      p = prime_iterator_next(&iter);
+    }
+    prime_iterator_destroy(&iter);
+    return (p <= to_n) ? p : 0;
+  }
+
   /* Simple treesieve.
    * This is much faster than simple divisibility for really big numbers.
    * Credit to Jens K Andersen for writing up the generic algorithm.
@@ -955,13 +1563,157 @@ int _GMP_prho_factor(mpz_t n, mpz_t f, UV a, UV rounds)
   return 0;
 }
 
-int _GMP_pbrent_factor(mpz_t n, mpz_t f, UV a, UV rounds)
-{
-  mpz_t Xi, Xm, saveXi, m, t;
-  UV i, r;
-  const UV inner = 256;
+/* Montgomery multiplication on moduli of a few limbs, done with mpn calls.
+ * For rho this is much cheaper than mpz_mul plus mpz_tdiv_r, which spends
+ * most of its time in the division and in size bookkeeping. */
+#if GMP_NAIL_BITS == 0
+#define MONT_MAXLIMBS 8
 
-  TEST_FOR_2357(n, f);
+typedef struct {
+  mp_size_t nl;
+  mp_limb_t n[MONT_MAXLIMBS];
+  mp_limb_t ninv;                  /* -1/n mod 2^GMP_NUMB_BITS */
+} mont_t;
+
+static void mont_init(mont_t* M, mpz_t n)
+{
+  mp_limb_t inv;
+  mp_size_t i;
+  M->nl = mpz_size(n);
+  for (i = 0; i < M->nl; i++)
+    M->n[i] = mpz_getlimbn(n, i);
+  /* Newton's iteration doubles the correct bits, starting from 3 */
+  inv = M->n[0];
+  for (i = 0; i < 6; i++)
+    inv *= 2 - M->n[0] * inv;
+  M->ninv = -inv;
+}
+
+/* r = xR mod n */
+static void mont_set_ui(mp_limb_t* r, UV x, mpz_t n, const mont_t* M)
+{
+  mp_size_t i;
+  mpz_t t;
+  mpz_init_set_ui(t, x);
+  mpz_mul_2exp(t, t, M->nl * GMP_NUMB_BITS);
+  mpz_mod(t, t, n);
+  for (i = 0; i < M->nl; i++)
+    r[i] = mpz_getlimbn(t, i);
+  mpz_clear(t);
+}
+
+static void mont_copy(mp_limb_t* r, const mp_limb_t* a, const mont_t* M)
+{
+  mp_size_t i;
+  for (i = 0; i < M->nl; i++)
+    r[i] = a[i];
+}
+
+/* r = t/R mod n, for t < nR of 2nl limbs.  t is destroyed. */
+static void mont_redc(mp_limb_t* r, mp_limb_t* t, const mont_t* M)
+{
+  mp_limb_t c[MONT_MAXLIMBS];
+  mp_size_t i, nl = M->nl;
+  for (i = 0; i < nl; i++)
+    c[i] = mpn_addmul_1(t+i, M->n, nl, t[i] * M->ninv);
+  if (mpn_add_n(r, t+nl, c, nl) || mpn_cmp(r, M->n, nl) >= 0)
+    mpn_sub_n(r, r, M->n, nl);
+}
+
+static void mont_mul(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b, const mont_t* M)
+{
+  mp_limb_t t[2*MONT_MAXLIMBS];
+  mpn_mul_n(t, a, b, M->nl);
+  mont_redc(r, t, M);
+}
+
+/* r = a + b mod n */
+static void mont_add(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b, const mont_t* M)
+{
+  if (mpn_add_n(r, a, b, M->nl) || mpn_cmp(r, M->n, M->nl) >= 0)
+    mpn_sub_n(r, r, M->n, M->nl);
+}
+
+/* r = |a - b| */
+static void mont_absdiff(mp_limb_t* r, const mp_limb_t* a, const mp_limb_t* b, const mont_t* M)
+{
+  if (mpn_cmp(a, b, M->nl) >= 0)  mpn_sub_n(r, a, b, M->nl);
+  else                            mpn_sub_n(r, b, a, M->nl);
+}
+
+/* f = gcd(a, n), where the Montgomery factor R has no effect */
+static void mont_gcd(mpz_t f, const mp_limb_t* a, mpz_t n, const mont_t* M)
+{
+  mpz_import(f, M->nl, -1, sizeof(mp_limb_t), 0, 0, a);
+  mpz_gcd(f, f, n);
+}
+
+/* Brent's rho as in _GMP_pbrent_factor, with x kept as xR mod n. */
+static int pbrent_mont(mpz_t n, mpz_t f, UV a, UV rounds)
+{
+  mont_t M;
+  mp_limb_t Xi[MONT_MAXLIMBS], Xm[MONT_MAXLIMBS], saveXi[MONT_MAXLIMBS];
+  mp_limb_t m[MONT_MAXLIMBS], d[MONT_MAXLIMBS], A[MONT_MAXLIMBS], one[MONT_MAXLIMBS];
+  UV i, r;
+  const UV inner = 256;
+
+  mont_init(&M, n);
+  mont_set_ui(one, 1, n, &M);
+  mont_set_ui(A, a, n, &M);
+  mont_set_ui(Xi, 2, n, &M);
+  mont_copy(Xm, Xi, &M);
+
+  r = 1;
+  while (rounds > 0) {
+    UV rleft = (r > rounds) ? rounds : r;
+    while (rleft > 0) {   /* Do rleft rounds, inner at a time */
+      UV dorounds = (rleft > inner) ? inner : rleft;
+      mont_copy(m, one, &M);
+      mont_copy(saveXi, Xi, &M);
+      for (i = 0; i < dorounds; i++) {
+        mont_mul(Xi, Xi, Xi, &M);  mont_add(Xi, Xi, A, &M);
+        mont_absdiff(d, Xi, Xm, &M);
+        mont_mul(m, m, d, &M);
+      }
+      rleft -= dorounds;
+      rounds -= dorounds;
+      mont_gcd(f, m, n, &M);
+      if (mpz_cmp_ui(f, 1) != 0)
+        break;
+    }
+    if (!mpz_cmp_ui(f, 1)) {
+      r *= 2;
+      mont_copy(Xm, Xi, &M);
+      continue;
+    }
+    if (!mpz_cmp(f, n)) {
+      /* f == n, so we have to back up to see what factor got found */
+      mont_copy(Xi, saveXi, &M);
+      do {
+        mont_mul(Xi, Xi, Xi, &M);  mont_add(Xi, Xi, A, &M);
+        mont_absdiff(d, Xi, Xm, &M);
+        mont_gcd(f, d, n, &M);
+      } while (!mpz_cmp_ui(f, 1) && r-- != 0);
+      if ( (!mpz_cmp_ui(f, 1)) || (!mpz_cmp(f, n)) )  break;
+    }
+    return 1;
+  }
+  mpz_set(f, n);
+  return 0;
+}
+#endif
+
+int _GMP_pbrent_factor(mpz_t n, mpz_t f, UV a, UV rounds)
+{
+  mpz_t Xi, Xm, saveXi, m, t;
+  UV i, r;
+  const UV inner = 256;
+
+  TEST_FOR_2357(n, f);
+#if GMP_NAIL_BITS == 0
+  if (mpz_size(n) <= MONT_MAXLIMBS)
+    return pbrent_mont(n, f, a, rounds);
+#endif
   mpz_init_set_ui(Xi, 2);
   mpz_init_set_ui(Xm, 2);
   mpz_init(m);
@@ -1012,11 +1764,452 @@ int _GMP_pbrent_factor(mpz_t n, mpz_t f, UV a, UV rounds)
   return 0;
 }
 
+/* Stage 1 exponents for p-1.  E(B1) = lcm(1..B1) is kept as products of
+ * runs of consecutive prime powers, each about PM1_CHUNK_BITS long, so stage
+ * 1 is one powmod per run with a gcd after each.  Exponents are built on
+ * first use and published like the prime trees; factor() only uses a few
+ * B1 values, so PM1_CACHE slots are plenty. */
+#define PM1_CHUNK_BITS  16384
+#define PM1_CACHE       8
+#define PM1_CACHE_MAXB1 UVCONST(16000000)
+
+typedef struct {
+  UV     B1;
+  UV     nchunks;
+  mpz_t* chunk;
+  UV*    firstq;         /* the first prime in each chunk */
+} pm1_exponent_t;
+
+static pm1_exponent_t* pm1_exponents[PM1_CACHE];
+
+/* The largest power of q not above B1 */
+static UV pm1_prime_power(UV q, UV B1)
+{
+  UV k = q, kmin = B1/q;
+  while (k <= kmin)
+    k *= q;
+  return k;
+}
+
+static pm1_exponent_t* build_pm1_exponent(UV B1)
+{
+  pm1_exponent_t* E;
+  UV q, nalloc = 16;
+  PRIME_ITERATOR(iter);
+
+  New(0, E, 1, pm1_exponent_t);
+  New(0, E->chunk, nalloc, mpz_t);
+  New(0, E->firstq, nalloc, UV);
+  E->B1 = B1;
+  E->nchunks = 0;
+  for (q = 2; q <= B1; q = prime_iterator_next(&iter)) {
+    if (E->nchunks == 0 || mpz_sizeinbase(E->chunk[E->nchunks-1], 2) >= PM1_CHUNK_BITS) {
+      if (E->nchunks >= nalloc) {
+        nalloc *= 2;
+        Renew(E->chunk, nalloc, mpz_t);
+        Renew(E->firstq, nalloc, UV);
+      }
+      mpz_init_set_ui(E->chunk[E->nchunks], 1);
+      E->firstq[E->nchunks++] = q;
+    }
+    mpz_mul_ui(E->chunk[E->nchunks-1], E->chunk[E->nchunks-1], pm1_prime_power(q, B1));
+  }
+  prime_iterator_destroy(&iter);
+  return E;
+}
+
+static void free_pm1_exponent(pm1_exponent_t* E)
+{
+  UV i;
+  for (i = 0; i < E->nchunks; i++)
+    mpz_clear(E->chunk[i]);
+  Safefree(E->chunk);
+  Safefree(E->firstq);
+  Safefree(E);
+}
+
+/* The exponent for B1.  *owned is set if the caller must free it. */
+static pm1_exponent_t* get_pm1_exponent(UV B1, int* owned)
+{
+  pm1_exponent_t* E;
+  int i;
+  *owned = 0;
+  for (i = 0; i < PM1_CACHE; i++) {
+    E = ATOMIC_LOAD(pm1_exponents[i]);
+    if (E == 0)
+      break;
+    if (E->B1 == B1)
+      return E;
+  }
+  E = build_pm1_exponent(B1);
+  if (SHARED_TABLES && B1 <= PM1_CACHE_MAXB1)
+    for ( ; i < PM1_CACHE; i++)
+      if (ATOMIC_CAS(pm1_exponents[i], 0, E))
+        return E;
+  *owned = 1;                /* No room, or other threads filled it */
+  return E;
+}
+
+static void destroy_pm1_exponents(void)
+{
+  int i;
+  for (i = 0; i < PM1_CACHE; i++) {
+    if (pm1_exponents[i] != 0)
+      free_pm1_exponent(pm1_exponents[i]);
+    pm1_exponents[i] = 0;
+  }
+}
+
+static void pp1_pow(mpz_t X, mpz_t Y, unsigned long exp, mpz_t n)
+{
+  mpz_t x0;
+  unsigned long bit;
+  {
+    unsigned long v = exp;
+    unsigned long b = 1;
+    while (v >>= 1) b++;
+    bit = 1UL << (b-2);
+  }
+  mpz_init_set(x0, X);
+  mpz_mul(Y, X, X);
+  mpz_sub_ui(Y, Y, 2);
+  mpz_tdiv_r(Y, Y, n);
+  while (bit) {
+    if ( exp & bit ) {
+      mpz_mul(X, X, Y);
+      mpz_sub(X, X, x0);
+      mpz_mul(Y, Y, Y);
+      mpz_sub_ui(Y, Y, 2);
+    } else {
+      mpz_mul(Y, X, Y);
+      mpz_sub(Y, Y, x0);
+      mpz_mul(X, X, X);
+      mpz_sub_ui(X, X, 2);
+    }
+    mpz_mod(X, X, n);
+    mpz_mod(Y, Y, n);
+    bit >>= 1;
+  }
+  mpz_clear(x0);
+}
+
+/* r = V_m given V_1 */
+static void lucas_v(mpz_t r, mpz_t V1, UV m, mpz_t n)
+{
+  mpz_t t;
+  if (m == 0) { mpz_set_ui(r, 2);  return; }
+  mpz_set(r, V1);
+  if (m == 1) return;
+  mpz_init(t);
+  pp1_pow(r, t, m, n);
+  mpz_clear(t);
+}
+
+/* The Lucas chain steps for p+1: V_(a+b) = V_a V_b - V_(a-b), V_2a = V_a^2-2 */
+#define VADD(R, A, B, C) \
+  { mpz_mul(t, A, B);  mpz_sub(t, t, C);  mpz_mod(R, t, n); }
+#define VDUP(R, A) \
+  { mpz_mul(t, A, A);  mpz_sub_ui(t, t, 2);  mpz_mod(R, t, n); }
+#define VSWAP(a, b) \
+  { __mpz_struct* s = a;  a = b;  b = s; }
+
+/* X = V_k(X) for odd k > 2 by the PRAC chain for k, as in ECM stage 1.  One
+ * mulmod per step, where pp1_pow's ladder costs two per bit.  w holds five
+ * temporaries. */
+static void pp1_prac(mpz_t X, UV k, mpz_t n, mpz_t* w)
+{
+  __mpz_struct *A = X, *B = w[0], *C = w[1], *T = w[2], *T2 = w[3], *t = w[4];
+  UV r = prac_start(k), d = k - r, e = 2 * r - k;
+  int c;
+
+  mpz_set(B, A);  mpz_set(C, A);  VDUP(A, A);
+  while (d != e) {
+    c = prac_step(&d, &e);
+    if (c & PRAC_SWAP)  VSWAP(A, B);
+    switch (c & 15) {
+      case 1:  VADD(T, A, B, C);  VADD(T2, T, A, B);  VADD(B, B, T, A);
+               VSWAP(A, T2);
+               break;
+      case 2:  VADD(B, A, B, C);  VDUP(A, A);
+               break;
+      case 3:  VADD(C, B, A, C);  VSWAP(B, C);
+               break;
+      case 4:  VADD(B, B, A, C);  VDUP(A, A);
+               break;
+      case 5:  VADD(C, C, A, B);  VDUP(A, A);
+               break;
+      case 6:  VDUP(T, A);  VADD(T2, A, B, C);  VADD(A, T, A, A);
+               VADD(C, T, T2, C);  VSWAP(B, C);
+               break;
+      case 7:  VADD(T, A, B, C);  VADD(B, T, A, B);  VDUP(T, A);
+               VADD(A, A, T, A);
+               break;
+      case 8:  VADD(T, A, B, C);  VADD(C, C, A, B);  VSWAP(B, T);
+               VDUP(T, A);  VADD(A, A, T, A);
+               break;
+      default: VADD(C, C, B, A);  VDUP(B, B);
+               break;
+    }
+  }
+  VADD(A, A, B, C);
+  if (A != X)  mpz_set(X, A);
+}
+
+/* X = V_k(X) for k the largest power of the prime q not above B1 */
+static void pp1_prime_power(mpz_t X, UV q, UV B1, mpz_t n, mpz_t* w)
+{
+  UV k;
+  __mpz_struct* t = w[4];
+  for (k = pm1_prime_power(q, B1); k > 1; k /= q) {
+    if (q == 2)  VDUP(X, X)
+    else         pp1_prac(X, q, n, w);
+  }
+}
+#undef VADD
+#undef VDUP
+#undef VSWAP
+
+/* Standard continuation with prime pairing, for any method whose stage 1
+ * result can be written as V_1 = x + 1/x mod n (Montgomery 1987, p252).
+ * With V_m = x^m + x^-m, p divides V_kD - V_j exactly when the order of x
+ * mod p divides kD-j or kD+j.  So writing each prime q in (B1,B2] as kD+-j
+ * with j < D/2, one product term covers both kD-j and kD+j when they are
+ * prime, and each term costs a single mulmod.  The V_j are the baby steps,
+ * and the giant steps V_kD follow from V_(k+1)D = V_kD V_D - V_(k-1)D.
+ * Sets f to the gcd of the product with n. */
+static void stage2_pairing(mpz_t f, mpz_t V1, mpz_t n, UV B1, UV B2)
+{
+  static const UV Ds[] = {210, 2310, 30030};
+  mpz_t *Vj, V2, Va, Vb, VD, Vk, Vkm1, b, t;
+  UV D, i, j, k, q, nterms, *stamp;
+  int *slot, nslots;
+  PRIME_ITERATOR(iter);
+
+  /* Balance the baby steps (D/4 mulmods) against the giant steps */
+  for (D = Ds[0], i = 1; i < sizeof(Ds)/sizeof(Ds[0]); i++)
+    if (Ds[i]/4 + (B2-B1)/Ds[i] < D/4 + (B2-B1)/D)
+      D = Ds[i];
+
+  mpz_init(V2);  mpz_init(Va);  mpz_init(Vb);  mpz_init(VD);
+  mpz_init(Vk);  mpz_init(Vkm1);  mpz_init_set_ui(b, 1);  mpz_init(t);
+
+  /* Baby steps: V_j for odd j < D/2 prime to D */
+  New(0, slot, D/2+1, int);
+  New(0, stamp, D/2+1, UV);
+  New(0, Vj, D/2+1, mpz_t);
+  lucas_v(V2, V1, 2, n);
+  mpz_set(Va, V1);                            /* V_-1 */
+  mpz_set(Vb, V1);                            /* V_1 */
+  for (j = 0, nslots = 0; j <= D/2; j++) {
+    slot[j] = -1;
+    stamp[j] = 0;
+    if (j < 3 || (j % 2) == 0)
+      continue;
+    mpz_mul(t, Vb, V2);                       /* V_j = V_(j-2) V_2 - V_(j-4) */
+    mpz_sub(t, t, Va);
+    mpz_swap(Va, Vb);
+    mpz_mod(Vb, t, n);
+    if (gcd_ui(j, D) == 1) {
+      mpz_init_set(Vj[nslots], Vb);
+      slot[j] = nslots++;
+    }
+  }
+  mpz_init_set(Vj[nslots], V1);
+  slot[1] = nslots++;
+
+  /* Giant steps, walking the primes in order.  A prime kD+j is skipped if
+   * kD-j already had its term, which stamp[j] = k+1 records. */
+  prime_iterator_setprime(&iter, B1);
+  q = prime_iterator_next(&iter);
+  k = (q + D/2) / D;
+  lucas_v(VD, V1, D, n);
+  lucas_v(Vk, V1, k*D, n);
+  lucas_v(Vkm1, V1, (k == 0) ? D : (k-1)*D, n);
+  nterms = 0;
+  while (q <= B2) {
+    int paired = 0;
+    for ( ; k < (q + D/2) / D; k++) {
+      mpz_mul(t, Vk, VD);
+      mpz_sub(t, t, Vkm1);
+      mpz_swap(Vkm1, Vk);
+      mpz_mod(Vk, t, n);
+    }
+    if (q >= k*D) {
+      j = q - k*D;
+      paired = (stamp[j] == k+1);
+    } else {
+      j = k*D - q;
+      stamp[j] = k+1;
+    }
+    if (!paired) {
+      if (slot[j] >= 0) {
+        mpz_sub(t, Vk, Vj[slot[j]]);
+      } else {                                /* q divides D */
+        lucas_v(t, V1, q, n);
+        mpz_sub_ui(t, t, 2);
+      }
+      mpz_mul(b, b, t);
+      mpz_mod(b, b, n);
+      if ( (++nterms % 64) == 0) {            /* GCD every so often */
+        mpz_gcd(f, b, n);
+        if ( (mpz_cmp_ui(f, 1) != 0) && (mpz_cmp(f, n) != 0) )
+          break;
+        if (effort_spend(64))
+          break;
+      }
+    }
+    q = prime_iterator_next(&iter);
+  }
+  mpz_gcd(f, b, n);
+
+  while (nslots > 0)
+    mpz_clear(Vj[--nslots]);
+  Safefree(Vj);
+  Safefree(stamp);
+  Safefree(slot);
+  mpz_clear(V2);  mpz_clear(Va);  mpz_clear(Vb);  mpz_clear(VD);
+  mpz_clear(Vk);  mpz_clear(Vkm1);  mpz_clear(b);  mpz_clear(t);
+  prime_iterator_destroy(&iter);
+}
+
+/* Stage 2 by fast polynomial evaluation (Montgomery and Silverman 1990).
+ * stage2_pairing forms the product of V_kD - V_j one term at a time.  Here
+ * the m baby steps V_j go into a subproduct tree once, and for each block of
+ * m giant steps we build G(x) = prod (x - V_kD) and evaluate it at every
+ * V_j down the tree.  The product of those values is the product of all m^2
+ * terms, up to sign, for O(M(m) log m) work instead of m^2 mulmods.  Every
+ * kD+-j is covered, prime or not, so this pays off once the range is wide
+ * enough that the pairing would spend more than that on the primes in it.
+ * Sets f to the gcd of the product with n. */
+static void stage2_poly(mpz_t f, mpz_t V1, mpz_t n, UV B1, UV B2)
+{
+  /* D and the number of j < D/2 prime to D, growing */
+  static const UV Ds[][2] = { {2310,240}, {4620,480}, {9240,960},
+    {30030,2880}, {60060,5760}, {90090,8640}, {150150,14400} };
+  polyz_tree_t T;
+  mpz_t *Vj, *G, *vals, V2, Va, Vb, VD, Vk, Vkm1, b, t;
+  UV D, m, i, j, k, kend, L, nbytes, lgm;
+  int nslots;
+
+  /* The largest D whose tree fits in about 32MB, and that the range fills */
+  nbytes = mpz_sizeinbase(n, 256) + 32;
+  for (i = 0; i+1 < sizeof(Ds)/sizeof(Ds[0]); i++) {
+    UV m1 = Ds[i+1][1];
+    for (lgm = 1; (UVCONST(1) << lgm) < m1; lgm++) ;
+    if (2 * m1 * lgm * nbytes > 32*1024*1024 || Ds[i+1][0] * m1 > B2 - B1)
+      break;
+  }
+  D = Ds[i][0];
+  m = Ds[i][1];
+  for (lgm = 1; (UVCONST(1) << lgm) < m; lgm++) ;
+
+  mpz_init(V2);  mpz_init(Va);  mpz_init(Vb);  mpz_init(VD);
+  mpz_init(Vk);  mpz_init(Vkm1);  mpz_init_set_ui(b, 1);  mpz_init(t);
+
+  /* Baby steps: V_j for odd j < D/2 prime to D */
+  New(0, Vj, m, mpz_t);
+  lucas_v(V2, V1, 2, n);
+  mpz_set(Va, V1);                            /* V_-1 */
+  mpz_set(Vb, V1);                            /* V_1 */
+  mpz_init_set(Vj[0], V1);
+  for (j = 3, nslots = 1; j < D/2; j += 2) {
+    mpz_mul(t, Vb, V2);                       /* V_j = V_(j-2) V_2 - V_(j-4) */
+    mpz_sub(t, t, Va);
+    mpz_swap(Va, Vb);
+    mpz_mod(Vb, t, n);
+    if (gcd_ui(j, D) == 1)
+      mpz_init_set(Vj[nslots++], Vb);
+  }
+  if ((UV)nslots != m)
+    croak("stage2_poly: wrong baby step count for D=%lu", (unsigned long)D);
+  polyz_tree_init(&T, Vj, m, m, n);
+
+  /* Giant steps, m at a time */
+  New(0, G, m+1, mpz_t);
+  New(0, vals, m, mpz_t);
+  for (i = 0; i <= m; i++)  mpz_init(G[i]);
+  for (i = 0; i < m; i++)   mpz_init(vals[i]);
+  k = (B1 + D/2) / D;
+  kend = (B2 + D/2) / D;
+  lucas_v(VD, V1, D, n);
+  lucas_v(Vk, V1, k*D, n);
+  lucas_v(Vkm1, V1, (k == 0) ? D : (k-1)*D, n);
+  while (k <= kend) {
+    L = (kend - k + 1 < m) ? kend - k + 1 : m;
+    for (i = 0; i < L; i++, k++) {
+      mpz_set(vals[i], Vk);
+      mpz_mul(t, Vk, VD);
+      mpz_sub(t, t, Vkm1);
+      mpz_swap(Vkm1, Vk);
+      mpz_mod(Vk, t, n);
+    }
+    polyz_from_roots(G, vals, L, n);
+    polyz_tree_eval(vals, G, L, &T, n);
+    for (i = 0; i < m; i++) {
+      mpz_mul(b, b, vals[i]);
+      mpz_mod(b, b, n);
+    }
+    mpz_gcd(f, b, n);
+    if ( (mpz_cmp_ui(f, 1) != 0) && (mpz_cmp(f, n) != 0) )
+      break;
+    if (effort_spend(4 * L * lgm))
+      break;
+  }
+  mpz_gcd(f, b, n);
+
+  for (i = 0; i <= m; i++)  mpz_clear(G[i]);
+  for (i = 0; i < m; i++)   mpz_clear(vals[i]);
+  for (i = 0; i < m; i++)   mpz_clear(Vj[i]);
+  Safefree(G);
+  Safefree(vals);
+  Safefree(Vj);
+  polyz_tree_destroy(&T);
+  mpz_clear(V2);  mpz_clear(Va);  mpz_clear(Vb);  mpz_clear(VD);
+  mpz_clear(Vk);  mpz_clear(Vkm1);  mpz_clear(b);  mpz_clear(t);
+}
+
+static void stage2(mpz_t f, mpz_t V1, mpz_t n, UV B1, UV B2)
+{
+  if (B2 - B1 >= STAGE2_POLY_MIN)
+    stage2_poly(f, V1, n, B1, B2);
+  else
+    stage2_pairing(f, V1, n, B1, B2);
+}
+
+/* Stage 1 left a = x0^m, and V_1 = a + 1/a puts it in the form the
+ * continuations take: prime pairing for short ranges, and polynomial
+ * evaluation for long ones.  t is a temporary. */
+static void pm1_stage2(mpz_t f, mpz_t a, mpz_t n, UV B1, UV B2, mpz_t t)
+{
+  if (!mpz_invert(t, a, n)) {
+    mpz_gcd(f, a, n);
+  } else {
+    mpz_add(t, t, a);
+    mpz_mod(t, t, n);
+    stage2(f, t, n, B1, B2);
+  }
+}
+
+/* One product of stage 1: a = a^e, keeping the old a in savea, and f the
+ * gcd of a-1 with n.  Returns 1 to stop, when f is not 1 or the effort budget
+ * has run out. */
+static int pm1_chunk(mpz_t f, mpz_t a, mpz_t savea, mpz_t e, mpz_t n, mpz_t t)
+{
+  mpz_set(savea, a);
+  mpz_powm(a, a, e, n);
+  if (mpz_sgn(a))  mpz_sub_ui(t, a, 1);
+  else             mpz_sub_ui(t, n, 1);
+  mpz_gcd(f, t, n);
+  return mpz_cmp_ui(f, 1) != 0 || effort_spend(mpz_sizeinbase(e, 2));
+}
+
 int _GMP_pminus1_factor(mpz_t n, mpz_t f, UV B1, UV B2)
 {
   mpz_t a, savea, t;
-  UV q, saveq, j, sqrtB1;
+  UV q, c, nchunks, qlo = 2, qhi = 2;
   int _verbose = get_verbose_level();
+  int owned, done;
+  pm1_exponent_t* E;
   PRIME_ITERATOR(iter);
 
   TEST_FOR_2357(n, f);
@@ -1030,164 +2223,67 @@ int _GMP_pminus1_factor(mpz_t n, mpz_t f, UV B1, UV B2)
 
   /* STAGE 1
    * Montgomery 1987 p249-250 and Brent 1990 p5 both indicate we can calculate
-   * a^m mod n where m is the lcm of the integers to B1.  This can be done
-   * using either
-   *    m = calc_lcm(B), b = a^m mod n
-   * or
-   *    calculate_b_lcm(b, B1, a, n);
-   *
-   * The first means raising a to a huge power then doing the mod, which is
-   * inefficient and can be _very_ slow on some machines.  The latter does
-   * one powmod for each prime power, which works pretty well.  Yet another
-   * way to handle this is to loop over each prime p below B1, calculating
-   * a = a^(p^e) mod n, where e is the largest e such that p^e <= B1.
-   * My experience with GMP is that this last method is faster with large B1,
-   * sometimes a lot faster.
+   * a^m mod n where m is the lcm of the integers to B1.  Raising a to all of
+   * m at once gives no chance to stop early, and building m for each n is
+   * wasted work, so m is cached as products of about PM1_CHUNK_BITS each.
+   * Past PM1_CACHE_MAXB1 the products are made one at a time instead.  We
+   * do one powmod per product, then a GCD.
    *
-   * One thing that can speed things up quite a bit is not running the GCD
-   * on every step.  However with small factors this means we can easily end
-   * up with multiple factors between GCDs, so we allow backtracking.  This
-   * could also be added to stage 2, but it's far less likely to happen there.
+   * With small factors we can easily end up with multiple factors between
+   * GCDs, so we allow backtracking through that product one prime power at
+   * a time.  This could also be added to stage 2, but it's far less likely
+   * to happen there.
    */
-  j = 15;
   mpz_set_ui(a, 2);
-  mpz_set_ui(savea, 2);
-  saveq = 2;
-  /* We could wrap this in a loop trying a few different a values, in case
-   * the current one ended up going to 0. */
-  q = 2;
-  mpz_set_ui(t, 1);
-  sqrtB1 = (UV) sqrt(B1);
-  while (q <= B1) {
-    UV k = q;
-    if (q <= sqrtB1) {
-      UV kmin = B1/q;
-      while (k <= kmin)
-        k *= q;
+  if (B1 <= PM1_CACHE_MAXB1) {
+    E = get_pm1_exponent(B1, &owned);
+    nchunks = E->nchunks;
+    for (c = 0; c < nchunks; c++) {
+      qlo = E->firstq[c];
+      qhi = (c+1 < nchunks) ? E->firstq[c+1] : B1+1;
+      if (pm1_chunk(f, a, savea, E->chunk[c], n, t))
+        break;
     }
-    mpz_mul_ui(t, t, k);        /* Accumulate powers for a */
-    if ( (j++ % 32) == 0) {
-      mpz_powm(a, a, t, n);     /* a=a^(k1*k2*k3*...) mod n */
-      if (mpz_sgn(a))  mpz_sub_ui(t, a, 1);
-      else             mpz_sub_ui(t, n, 1);
-      mpz_gcd(f, t, n);         /* f = gcd(a-1, n) */
-      mpz_set_ui(t, 1);
-      if (mpz_cmp(f, n) == 0)
+    done = (c >= nchunks);
+    if (owned)
+      free_pm1_exponent(E);
+  } else {
+    /* Too large to keep, so each product is made as it is used */
+    mpz_t e;
+    mpz_init(e);
+    for (q = 2, done = 0; !done; done = (q > B1)) {
+      qlo = q;
+      mpz_set_ui(e, 1);
+      for ( ; q <= B1 && mpz_sizeinbase(e, 2) < PM1_CHUNK_BITS; q = prime_iterator_next(&iter))
+        mpz_mul_ui(e, e, pm1_prime_power(q, B1));
+      qhi = q;
+      if (pm1_chunk(f, a, savea, e, n, t))
         break;
-      if (mpz_cmp_ui(f, 1) != 0)
-        goto end_success;
-      saveq = q;
-      mpz_set(savea, a);
     }
-    q = prime_iterator_next(&iter);
+    mpz_clear(e);
   }
-  mpz_powm(a, a, t, n);
-  if (mpz_sgn(a))  mpz_sub_ui(t, a, 1);
-  else             mpz_sub_ui(t, n, 1);
-  mpz_gcd(f, t, n);
   if (mpz_cmp(f, n) == 0) {
     /* We found multiple factors.  Loop one at a time. */
-    prime_iterator_setprime(&iter, saveq);
+    prime_iterator_setprime(&iter, qlo);
     mpz_set(a, savea);
-    for (q = saveq; q <= B1; q = prime_iterator_next(&iter)) {
-      UV k = q;
-      if (q <= sqrtB1) {
-        UV kmin = B1/q;
-        while (k <= kmin)
-          k *= q;
-      }
-      mpz_powm_ui(a, a, k, n );
+    for (q = qlo; q < qhi; q = prime_iterator_next(&iter)) {
+      mpz_powm_ui(a, a, pm1_prime_power(q, B1), n);
       mpz_sub_ui(t, a, 1);
       mpz_gcd(f, t, n);
       if (mpz_cmp(f, n) == 0)
-        goto end_fail;
+        break;
       if (mpz_cmp_ui(f, 1) != 0)
-        goto end_success;
+        break;
     }
   }
   if ( (mpz_cmp_ui(f, 1) != 0) && (mpz_cmp(f, n) != 0) )
     goto end_success;
+  if (mpz_cmp(f, n) == 0 || !done)
+    goto end_fail;
 
-  /* STAGE 2
-   * This is the standard continuation which replaces the powmods in stage 1
-   * with two mulmods, with a GCD every 64 primes (no backtracking).
-   * This is quite a bit faster than stage 1.
-   * See Montgomery 1987, p250-253 for possible optimizations.
-   * We quickly precalculate a few of the prime gaps, and lazily cache others
-   * up to a gap of 222.  That's enough for a B2 value of 189 million.  We
-   * still work above that, we just won't cache the value for big gaps.
-   */
+  /* STAGE 2 */
   if (B2 > B1) {
-    mpz_t b, bm, bmdiff;
-    mpz_t precomp_bm[111];
-    int   is_precomp[111] = {0};
-    UV* primes = 0;
-    UV sp = 1;
-
-    mpz_init(bmdiff);
-    mpz_init_set(bm, a);
-    mpz_init_set_ui(b, 1);
-
-    /* Set the first 20 differences */
-    mpz_powm_ui(bmdiff, bm, 2, n);
-    mpz_init_set(precomp_bm[0], bmdiff);
-    is_precomp[0] = 1;
-    for (j = 1; j < 22; j++) {
-      mpz_mul(bmdiff, bmdiff, bm);
-      mpz_mul(bmdiff, bmdiff, bm);
-      mpz_tdiv_r(bmdiff, bmdiff, n);
-      mpz_init_set(precomp_bm[j], bmdiff);
-      is_precomp[j] = 1;
-    }
-
-    mpz_powm_ui(a, a, q, n );
-    if (B2 < 10000000) {
-      /* grab all the primes at once.  Hack around non-perfect iterator. */
-      primes = sieve_to_n(B2+300, 0);
-      for (sp = B1>>4; primes[sp] <= q; sp++)  ;
-      /* q is primes <= B1, primes[sp] is the next prime */
-    }
-
-    j = 31;
-    while (q <= B2) {
-      UV lastq, qdiff;
-
-      lastq = q;
-      q = primes ? primes[sp++] : prime_iterator_next(&iter);
-      qdiff = (q - lastq) / 2 - 1;
-
-      if (qdiff < 111 && is_precomp[qdiff]) {
-        mpz_mul(t, a, precomp_bm[qdiff]);
-      } else if (qdiff < 111) {
-        mpz_powm_ui(bmdiff, bm, q-lastq, n);
-        mpz_init_set(precomp_bm[qdiff], bmdiff);
-        is_precomp[qdiff] = 1;
-        mpz_mul(t, a, bmdiff);
-      } else {
-        mpz_powm_ui(bmdiff, bm, q-lastq, n);  /* Big gap */
-        mpz_mul(t, a, bmdiff);
-      }
-      mpz_tdiv_r(a, t, n);
-      if (mpz_sgn(a))  mpz_sub_ui(t, a, 1);
-      else             mpz_sub_ui(t, n, 1);
-      mpz_mul(b, b, t);
-      if ((j % 2) == 0)           /* put off mods a little */
-        mpz_tdiv_r(b, b, n);
-      if ( (j++ % 64) == 0) {     /* GCD every so often */
-        mpz_gcd(f, b, n);
-        if ( (mpz_cmp_ui(f, 1) != 0) && (mpz_cmp(f, n) != 0) )
-          break;
-      }
-    }
-    mpz_gcd(f, b, n);
-    mpz_clear(b);
-    mpz_clear(bm);
-    mpz_clear(bmdiff);
-    for (j = 0; j < 111; j++) {
-      if (is_precomp[j])
-        mpz_clear(precomp_bm[j]);
-    }
-    if (primes != 0) Safefree(primes);
+    pm1_stage2(f, a, n, B1, B2, t);
     if ( (mpz_cmp_ui(f, 1) != 0) && (mpz_cmp(f, n) != 0) )
       goto end_success;
   }
@@ -1208,51 +2304,61 @@ int _GMP_pminus1_factor(mpz_t n, mpz_t f, UV B1, UV B2)
     return 0;
 }
 
-static void pp1_pow(mpz_t X, mpz_t Y, unsigned long exp, mpz_t n)
+/* Continue p-1 from a = x0^E(B0) mod n, where E(B) is the product of the
+ * largest powers of the primes up to B that are at most B.  Stage 1 runs
+ * to the end without stopping for factors, so a is left at x0^E(B1) and
+ * can be saved and extended again.  Stage 2 to B2 follows if B2 > B1. */
+int _GMP_pminus1_resume(mpz_t n, mpz_t f, mpz_t a, UV B0, UV B1, UV B2)
 {
-  mpz_t x0;
-  unsigned long bit;
-  {
-    unsigned long v = exp;
-    unsigned long b = 1;
-    while (v >>= 1) b++;
-    bit = 1UL << (b-2);
-  }
-  mpz_init_set(x0, X);
-  mpz_mul(Y, X, X);
-  mpz_sub_ui(Y, Y, 2);
-  mpz_tdiv_r(Y, Y, n);
-  while (bit) {
-    if ( exp & bit ) {
-      mpz_mul(X, X, Y);
-      mpz_sub(X, X, x0);
-      mpz_mul(Y, Y, Y);
-      mpz_sub_ui(Y, Y, 2);
-    } else {
-      mpz_mul(Y, X, Y);
-      mpz_sub(Y, Y, x0);
-      mpz_mul(X, X, X);
-      mpz_sub_ui(X, X, 2);
+  mpz_t e, t;
+  UV q, k;
+  int found;
+  PRIME_ITERATOR(iter);
+
+  mpz_init_set_ui(e, 1);
+  mpz_init(t);
+  for (q = 2; q <= B1; q = prime_iterator_next(&iter)) {
+    if (q <= B0 && q > B1/q) {          /* no new powers until past B0 */
+      prime_iterator_setprime(&iter, B0);
+      continue;
+    }
+    for (k = 1; k <= B1/q; k *= q)
+      if (k*q > B0)
+        mpz_mul_ui(e, e, q);
+    if (mpz_sizeinbase(e, 2) >= PM1_CHUNK_BITS) {
+      mpz_powm(a, a, e, n);
+      mpz_set_ui(e, 1);
     }
-    mpz_mod(X, X, n);
-    mpz_mod(Y, Y, n);
-    bit >>= 1;
   }
-  mpz_clear(x0);
+  mpz_powm(a, a, e, n);
+  prime_iterator_destroy(&iter);
+
+  mpz_sub_ui(t, a, 1);
+  mpz_gcd(f, t, n);
+  found = mpz_cmp_ui(f, 1) && mpz_cmp(f, n);
+  if (!found && mpz_cmp_ui(f, 1) == 0 && B2 > B1) {
+    pm1_stage2(f, a, n, B1, B2, t);
+    found = mpz_cmp_ui(f, 1) && mpz_cmp(f, n);
+  }
+  mpz_clear(e);
+  mpz_clear(t);
+  if (!found) mpz_set(f, n);
+  return found;
 }
 
 int _GMP_pplus1_factor(mpz_t n, mpz_t f, UV P0, UV B1, UV B2)
 {
-  UV j, q, saveq, sqrtB1;
-  mpz_t X, Y, saveX;
+  UV j, q, saveq;
+  int i;
+  mpz_t X, saveX, w[5];
   PRIME_ITERATOR(iter);
 
   TEST_FOR_2357(n, f);
   if (B1 < 7) return 0;
 
   mpz_init_set_ui(X, P0);
-  mpz_init(Y);
   mpz_init(saveX);
+  for (i = 0; i < 5; i++)  mpz_init(w[i]);
 
   /* Montgomery 1987 */
   if (P0 == 0) {
@@ -1279,19 +2385,12 @@ int _GMP_pplus1_factor(mpz_t n, mpz_t f, UV P0, UV B1, UV B2)
     }
   }
 
-  sqrtB1 = (UV) sqrt(B1);
   j = 8;
   q = 2;
   saveq = q;
   mpz_set(saveX, X);
   while (q <= B1) {
-    UV k = q;
-    if (q <= sqrtB1) {
-      UV kmin = B1/q;
-      while (k <= kmin)
-        k *= q;
-    }
-    pp1_pow(X, Y, k, n);
+    pp1_prime_power(X, q, B1, n, w);
     if ( (j++ % 16) == 0) {
       mpz_sub_ui(f, X, 2);
       if (mpz_sgn(f) == 0)        break;
@@ -1310,13 +2409,7 @@ int _GMP_pplus1_factor(mpz_t n, mpz_t f, UV P0, UV B1, UV B2)
     prime_iterator_setprime(&iter, saveq);
     mpz_set(X, saveX);
     for (q = saveq; q <= B1; q = prime_iterator_next(&iter)) {
-      UV k = q;
-      if (q <= sqrtB1) {
-        UV kmin = B1/q;
-        while (k <= kmin)
-          k *= q;
-      }
-      pp1_pow(X, Y, k, n);
+      pp1_prime_power(X, q, B1, n, w);
       mpz_sub_ui(f, X, 2);
       if (mpz_sgn(f) == 0)        goto end_fail;
       mpz_gcd(f, f, n);
@@ -1326,12 +2419,21 @@ int _GMP_pplus1_factor(mpz_t n, mpz_t f, UV P0, UV B1, UV B2)
   }
   if ( (mpz_cmp_ui(f, 1) > 0) && (mpz_cmp(f, n) != 0) )
     goto end_success;
-  /* TODO: stage 2 */
+
+  /* STAGE 2
+   * X is V_m(P0), so it goes straight into the same continuations as p-1.
+   */
+  if (B2 > B1 && mpz_cmp_ui(f, 1) == 0) {
+    stage2(f, X, n, B1, B2);
+    if ( (mpz_cmp_ui(f, 1) != 0) && (mpz_cmp(f, n) != 0) )
+      goto end_success;
+  }
   end_fail:
     mpz_set(f,n);
   end_success:
     prime_iterator_destroy(&iter);
-    mpz_clear(X);  mpz_clear(Y);  mpz_clear(saveX);
+    mpz_clear(X);  mpz_clear(saveX);
+    for (i = 0; i < 5; i++)  mpz_clear(w[i]);
     return (mpz_cmp_ui(f, 1) != 0) && (mpz_cmp(f, n) != 0);
 }
 
@@ -5,8 +5,49 @@
 #include "ptypes.h"
 
 extern void _init_factor(void);
+extern void _destroy_factor(void);
 
+/* One stage of the factoring strategy used by factor().  Stages are tried
+ * in order on each composite whose size is in [minbits,maxbits], until one
+ * finds a factor.  A maxbits of 0 means no upper limit. */
+enum { FACTOR_SQUFOF, FACTOR_POWER, FACTOR_PMINUS1, FACTOR_PPLUS1,
+       FACTOR_ECM, FACTOR_QS, FACTOR_PBRENT, FACTOR_PRHO, FACTOR_HOLF,
+       FACTOR_ECM_SUYAMA,   /* ECM on Montgomery rather than Edwards curves */
+       FACTOR_ECM_AFFINE,   /* stage 1 on affine curves side by side */
+       FACTOR_NMETHODS };
+typedef struct {
+  int method;
+  UV  minbits, maxbits;
+  UV  arg1, arg2;     /* B1,B2 for p-1/p+1; B1,curves for ECM; or rounds */
+  UV  cost;           /* estimated mulmods, 0 if it depends on n */
+} factor_stage_t;
+
+extern int  factor_method(const char* name);
+extern const char* factor_method_name(int method);
+/* Replace the strategy with a copy of the stages, or the default if NULL */
+extern void set_factor_strategy(const factor_stage_t* stages, UV nstages);
+/* A copy of the current strategy, allocated with New.  Safefree it. */
+extern factor_stage_t* get_factor_strategy(UV* nstages);
+
+/* The complete factorization, croaking if a composite is left (the effort
+ * budget ran out or no strategy stage split it). */
 extern int factor(mpz_t n, mpz_t* factors[], int* exponents[]);
+/* Partial results are allowed here.  Also returns the status of each factor: 2 if it is proven prime, 1 if it
+ * is a probable prime, and 0 for composites that could not be factored.
+ * The status array must be freed with Safefree when nfactors > 0. */
+extern int factor_with_status(mpz_t n, mpz_t* factors[], int* exponents[], int* status[]);
+
+/* Keep up to this many factorizations of numbers over 64 bits, 0 to turn
+ * the cache off.  This empties the cache and resets the counters. */
+extern void set_factor_cache(UV entries);
+extern void factor_cache_stats(UV* hits, UV* misses, UV* entries);
+
+/* Threads used by factor() to work on several composites at once, 1 for
+ * none.  Always 1 when worker threads are not supported. */
+#define MAX_FACTOR_THREADS 64
+extern void set_factor_threads(int nthreads);
+extern int  get_factor_threads(void);
+
 extern void clear_factors(int nfactors, mpz_t* pfactors[], int* pexponents[]);
 
 extern void sigma(mpz_t res, mpz_t n, UV k);
@@ -23,6 +64,8 @@ extern UV   _GMP_trial_factor(mpz_t n, UV from_n, UV to_n);
 extern int  _GMP_prho_factor(mpz_t n, mpz_t f, UV a, UV rounds);
 extern int  _GMP_pbrent_factor(mpz_t n, mpz_t f, UV a, UV rounds);
 extern int  _GMP_pminus1_factor(mpz_t n, mpz_t f, UV B1, UV B2);
+/* p-1 from a saved stage 1 residue a at B0, to B1 then B2.  a is updated. */
+extern int  _GMP_pminus1_resume(mpz_t n, mpz_t f, mpz_t a, UV B0, UV B1, UV B2);
 extern int  _GMP_pplus1_factor(mpz_t n, mpz_t f, UV P0, UV B1, UV B2);
 extern int  _GMP_holf_factor(mpz_t n, mpz_t f, UV rounds);
 extern int  _GMP_squfof_factor(mpz_t n, mpz_t f, UV rounds);
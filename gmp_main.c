@@ -6,6 +6,8 @@
 #include "gmp_main.h"
 #include "primality.h"
 #include "prime_iterator.h"
+#include "prime_tree.h"
+#include "prac.h"
 #include "ecpp.h"
 #include "factor.h"
 
@@ -14,13 +16,11 @@
 
 static mpz_t _bgcd;
 static mpz_t _bgcd2;
-static mpz_t _bgcd3;
 #define BGCD_PRIMES       168
 #define BGCD_LASTPRIME    997
 #define BGCD_NEXTPRIME   1009
 #define BGCD2_PRIMES     1229
 #define BGCD2_NEXTPRIME 10007
-#define BGCD3_PRIMES     4203
 #define BGCD3_NEXTPRIME 40009
 
 #define NSMALLPRIMES 168
@@ -41,17 +41,18 @@ void _GMP_init(void)
   mpz_init(_bgcd);
   _GMP_pn_primorial(_bgcd, BGCD_PRIMES);   /* mpz_primorial_ui(_bgcd, 1000) */
   mpz_init_set_ui(_bgcd2, 0);
-  mpz_init_set_ui(_bgcd3, 0);
   _init_factor();
 }
 
 void _GMP_destroy(void)
 {
+  _destroy_factor();
+  prime_tree_global_shutdown();
+  prac_global_shutdown();
   prime_iterator_global_shutdown();
   clear_randstate();
   mpz_clear(_bgcd);
   mpz_clear(_bgcd2);
-  mpz_clear(_bgcd3);
   destroy_ecpp_gcds();
 }
 
@@ -98,24 +99,6 @@ int primality_pretest(mpz_t n)
     if (mpz_cmp_ui(n, BGCD_NEXTPRIME*BGCD_NEXTPRIME) < 0)
       { mpz_clear(t); return 2; }
 
-    /* If we're reasonably large, do a gcd with more primes */
-    if (log2n > 700) {
-      if (mpz_sgn(_bgcd3) == 0) {
-        _GMP_pn_primorial(_bgcd3, BGCD3_PRIMES);
-        mpz_divexact(_bgcd3, _bgcd3, _bgcd);
-      }
-      mpz_gcd(t, n, _bgcd3);
-      if (mpz_cmp_ui(t, 1))
-        { mpz_clear(t); return 0; }
-    } else if (log2n > 300) {
-      if (mpz_sgn(_bgcd2) == 0) {
-        _GMP_pn_primorial(_bgcd2, BGCD2_PRIMES);
-        mpz_divexact(_bgcd2, _bgcd2, _bgcd);
-      }
-      mpz_gcd(t, n, _bgcd2);
-      if (mpz_cmp_ui(t, 1))
-        { mpz_clear(t); return 0; }
-    }
     mpz_clear(t);
     /* Do more trial division if we think we should.
      * According to Menezes (section 4.45) as well as Park (ISPEC 2005),
@@ -128,16 +111,22 @@ int primality_pretest(mpz_t n)
      *   log2n =  99678, E=   56956000 uS, D=0.55 uS, E/D = 0.01  * log2n
      *   log2n =  33412, E=    4289000 uS, D=0.30 uS, E/D = 0.013 * log2n
      *   log2n =  13484, E=     470000 uS, D=0.21 uS, E/D = 0.012 * log2n
-     * Our trial division could also be further improved for large inputs.
+     * Below 2^24 the division is now gcds with the cached prime product
+     * trees, so D is several times smaller than these.
      */
-    if (log2n > 16000) {
-      double dB = (double)log2n * (double)log2n * 0.005;
-      if (BITS_PER_WORD == 32 && dB > 4200000000.0) dB = 4200000000.0;
-      if (_GMP_trial_factor(n, BGCD3_NEXTPRIME, (UV)dB))  return 0;
-    } else if (log2n > 4000) {
-      if (_GMP_trial_factor(n, BGCD3_NEXTPRIME, 80*log2n))  return 0;
-    } else if (log2n > 1600) {
-      if (_GMP_trial_factor(n, BGCD3_NEXTPRIME, 30*log2n))  return 0;
+    {
+      UV limit = 0;
+      if (log2n > 16000) {
+        double dB = (double)log2n * (double)log2n * 0.005;
+        if (BITS_PER_WORD == 32 && dB > 4200000000.0) dB = 4200000000.0;
+        limit = (UV)dB;
+      }
+      else if (log2n > 4000)  limit = 80*log2n;
+      else if (log2n > 1600)  limit = 30*log2n;
+      else if (log2n >  700)  limit = BGCD3_NEXTPRIME-1;
+      else if (log2n >  300)  limit = BGCD2_NEXTPRIME-1;
+      if (limit > 0 && _GMP_trial_factor(n, BGCD_NEXTPRIME, limit))
+        return 0;
     }
   }
   return 1;
@@ -279,6 +268,135 @@ void _GMP_prev_prime(mpz_t n)
   }
 }
 
+/*****************************************************************************/
+
+/* Walking consecutive primes.  The sieved window and the BPSW results for its
+ * candidates are kept, so each step costs about one BPSW test and a new
+ * window is only sieved when we walk off the end of the current one. */
+
+/* Window width, in multiples of log(n).  Larger than NPS_MERIT since we
+ * expect to use many primes from each window. */
+#define WALK_MERIT  (4*NPS_MERIT)
+
+static void _walk_clear_window(prime_walk_t* w)
+{
+  if (w->cand != 0) {
+    Safefree(w->cand);
+    Safefree(w->state);
+  }
+  w->cand = 0;
+  w->state = 0;
+  w->ncand = 0;
+  w->width = 0;
+}
+
+/* Sieve a window of candidates just above v (forward) or just below v.
+ * Returns 0 without a window if v is too small to sieve this way. */
+static int _walk_window(prime_walk_t* w, mpz_t v, int forward)
+{
+  UV i, n, log2n, log2log2n, width, depth;
+  uint32_t* comp;
+
+  log2n = mpz_sizeinbase(v, 2);
+  for (log2log2n = 1, i = log2n; i >>= 1; ) log2log2n++;
+  width = (UV) (WALK_MERIT/1.4427 * (double)log2n + 0.5);
+  width = 64 * ((width+63)/64);
+  depth = NPS_DEPTH(log2n, log2log2n);
+
+  _walk_clear_window(w);
+  if (forward) {
+    mpz_add_ui(w->base, v, mpz_even_p(v) ? 1 : 2);    /* next odd */
+  } else {
+    if (mpz_cmp_ui(v, width) <= 0) return 0;
+    mpz_sub_ui(w->base, v, mpz_even_p(v) ? 1 : 2);    /* prev odd */
+    mpz_sub_ui(w->base, w->base, width-2);
+  }
+  /* The sieve would remove the sieving primes themselves */
+  if (mpz_cmp_ui(w->base, depth) <= 0) return 0;
+
+  comp = partial_sieve(w->base, width, depth);  /* base is now even */
+  New(0, w->cand, width/2, UV);
+  for (i = 1, n = 0; i < width; i += 2)
+    if (!TSTAVAL(comp, i))
+      w->cand[n++] = i;
+  Safefree(comp);
+  Newz(0, w->state, n+1, unsigned char);
+  w->ncand = n;
+  w->width = width;
+  w->idx = forward ? -1 : (IV)n;
+  return 1;
+}
+
+/* Is candidate i prime?  Tests once, then remembers. */
+static int _walk_is_prime(prime_walk_t* w, UV i)
+{
+  if (w->state[i] == 0) {
+    mpz_add_ui(w->t, w->base, w->cand[i]);
+    w->state[i] = _GMP_BPSW(w->t) ? 1 : 2;
+  }
+  return (w->state[i] == 1);
+}
+
+void prime_walk_init(prime_walk_t* w, mpz_t start)
+{
+  mpz_init_set(w->p, start);
+  mpz_init(w->base);
+  mpz_init(w->t);
+  w->cand = 0;
+  w->state = 0;
+  _walk_clear_window(w);
+}
+
+void prime_walk_destroy(prime_walk_t* w)
+{
+  _walk_clear_window(w);
+  mpz_clear(w->t);
+  mpz_clear(w->base);
+  mpz_clear(w->p);
+}
+
+void prime_walk_next(prime_walk_t* w)
+{
+  IV i;
+  while (1) {
+    if (w->cand == 0 && !_walk_window(w, w->p, 1)) {
+      _GMP_next_prime(w->p);                /* Small values */
+      return;
+    }
+    for (i = w->idx+1; i < (IV)w->ncand; i++) {
+      if (_walk_is_prime(w, i)) {
+        w->idx = i;
+        mpz_add_ui(w->p, w->base, w->cand[i]);
+        return;
+      }
+    }
+    /* Continue from the last value this window covered */
+    mpz_add_ui(w->p, w->base, w->width-1);
+    _walk_clear_window(w);
+  }
+}
+
+void prime_walk_prev(prime_walk_t* w)
+{
+  IV i;
+  while (1) {
+    if (w->cand == 0 && !_walk_window(w, w->p, 0)) {
+      _GMP_prev_prime(w->p);                /* Small values */
+      return;
+    }
+    for (i = w->idx-1; i >= 0; i--) {
+      if (_walk_is_prime(w, i)) {
+        w->idx = i;
+        mpz_add_ui(w->p, w->base, w->cand[i]);
+        return;
+      }
+    }
+    /* Continue from the first value this window covered */
+    mpz_add_ui(w->p, w->base, 1);
+    _walk_clear_window(w);
+  }
+}
+
 
 /*****************************************************************************/
 
@@ -931,23 +1049,51 @@ char* pidigits(UV n) {
 }
 
 typedef struct {
-  uint32_t nmax;
-  uint32_t nsize;
-  UV* list;
+  UV nmax;
+  UV nsize;
+  UV* list;     /* NULL if we are only counting */
 } vlist;
-#define INIT_VLIST(v) \
+#define INIT_VLIST(v, count_only) \
   v.nsize = 0; \
-  v.nmax = 1024; \
-  New(0, v.list, v.nmax, UV);
+  v.nmax = (count_only) ? 0 : 1024; \
+  v.list = 0; \
+  if (v.nmax > 0) New(0, v.list, v.nmax, UV);
 #define RESIZE_VLIST(v, size) \
-  do { if (v.nmax < size) Renew(v.list, v.nmax = size, UV); } while (0)
+  do { if (v.list != 0 && v.nmax < size) Renew(v.list, v.nmax = size, UV); } while (0)
 #define PUSH_VLIST(v, n) \
   do { \
+    if (v.list == 0) { v.nsize++; break; } \
     if (v.nsize >= v.nmax) \
       Renew(v.list, v.nmax += 1024, UV); \
     v.list[v.nsize++] = n; \
   } while (0)
 
+/* Count-only sieving walks the range in segments this wide, so memory use
+ * stays constant (the sieve uses width/16 bytes) no matter the range. */
+#define COUNT_SEGMENT_WIDTH  67108864UL
+
+static INLINE uint32_t popcnt32(uint32_t w) {
+#if defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4))
+  return __builtin_popcount(w);
+#else
+  w = w - ((w >> 1) & 0x55555555U);
+  w = (w & 0x33333333U) + ((w >> 2) & 0x33333333U);
+  w = (w + (w >> 4)) & 0x0F0F0F0FU;
+  return (w * 0x01010101U) >> 24;
+#endif
+}
+/* Number of unmarked values in the first nbits entries of an odds sieve */
+static UV count_zero_bits(const uint32_t* comp, UV nbits) {
+  UV i, nwords = nbits / 32, count = 0;
+  for (i = 0; i < nwords; i++)
+    count += 32 - popcnt32(comp[i]);
+  if (nbits % 32) {
+    uint32_t mask = (1U << (nbits % 32)) - 1;
+    count += (nbits % 32) - popcnt32(comp[nwords] & mask);
+  }
+  return count;
+}
+
 #define ADDVAL32(v, n, max, val) \
   do { if (n >= max) Renew(v, max += 1024, UV);  v[n++] = val; } while (0)
 #define SWAPL32(l1, n1, m1,  l2, n2, m2) \
@@ -955,7 +1101,7 @@ typedef struct {
             t_ = n1;  n1 = n2;  n2 = t_; \
             t_ = m1;  m1 = m2;  m2 = t_; }
 
-UV* sieve_primes(mpz_t inlow, mpz_t high, UV k, UV *rn) {
+static UV* _sieve_primes(mpz_t inlow, mpz_t high, UV k, int count_only, UV *rn) {
   mpz_t t, low;
   int test_primality = 0, k_primality = 0;
   uint32_t* comp;
@@ -965,13 +1111,24 @@ UV* sieve_primes(mpz_t inlow, mpz_t high, UV k, UV *rn) {
   if (mpz_cmp(inlow, high) > 0) { *rn = 0; return 0; }
 
   mpz_init(t);
+  mpz_init(low);
   mpz_sqrt(t, high);           /* No need for k to be > sqrt(high) */
   /* If auto-setting k or k >= sqrt(n), pick a good depth and test primality */
   if (k == 0 || mpz_cmp_ui(t, k) <= 0) {
-    /* TODO: We need to take into account the sieve width */
     UV hbits = mpz_sizeinbase(high,2);
     test_primality = 1;
     k = (hbits < 100) ? 50000000 : hbits*500000;
+    /* Each sieving prime costs an mpz remainder.  Past about width/4 they
+     * remove too few candidates to pay for that, so narrow ranges use a
+     * shallower sieve and let BPSW do the rest. */
+    mpz_sub(low, high, inlow);
+    if (mpz_cmp_ui(low, 4*k) < 0) {
+      k = mpz_get_ui(low) / 4;
+      if (k < 1000) k = 1000;
+      /* A complete sieve needs no BPSW at all, so go deeper if that is near */
+      if (mpz_cmp_ui(t, 256*k) <= 0)
+        k = mpz_get_ui(t);
+    }
   }
   /* If k >= sqrtn, sieving is enough.  Use k=sqrtn, turn off post-sieve test */
   if (mpz_cmp_ui(t, k) <= 0) {
@@ -980,10 +1137,10 @@ UV* sieve_primes(mpz_t inlow, mpz_t high, UV k, UV *rn) {
     test_primality = 0;        /* Don't run BPSW */
   }
 
-  INIT_VLIST(retlist);
+  INIT_VLIST(retlist, count_only);
 
   /* If we want small primes, do it quickly */
-  if ( (k_primality || test_primality) && mpz_cmp_ui(high,2000000000U) <= 0 ) {
+  if ( !count_only && (k_primality || test_primality) && mpz_cmp_ui(high,2000000000U) <= 0 ) {
     UV ulow = mpz_get_ui(inlow), uhigh = mpz_get_ui(high);
     if (uhigh < 1000000U || uhigh/ulow >= 4) {
       UV n, Pi, *primes;
@@ -994,13 +1151,14 @@ UV* sieve_primes(mpz_t inlow, mpz_t high, UV k, UV *rn) {
           PUSH_VLIST(retlist, primes[n]-ulow);
       }
       Safefree(primes);
+      mpz_clear(low);
       mpz_clear(t);
       *rn = retlist.nsize;
       return retlist.list;
     }
   }
 
-  mpz_init_set(low, inlow);
+  mpz_set(low, inlow);
   if (k < 2) k = 2;   /* Should have been handled by quick return */
 
   /* Include all primes up to k, since they will get filtered */
@@ -1024,10 +1182,14 @@ UV* sieve_primes(mpz_t inlow, mpz_t high, UV k, UV *rn) {
     /* Get bit array of odds marked with composites(k) marked with 1 */
     comp = partial_sieve(low, length, k);
     mpz_sub(t, low, inlow); offset = mpz_get_ui(t);
-    for (i = 1; i <= length; i += 2) {
-      if (!TSTAVAL(comp, i)) {
-        if (!test_primality || (mpz_add_ui(t,low,i),_GMP_BPSW(t)))
-          PUSH_VLIST(retlist, i - offset);
+    if (count_only && !test_primality) {
+      retlist.nsize += count_zero_bits(comp, (length+1)/2);
+    } else {
+      for (i = 1; i <= length; i += 2) {
+        if (!TSTAVAL(comp, i)) {
+          if (!test_primality || (mpz_add_ui(t,low,i),_GMP_BPSW(t)))
+            PUSH_VLIST(retlist, i - offset);
+        }
       }
     }
     Safefree(comp);
@@ -1039,7 +1201,7 @@ UV* sieve_primes(mpz_t inlow, mpz_t high, UV k, UV *rn) {
   return retlist.list;
 }
 
-UV* sieve_twin_primes(mpz_t low, mpz_t high, UV twin, UV *rn) {
+static UV* _sieve_twin_primes(mpz_t low, mpz_t high, UV twin, int count_only, UV *rn) {
   mpz_t t;
   UV i, length, k, starti = 1, skipi = 2;
   uint32_t* comp;
@@ -1059,7 +1221,7 @@ UV* sieve_twin_primes(mpz_t low, mpz_t high, UV twin, UV *rn) {
   if (mpz_cmp(low, high) > 0 || (i == 1 || i == 3 || i == 5))
     { *rn = 0; return 0; }
 
-  INIT_VLIST(retlist);
+  INIT_VLIST(retlist, count_only);
   mpz_init(t);
 
   /* Use a much higher k value than we do for primes */
@@ -1107,7 +1269,7 @@ UV* sieve_twin_primes(mpz_t low, mpz_t high, UV twin, UV *rn) {
 
 #define addmodded(r,a,b,n)  do { r = a + b; if (r >= n) r -= n; } while(0)
 
-UV* sieve_cluster(mpz_t low, mpz_t high, uint32_t* cl, UV nc, UV *rn) {
+static UV* _sieve_cluster(mpz_t low, mpz_t high, uint32_t* cl, UV nc, int count_only, UV *rn) {
   mpz_t t, savelow;
   vlist retlist;
   UV i, ppr, nres, allocres;
@@ -1124,15 +1286,15 @@ UV* sieve_cluster(mpz_t low, mpz_t high, uint32_t* cl, UV nc, UV *rn) {
   int run_pretests = 0;
   int _verbose = get_verbose_level();
 
-  if (nc == 1) return sieve_primes(low, high, 0, rn);
-  if (nc == 2) return sieve_twin_primes(low, high, cl[1], rn);
+  if (nc == 1) return _sieve_primes(low, high, 0, count_only, rn);
+  if (nc == 2) return _sieve_twin_primes(low, high, cl[1], count_only, rn);
 
   if (mpz_even_p(low))           mpz_add_ui(low, low, 1);
   if (mpz_even_p(high))          mpz_sub_ui(high, high, 1);
 
   if (mpz_cmp(low, high) > 0) { *rn = 0; return 0; }
 
-  INIT_VLIST(retlist);
+  INIT_VLIST(retlist, count_only);
   mpz_init(t);
 
   /* Handle small values that would get sieved away */
@@ -1363,3 +1525,58 @@ UV* sieve_cluster(mpz_t low, mpz_t high, uint32_t* cl, UV nc, UV *rn) {
   *rn = retlist.nsize;
   return retlist.list;
 }
+
+UV* sieve_primes(mpz_t low, mpz_t high, UV k, UV *rn) {
+  return _sieve_primes(low, high, k, 0, rn);
+}
+UV* sieve_twin_primes(mpz_t low, mpz_t high, UV twin, UV *rn) {
+  return _sieve_twin_primes(low, high, twin, 0, rn);
+}
+UV* sieve_cluster(mpz_t low, mpz_t high, uint32_t* cl, UV nc, UV *rn) {
+  return _sieve_cluster(low, high, cl, nc, 0, rn);
+}
+
+/* Counting versions.  Nothing is stored, and the prime and twin sieves are
+ * run in fixed-size segments.  low and high are not modified. */
+static UV _count_segmented(mpz_t low, mpz_t high, UV k, UV twin)
+{
+  mpz_t seglow, seghigh, next;
+  UV rn, count = 0;
+
+  mpz_init_set(seglow, low);
+  mpz_init(seghigh);
+  mpz_init(next);
+  while (mpz_cmp(seglow, high) <= 0) {
+    mpz_add_ui(seghigh, seglow, COUNT_SEGMENT_WIDTH-1);
+    if (mpz_cmp(seghigh, high) > 0)
+      mpz_set(seghigh, high);
+    mpz_add_ui(next, seghigh, 1);
+    if (twin == 0) (void) _sieve_primes(seglow, seghigh, k, 1, &rn);
+    else           (void) _sieve_twin_primes(seglow, seghigh, twin, 1, &rn);
+    count += rn;
+    mpz_set(seglow, next);
+  }
+  mpz_clear(next);
+  mpz_clear(seghigh);
+  mpz_clear(seglow);
+  return count;
+}
+UV sieve_primes_count(mpz_t low, mpz_t high, UV k) {
+  return _count_segmented(low, high, k, 0);
+}
+UV sieve_twin_primes_count(mpz_t low, mpz_t high, UV twin) {
+  MPUassert( twin > 0, "twin prime offset is zero" );
+  return _count_segmented(low, high, 0, twin);
+}
+UV sieve_cluster_count(mpz_t low, mpz_t high, uint32_t* cl, UV nc) {
+  mpz_t seglow, seghigh;
+  UV rn;
+  if (nc == 1) return sieve_primes_count(low, high, 0);
+  if (nc == 2) return sieve_twin_primes_count(low, high, cl[1]);
+  mpz_init_set(seglow, low);
+  mpz_init_set(seghigh, high);
+  (void) _sieve_cluster(seglow, seghigh, cl, nc, 1, &rn);
+  mpz_clear(seghigh);
+  mpz_clear(seglow);
+  return rn;
+}
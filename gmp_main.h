@@ -12,6 +12,23 @@ extern int  primality_pretest(mpz_t n);
 extern void _GMP_next_prime(mpz_t n);
 extern void _GMP_prev_prime(mpz_t n);
 
+/* Walks consecutive primes in either direction, keeping the sieved window */
+typedef struct {
+  mpz_t          p;        /* the current value */
+  mpz_t          base;     /* the window holds base+cand[i] */
+  mpz_t          t;
+  UV             width;
+  UV             ncand;    /* number of sieve survivors in the window */
+  UV            *cand;     /* their offsets, increasing */
+  unsigned char *state;    /* 0 untested, 1 prime, 2 composite */
+  IV             idx;      /* p is cand[idx], -1 if below, ncand if above */
+} prime_walk_t;
+
+extern void prime_walk_init(prime_walk_t* w, mpz_t start);
+extern void prime_walk_destroy(prime_walk_t* w);
+extern void prime_walk_next(prime_walk_t* w);
+extern void prime_walk_prev(prime_walk_t* w);
+
 extern void _GMP_pn_primorial(mpz_t prim, UV n);
 extern void _GMP_primorial(mpz_t prim, UV n);
 extern void _GMP_lcm_of_consecutive_integers(UV B, mpz_t m);
@@ -32,4 +49,8 @@ extern UV* sieve_primes(mpz_t low, mpz_t high, UV k, UV *rn);
 extern UV* sieve_twin_primes(mpz_t low, mpz_t high, UV twin, UV *rn);
 extern UV* sieve_cluster(mpz_t low, mpz_t high, uint32_t* cl, UV nc, UV *rn);
 
+extern UV sieve_primes_count(mpz_t low, mpz_t high, UV k);
+extern UV sieve_twin_primes_count(mpz_t low, mpz_t high, UV twin);
+extern UV sieve_cluster_count(mpz_t low, mpz_t high, uint32_t* cl, UV nc);
+
 #endif
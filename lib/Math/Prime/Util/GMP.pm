@@ -42,6 +42,8 @@ our @EXPORT_OK = qw(
                      sieve_primes
                      sieve_twin_primes
                      sieve_prime_cluster
+                     twin_prime_count
+                     prime_cluster_count
                      sieve_range
                      next_prime
                      prev_prime
@@ -53,12 +55,24 @@ our @EXPORT_OK = qw(
                      holf_factor
                      squfof_factor
                      ecm_factor
+                     pminus1_save ecm_save resume_save resume_factor
                      qs_factor
                      factor
+                     factor_with_status
+                     set_factor_strategy
+                     get_factor_strategy
+                     set_factor_cache
+                     factor_cache_stats
+                     set_factor_threads
+                     set_effort_budget
+                     effort_exhausted
+                     smooth_parts
+                     smooth_factors
                      sigma
                      chinese
                      moebius
                      prime_count
+                     nth_prime
                      primorial
                      pn_primorial
                      factorial
@@ -79,8 +93,6 @@ our @EXPORT_OK = qw(
                      ramanujan_tau
                      Pi
                    );
-                   # Should add:
-                   # nth_prime
 our %EXPORT_TAGS = (all => [ @EXPORT_OK ]);
 
 BEGIN {
@@ -160,6 +172,10 @@ sub primes {
   [ sieve_primes($low, $high, 0) ];
 }
 
+package Math::Prime::Util::GMP::PrimeIterator;
+# The object holds a pointer to C memory, so new threads don't get copies
+sub CLONE_SKIP { 1 }
+
 1;
 
 __END__
@@ -823,7 +839,25 @@ out the cluster from a list of primes.  For that example, a range of
 C<10^13> takes less than a second to search -- thousands of times faster
 than filtering results from primes or twin primes.
 Shorter clusters are not quite this efficient, and the overhead for
-returning large arrays should not be ignored.
+returning large arrays should not be ignored.  If only the number of
+clusters is needed, use L</prime_cluster_count>.
+
+=head2 twin_prime_count
+
+  my $n = twin_prime_count(10**20, 10**20 + 10**9);
+
+Given two arguments C<low> and C<high>, returns the number of lower twin
+primes in the interval (inclusive).  This is the count of values that
+L</sieve_twin_primes> would return, but no list is built and the range is
+sieved in fixed-size segments, so memory use does not grow with the width.
+
+=head2 prime_cluster_count
+
+  # Count prime quadruplets
+  my $n = prime_cluster_count(10**15, 10**15 + 10**12, 2,6,8);
+
+Takes the same arguments as L</sieve_prime_cluster> and returns the number
+of clusters found in the range rather than the list of them.
 
 
 =head2 next_prime
@@ -849,6 +883,57 @@ that is less than the input number).
 The function L</is_prob_prime> is used to determine when a prime is found,
 hence the result is a probable prime (using BPSW).
 
+=head2 Math::Prime::Util::GMP::PrimeIterator
+
+  my $it = Math::Prime::Util::GMP::PrimeIterator->new("1" . "0" x 50);
+  say $it->value;                   # first prime >= 10^50
+  say $it->next for 1 .. 100;       # the next 100 primes
+  say $it->prev;                    # and back one
+
+An object for walking consecutive primes in either direction.  C<new>
+takes an optional start (default 2) and positions the iterator on the
+first prime greater than or equal to it.  C<value> returns the current
+prime, while C<next> and C<prev> move to the next or previous prime and
+return it.  Moving below 2 gives 0.
+
+Unlike repeated calls to L</next_prime>, the iterator keeps its sieved
+window and the results of primality tests done in it, so walking costs
+about one BPSW test per prime and a new window is sieved only when the
+walk leaves the current one.  As with L</next_prime>, results are
+probable primes.
+
+Iterators are not copied into new threads.  In a thread created after the
+iterator, the variable is an unblessed reference to C<undef>.
+
+=head2 prime_count
+
+  my $n = prime_count(10**25, 10**25 + 10**7);
+  my $pi = prime_count(10**13);
+
+Given two arguments C<low> and C<high>, returns the number of primes in the
+interval (inclusive).  Given one argument C<n>, returns the number of primes
+less than or equal to C<n>.
+
+Narrow ranges are sieved in segments, with the sieve depth chosen from the
+width of the range, and the survivors are tested with BPSW.  Hence for inputs
+over C<2^64> the count is of probable primes.  Ranges that are wide compared
+to C<high^(2/3)> are instead computed as C<pi(high) - pi(low-1)> using the
+Lagarias-Miller-Odlyzko method, which is exact.  This takes about 2 seconds
+for C<10^13> and grows by about 5x for each power of ten.  Memory use is
+about 140MB at C<10^20>, and inputs much above C<2^88> are not supported
+by this method.
+
+=head2 nth_prime
+
+  say "The ten billionth prime is ", nth_prime(10**10);
+
+Given a non-negative integer C<n>, returns the C<n>th prime, with
+C<nth_prime(1) = 2>.  Returns 0 if C<n> is 0.  The inverse of the Riemann R
+function gives an estimate C<x>, L</prime_count> finds C<pi(x)> exactly, and
+the remaining distance is sieved.  The time is dominated by the prime count,
+so C<nth_prime(10**12)> takes a few seconds and each further power of ten
+costs about 5x more.
+
 
 =head2 lucasu
 
@@ -1287,7 +1372,8 @@ Like most advanced factoring programs, a mix of methods is used.  This
 includes trial division for small factors, perfect power detection,
 Pollard's Rho, Pollard's P-1 with various smoothness and stage settings,
 Hart's OLF (a Fermat variant), ECM (elliptic curve method), and
-QS (quadratic sieve).
+QS (quadratic sieve).  The order and parameters of the methods can be changed
+with L</set_factor_strategy>.
 Certainly improvements could be designed for this algorithm
 (suggestions are welcome).
 
@@ -1305,6 +1391,165 @@ L<gmp-ecm|http://ecm.gforge.inria.fr/>, and
 L<GGNFS|http://sourceforge.net/projects/ggnfs/>.
 
 
+=head2 factor_with_status
+
+  for my $f (factor_with_status($n)) {
+    my($p, $e, $status) = @$f;
+    warn "$p is an unfactored composite\n" if $status == 0;
+  }
+
+Factors the input like L</factor>, but returns one array reference per
+distinct factor in numerical order, holding the factor, its exponent, and
+its status:  2 if the factor is proven prime, 1 if it is a probable prime
+(as L</is_prob_prime> would return), and 0 if it is a composite that could
+not be factored.  The status comes from the tests made while factoring, so
+there is no need to test the factors again.  Prime factors below C<2^64> are
+always proven.  Composites are only left when the effort budget runs out
+(see L</set_effort_budget>) or no stage of the factoring strategy splits
+them.  The input 1 gives an empty list, and 0 gives C<[0,1,0]>.
+
+=head2 set_factor_strategy
+
+  # Inputs like p-1 for primes p are often smooth: go to p-1 early.
+  set_factor_strategy(
+    [ 'power' ],
+    [ 'pminus1', 0,  0, 1000000, 50000000 ],
+    [ 'ecm',     0, 99,    5000,       40 ],
+    get_factor_strategy(),
+  );
+  set_factor_strategy();   # back to the default
+
+Sets the sequence of methods L</factor> uses on each composite it cannot
+finish with trial division.  Each stage is an array reference:
+
+  [ method, minbits, maxbits, arg1, arg2 ]
+
+The stages are tried in order on each composite cofactor between C<minbits>
+and C<maxbits> bits in size (a C<maxbits> of 0 means no limit), until one
+finds a factor.  Any cofactor left when all stages fail is returned as if it
+were prime.  The method is one of C<power>, C<squfof>, C<prho>, C<pbrent>,
+C<pminus1>, C<pplus1>, C<holf>, C<ecm>, C<ecm_suyama>, C<ecm_affine>, or
+C<qs>, and the arguments are those of the matching single-method function
+(e.g. C<B1> and the number of curves for C<ecm>).  C<ecm_suyama> and
+C<ecm_affine> are ECM on the curves L</ecm_factor> uses with C<suyama> and
+C<affine>.  Arguments of 0 get the same defaults as those functions.
+
+Called with no arguments, this restores the default strategy.  The strategy
+is shared by every thread in the process.
+
+=head2 get_factor_strategy
+
+  for my $s (get_factor_strategy()) {
+    my($method, $minbits, $maxbits, $arg1, $arg2, $cost) = @$s;
+    ...
+  }
+
+Returns the current list of stages used by L</factor>, in the form taken by
+L</set_factor_strategy>, with an estimate of the stage's cost in modular
+multiplications as a sixth element (0 for QS, which depends on the input).
+The default strategy runs SQUFOF for native sized inputs, then p-1 and
+increasingly large ECM, with QS for 30 to 90 digits.
+
+=head2 set_factor_cache
+
+  set_factor_cache(10000);
+  my($t, $s, $l) = (totient($n), sigma($n), carmichael_lambda($n));
+  my($hits, $misses, $entries) = factor_cache_stats();
+  set_factor_cache(0);     # off
+
+Keeps up to the given number of factorizations of inputs larger than 64 bits,
+evicting the least recently used.  This is used by L</factor> and everything
+that factors internally, such as L</totient>, L</sigma>, L</moebius>,
+L</carmichael_lambda>, and L</znorder>, so calling several of these with the
+same input, or on recurring values such as C<p-1>, factors it only once.
+Factorizations with unfactored composites are not kept.
+
+The cache is off by default.  Each call empties it and resets the counters,
+and a size of 0 turns it off.  It is shared by every thread in the process.
+
+=head2 factor_cache_stats
+
+Returns the number of cache hits, the number of misses, and the number of
+factorizations held since the last call to L</set_factor_cache>.
+
+=head2 set_factor_threads
+
+  my $nthreads = set_factor_threads(4);
+  my @f = factor($n);
+  set_factor_threads(1);   # back to the default
+
+Lets L</factor> and everything that factors internally use up to the given
+number of threads, counting the calling one.  Once an input has split into
+more than one composite, each gets its next stage of the strategy at the
+same time, with the ECM and Pollard rho stages run on worker threads.
+p-1, p+1, QS, and other stages run on the calling thread.  Inputs that stay
+in one piece, or split only into primes, see no benefit.  The workers are
+charged to the caller's L<effort budget|/set_effort_budget>, and the results
+are the same as with one thread.
+
+Returns the number of threads that will be used, which is 1 if the module
+was built without thread support.  The setting applies to every thread in
+the process.
+
+=head2 set_effort_budget
+
+  set_effort_budget(60);          # give up after about a minute
+  my @f = factor($n);
+  warn "partial factorization" if effort_exhausted();
+  set_effort_budget();            # no limit
+
+Limits the work done by each later call to L</factor>, the factoring
+methods, and the proof methods.  The first argument is a wall clock limit
+in whole seconds, and the optional second is a limit on the number of
+operations, roughly modular multiplications as estimated by
+L</get_factor_strategy>.  A limit of 0 means none, so calling with no
+arguments removes the budget.  The count starts over at every call, so one
+call running out does not affect the next.  The budget belongs to the
+thread that set it; other threads are not limited by it.
+
+The budget is checked every few hundred primes within both stages of each
+ECM curve, every few dozen primes in both stages of p-1, for each set of
+QS polynomials, before each stage of L</factor>, and at each step of the
+ECPP descent.  Once it is used up these give up rather than running to
+completion:  L</factor> returns the factors it found with any unfactored
+composites left in the list (L</factor_with_status> marks them), the
+single-method factoring functions return their input, and
+L</is_provable_prime> returns 1 (probable prime) rather than a proof.
+Functions that need the complete factorization, such as L</totient>,
+L</moebius>, or L</znorder>, croak instead of returning a wrong answer.
+
+=head2 effort_exhausted
+
+Returns 1 if the budget set with L</set_effort_budget> has run out, and 0
+otherwise.  After L</factor> returns, this tells whether any composites may
+remain in its result.
+
+=head2 smooth_parts
+
+  my @s = smooth_parts(1000, @n);
+  # Which inputs are 1000-smooth?
+  my @smooth = map { $n[$_] } grep { $s[$_] eq $n[$_] } 0 .. $#n;
+
+Given a bound C<B> and a list of non-negative integers, returns for each input
+its C<B>-smooth part: the largest divisor whose prime factors are all at most
+C<B>.  An input is C<B>-smooth when its smooth part is the input itself.
+The smooth part of 0 is 0.
+
+Bernstein's batch algorithm is used.  The product of the primes up to C<B> is
+reduced modulo every input through a remainder tree, so the cost is shared by
+the whole list.  This is much faster than trial dividing each input when
+there are many of them, and lists of 100,000 inputs are reasonable.
+
+=head2 smooth_factors
+
+  my @f = smooth_factors(1000, @n);
+  # $f[$i] is an array reference with the prime factors of $n[$i] below 1000
+
+Like L</smooth_parts>, but returns for each input an array reference holding
+the prime factors of its smooth part, with multiplicity and in numerical
+order.  Inputs of 0 or 1 give an empty list.
+
+
 =head2 trial_factor
 
   my @factors = trial_factor($n);
@@ -1322,9 +1567,11 @@ This is a good and fast initial test, and will be very fast for small numbers
 (e.g. under 1 million).  For larger numbers, faster methods for complete
 factoring have been known since the 17th century.
 
-For inputs larger than about 1000 digits, a dynamic product/remainder tree
-is used, which is faster than GMP's native methods.  This helps when pruning
-composites or looking for very small factors.
+For inputs larger than a machine word, primes above 2048 and below C<2^24>
+are tested with gcds against cached products of primes, which is much faster
+than dividing by each one.  Past that, inputs larger than about 1000 digits
+use a product/remainder tree.  This helps when pruning composites or looking
+for very small factors.
 
 
 =head2 prho_factor
@@ -1394,7 +1641,10 @@ a factor in the first stage if C<B1 E<gt>= 703499> or in the second stage if
 C<B1 E<gt>= 3137> and C<B2 E<gt>= 703499>.
 
 The implementation is written from scratch using the basic algorithm including
-a second stage as described in Montgomery 1987.  It is faster than most simple
+a second stage as described in Montgomery 1987.  The second stage pairs primes
+C<kD-j> and C<kD+j>, and when C<B2-B1> is over a few million it instead
+evaluates a polynomial over a product tree (Montgomery and Silverman 1990),
+so a C<B2> of C<10^10> or more is practical.  It is faster than most simple
 implementations I have seen (many of which are written assuming native
 precision inputs), but slower than Ben Buhrow's code used in earlier
 versions of L<yafu|http://sourceforge.net/projects/yafu/>, and nowhere close
@@ -1411,7 +1661,10 @@ C<p+1> method.  The resulting array will contain either two factors (it
 succeeded) or the original number (no factor was found).  In either case,
 multiplying @factors yields the original input.  An optional first stage
 smoothness factor (B1) may be given as the second parameter.  This will be
-the smoothness limit B1 for the first stage.
+the smoothness limit B1 for the first stage, and will use C<10*B1> for
+the second stage limit B2.  If a third parameter is given, it will be used
+as the second stage limit B2.  The second stage is the same as for
+L</pminus1_factor>.
 Factoring will stop when the input is a prime, one factor has been found, or
 the algorithm fails to find a factor with the given smoothness.
 
@@ -1475,6 +1728,8 @@ generally slower than the C<prho> and C<pbrent> implementations.
   my @factors = ecm_factor($n);
   my @factors = ecm_factor($n, 12500);      # B1 = 12500
   my @factors = ecm_factor($n, 12500, 10);  # B1 = 12500, curves = 10
+  my @factors = ecm_factor($n, 12500, 10, 'suyama');   # Montgomery curves
+  my @factors = ecm_factor($n, 12500, 10, 'affine');   # stage 1 only
 
 Given a positive number input, tries to discover a factor using ECM.  The
 resulting array will contain either two factors (it succeeded) or the original
@@ -1482,16 +1737,59 @@ number (no factor was found).  In either case, multiplying @factors yields the
 original input.  An optional maximum smoothness may be given as the second
 parameter, which relates to the size of factor to search for.  An optional
 third parameter indicates the number of random curves to use at each
-smoothness value being searched.
+smoothness value being searched.  An optional fourth parameter chooses the
+curve family:  C<edwards> (the default); C<suyama>, Montgomery curves from
+Suyama's parametrization, which find a different set of factors for the
+same bound; or C<affine>, which runs stage 1 only on all the curves side by
+side, sharing one modular inversion per step, with bounds rising from 100
+to B1.  Any other value croaks.
 
 This is an implementation of Hendrik Lenstra's elliptic curve factoring
 method, usually referred to as ECM.  The implementation is reasonable,
-using projective coordinates, Montgomery's PRAC heuristic for EC
-multiplication, and two stages.
+using Edwards curves with torsion group Z/12 in extended coordinates and
+windowed NAF multiplication for stage 1 (or Montgomery curves with PRAC
+chains), and Montgomery curves for the standard stage 2.
 It is much slower than the latest GMP-ECM, but still quite useful for
 factoring reasonably sized inputs.
 
 
+=head2 pminus1_save
+
+=head2 ecm_save
+
+  my ($line) = pminus1_save($n, 100000);          # x0 = 2
+  my ($line) = ecm_save($n, 1000000);             # random sigma
+  my ($line, @factors) = ecm_save($n, 1000000, 123456789);  # given sigma
+
+Runs stage 1 of p-1 or of ECM (on a single Suyama curve) to the bound B1 and
+returns a one-line description of the state reached.  The optional third
+parameter is the starting value for p-1 or the curve's sigma for ECM.  The
+line uses the same C<KEY=value;> fields as GMP-ECM save files, so it can be
+written to a file and used later with L</resume_save> or L</resume_factor>.
+Stage 1 always runs to completion.  If it found a factor, the factor and
+its cofactor follow the line, so call these in list context.
+
+=head2 resume_save
+
+  ($line, @factors) = resume_save($line, 5000000);
+
+Given a line from L</pminus1_save>, L</ecm_save>, or a previous call, continues
+stage 1 from its B1 to the new bound and returns the updated line, followed
+by a factor and its cofactor if one was found.  The result is the same as
+saving with the larger bound in the first place.
+
+=head2 resume_factor
+
+  my @factors = resume_factor($line);
+  my @factors = resume_factor($line, 10000000);   # B2
+
+Given a saved line, checks the stage 1 result for a factor and then runs
+stage 2 up to the optional bound (default 100 times B1 for ECM, 10 times B1
+for p-1).  Returns the factor and its cofactor, or the original number if
+nothing was found.  Both this and L</resume_save> croak on an invalid line,
+including one without a C<CHECKSUM> field.
+
+
 =head2 qs_factor
 
   my @factors = qs_factor($n);
@@ -0,0 +1,727 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <gmp.h>
+
+#include "ptypes.h"
+#include "lmo.h"
+#include "prime_iterator.h"
+#include "gmp_main.h"
+#define FUNC_isqrt 1
+#define FUNC_mpz_logn 1
+#include "utility.h"
+
+/*
+ * Prime counting using the Lagarias-Miller-Odlyzko method, with the special
+ * leaves split as in Deleglise-Rivat:
+ *
+ *   pi(x) = S1 + S2 + pi(y) - 1 - P2
+ *
+ * where y >= x^(1/3), S1 are the ordinary leaves, S2 the special leaves, and
+ * P2 counts the integers <= x with exactly two prime factors larger than y.
+ *
+ * S2 is computed with a segmented sieve over [0, x/y].  Each segment keeps a
+ * counter per block of bits, so a leaf is answered by summing a few counters
+ * and a short popcount.  P2 uses a second segmented sieve over the same
+ * range, walking the primes in (y, sqrt(x)] downwards as x/p walks upwards.
+ *
+ * Arithmetic on x is done with UVs when x fits, with 128-bit integers when
+ * the compiler has them, and with mpz otherwise.  Everything else fits in a
+ * UV as long as x/y does, and sums use a two-word accumulator.
+ *
+ * Memory use is about 4*y bytes for the mu/lpf table plus the primes to y.
+ */
+
+/* Below this use a simple sieve */
+#define LMO_MIN_N       100000
+/* Use LMO for ranges wider than this times x^(2/3) */
+#define LMO_SIEVE_RATIO 2
+/* Cap on y, which bounds memory use */
+#define LMO_MAX_Y       UVCONST(67108864)
+
+/* phi(v, c) for the first PHI_C primes is done with a table */
+#define PHI_C           6
+#define PHI_PRIMORIAL   30030
+#define PHI_TOTIENT     5760
+
+#define BLOCK_WORDS     8                   /* words per block counter */
+#define BLOCK_BITS      (32*BLOCK_WORDS)
+
+#if HAVE_UINT128
+typedef uint128_t xuint;
+#else
+typedef UV xuint;
+#endif
+
+/* Unsigned double-word accumulator */
+typedef struct {
+  UV hi;
+  UV lo;
+} acc_t;
+#define ACC_ADD(a, v) \
+  do { UV v_ = (v);  (a).lo += v_;  if ((a).lo < v_) (a).hi++; } while (0)
+
+static void mpz_set_uv(mpz_t r, UV v)
+{
+#if BITS_PER_WORD == 64
+  if (ULONG_MAX < UV_MAX) {
+    mpz_set_ui(r, (unsigned long)(v >> 32));
+    mpz_mul_2exp(r, r, 32);
+    mpz_add_ui(r, r, (unsigned long)(v & 0xFFFFFFFFUL));
+    return;
+  }
+#endif
+  mpz_set_ui(r, v);
+}
+static void acc_add_to_mpz(mpz_t r, const acc_t* a, int negate)
+{
+  mpz_t t;
+  mpz_init(t);
+  mpz_set_uv(t, a->hi);
+  mpz_mul_2exp(t, t, BITS_PER_WORD);
+  if (a->lo > 0) {
+    mpz_t lo;
+    mpz_init(lo);
+    mpz_set_uv(lo, a->lo);
+    mpz_add(t, t, lo);
+    mpz_clear(lo);
+  }
+  if (negate) mpz_sub(r, r, t);
+  else        mpz_add(r, r, t);
+  mpz_clear(t);
+}
+
+/* x, with the fastest representation we can use for it */
+typedef struct {
+  mpz_t x;
+  int   usempz;     /* x does not fit in an xuint */
+  xuint xw;
+  mpz_t t;
+} lmo_x;
+
+/* A quotient x/d kept for repeated division */
+typedef struct {
+  xuint v;
+  mpz_t z;
+} xquot;
+
+static void xq_set(xquot* q, lmo_x* X, UV d)
+{
+  if (!X->usempz)  q->v = X->xw / d;
+  else             mpz_tdiv_q_ui(q->z, X->x, d);
+}
+/* min( floor(q / d), cap ) */
+static INLINE UV xq_div(xquot* q, lmo_x* X, UV d, UV cap)
+{
+  if (!X->usempz) {
+    xuint r = q->v / d;
+    return (r > cap) ? cap : (UV)r;
+  }
+  mpz_tdiv_q_ui(X->t, q->z, d);
+  return (mpz_cmp_ui(X->t, cap) > 0) ? cap : mpz_get_ui(X->t);
+}
+
+static INLINE uint32_t popcnt32(uint32_t w) {
+#if defined(__GNUC__) && (__GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4))
+  return __builtin_popcount(w);
+#else
+  w = w - ((w >> 1) & 0x55555555U);
+  w = (w & 0x33333333U) + ((w >> 2) & 0x33333333U);
+  w = (w + (w >> 4)) & 0x0F0F0F0FU;
+  return (w * 0x01010101U) >> 24;
+#endif
+}
+
+/******************************************************************************/
+/*                       SEGMENT SIEVE WITH COUNTERS                          */
+/******************************************************************************/
+
+/* A segment covers [low, low+size) with low even.  Bit j is low+2j+1. */
+
+/* Fill block counters, return the total number of set bits */
+static UV fill_counters(const uint32_t* bits, uint32_t* counters, UV nblocks)
+{
+  UV i, j, total = 0;
+  for (i = 0; i < nblocks; i++) {
+    uint32_t c = 0;
+    for (j = 0; j < BLOCK_WORDS; j++)
+      c += popcnt32(bits[i*BLOCK_WORDS + j]);
+    counters[i] = c;
+    total += c;
+  }
+  return total;
+}
+
+/* Clear odd multiples of p from *pnext up to high, maintaining counters.
+ * Returns the number of bits that were cleared. */
+static UV cross_off(uint32_t* bits, uint32_t* counters, UV low, UV high,
+                    UV p, UV* pnext)
+{
+  UV n, removed = 0;
+  for (n = *pnext; n < high; n += 2*p) {
+    UV j = (n - low) >> 1;
+    uint32_t mask = 1U << (j & 31);
+    if (bits[j >> 5] & mask) {
+      bits[j >> 5] &= ~mask;
+      if (counters != 0) counters[j / BLOCK_BITS]--;
+      removed++;
+    }
+  }
+  *pnext = n;
+  return removed;
+}
+
+/* Number of set bits for odd values in [low, v].  Queries must have
+ * increasing v; *blk and *cnt hold the running sum of whole blocks. */
+static INLINE UV seg_count(const uint32_t* bits, const uint32_t* counters,
+                           UV low, UV v, UV* blk, UV* cnt)
+{
+  UV nb = (v - low + 1) >> 1;
+  UV tb = nb / BLOCK_BITS;
+  UV w, wend = nb >> 5, c;
+  while (*blk < tb)
+    *cnt += counters[(*blk)++];
+  c = *cnt;
+  for (w = tb * BLOCK_WORDS; w < wend; w++)
+    c += popcnt32(bits[w]);
+  if (nb & 31)
+    c += popcnt32(bits[wend] & ((1U << (nb & 31)) - 1));
+  return c;
+}
+
+/* Sieve the odd primes in [low, low+size) using the odd primes[2..] */
+static void sieve_window(uint32_t* bits, UV low, UV size,
+                         const uint32_t* primes, UV nprimes)
+{
+  UV i, high = low + size;
+  memset(bits, 0xFF, size/16);
+  if (low == 0) bits[0] &= ~1U;             /* 1 is not prime */
+  for (i = 2; i <= nprimes; i++) {
+    UV p = primes[i], n;
+    if (p*p >= high) break;
+    n = p*p;
+    if (n < low) {
+      n = ((low + p - 1) / p) * p;
+      if (!(n & 1)) n += p;
+    }
+    (void) cross_off(bits, 0, low, high, p, &n);
+  }
+}
+
+/* Odd multiples of 3, 5, 7, 11, and 13 repeat every 15015 odd values.  A
+ * pattern of 15015 words holds 32 whole periods, so a segment starting at a
+ * multiple of 64 is filled by copying words. */
+#define PRESIEVE_WORDS  15015
+static uint32_t* make_presieve(void)
+{
+  UV j;
+  uint32_t* pat;
+  Newz(0, pat, PRESIEVE_WORDS, uint32_t);
+  for (j = 0; j < 32*PRESIEVE_WORDS; j++) {
+    UV v = 2*j+1;
+    if (v%3 && v%5 && v%7 && v%11 && v%13)
+      pat[j >> 5] |= 1U << (j & 31);
+  }
+  return pat;
+}
+static void presieve_fill(uint32_t* bits, UV nwords, const uint32_t* pat, UV low)
+{
+  UV i = 0, w = (low / 64) % PRESIEVE_WORDS;
+  while (i < nwords) {
+    UV n = PRESIEVE_WORDS - w;
+    if (n > nwords - i) n = nwords - i;
+    memcpy(bits + i, pat + w, n * sizeof(uint32_t));
+    i += n;
+    w = 0;
+  }
+}
+
+/* Segment size:  a power of two, at least sqrt(z).  Anything under 2^18 bits
+ * (a 32KB bitmap) spends more time on per-segment setup than on sieving. */
+static UV segment_size(UV z)
+{
+  UV s = UVCONST(1) << 18, sz = isqrt(z);
+  while (s < sz) s <<= 1;
+  return s;
+}
+
+/******************************************************************************/
+/*                              THE COMPONENTS                                */
+/******************************************************************************/
+
+/* Ordinary leaves:  S1 = sum_{n <= y, lpf(n) > p_c} mu(n) phi(x/n, c) */
+static void lmo_s1(mpz_t S1, lmo_x* X, UV y, UV pc, const int32_t* mlpf,
+                   const uint16_t* phitab)
+{
+  UV n;
+  acc_t plus = {0,0}, minus = {0,0};
+  mpz_t q;
+
+  mpz_init(q);
+  for (n = 1; n <= y; n++) {
+    int32_t v = mlpf[n];
+    UV lpf = (v < 0) ? (UV)(-(IV)v) : (UV)v;
+    if (v == 0 || lpf <= pc) continue;
+    if (!X->usempz && X->xw / n <= UV_MAX) {
+      UV xn = (UV)(X->xw / n);
+      UV phi = (xn / PHI_PRIMORIAL) * PHI_TOTIENT + phitab[xn % PHI_PRIMORIAL];
+      if (v > 0) ACC_ADD(plus, phi);
+      else       ACC_ADD(minus, phi);
+    } else {
+      UV r;
+      mpz_tdiv_q_ui(q, X->x, n);
+      r = mpz_fdiv_q_ui(q, q, PHI_PRIMORIAL);
+      mpz_mul_ui(q, q, PHI_TOTIENT);
+      mpz_add_ui(q, q, phitab[r]);
+      if (v > 0) mpz_add(S1, S1, q);
+      else       mpz_sub(S1, S1, q);
+    }
+  }
+  acc_add_to_mpz(S1, &plus, 0);
+  acc_add_to_mpz(S1, &minus, 1);
+  mpz_clear(q);
+}
+
+/* Special leaves:
+ *   S2 = - sum_{c < b < a} sum_{y/p_b < m <= y, lpf(m) > p_b} mu(m) phi(x/(p_b m), b-1)
+ */
+static void lmo_s2(mpz_t S2, lmo_x* X, UV y, UV z, UV c,
+                   const uint32_t* primes, UV a, const int32_t* mlpf,
+                   const uint32_t* presieve)
+{
+  UV b, low, segsize, nwords, nblocks, sqrty, *next, *phi;
+  uint32_t *bits, *counters;
+  acc_t plus = {0,0}, minus = {0,0};
+  xquot xp;
+
+  sqrty = isqrt(y);
+  segsize = segment_size(z);
+  nwords = segsize / 64;
+  nblocks = nwords / BLOCK_WORDS;
+  New(0, bits, nwords, uint32_t);
+  New(0, counters, nblocks, uint32_t);
+  Newz(0, phi, a+1, UV);
+  New(0, next, a+1, UV);
+  for (b = 2; b <= a; b++)
+    next[b] = primes[b];
+  mpz_init(xp.z);
+
+  for (low = 0; low <= z; low += segsize) {
+    UV high = low + segsize, total;
+
+    presieve_fill(bits, nwords, presieve, low);     /* phi(., c) */
+    total = fill_counters(bits, counters, nblocks);
+
+    for (b = c+1; b < a; b++) {
+      UV p = primes[b], min_m, max_m, blk = 0, cnt = 0;
+      xq_set(&xp, X, p);
+      max_m = (low == 0) ? y : xq_div(&xp, X, low, y);
+      if (p >= max_m) break;
+      min_m = xq_div(&xp, X, high, y);
+      if (min_m < y/p) min_m = y/p;
+
+      if (p <= sqrty) {
+        UV m;
+        for (m = max_m; m > min_m; m--) {
+          int32_t v = mlpf[m];
+          if (v != 0 && (UV)((v < 0) ? -v : v) > p) {
+            UV xn = xq_div(&xp, X, m, UV_MAX);
+            UV phixn = phi[b] + seg_count(bits, counters, low, xn, &blk, &cnt);
+            if (v > 0) ACC_ADD(minus, phixn);
+            else       ACC_ADD(plus, phixn);
+          }
+        }
+      } else {
+        /* m must be a prime in (max(p, min_m), max_m] */
+        UV lo = b+1, hi = a+1, k, mlo = (min_m > p) ? min_m : p;
+        while (lo < hi) {               /* first index with primes[k] > mlo */
+          UV mid = lo + (hi-lo)/2;
+          if (primes[mid] <= mlo) lo = mid+1; else hi = mid;
+        }
+        for (k = lo; k <= a && primes[k] <= max_m; k++)
+          ;
+        while (k-- > lo) {
+          UV xn = xq_div(&xp, X, primes[k], UV_MAX);
+          ACC_ADD(plus, phi[b] + seg_count(bits, counters, low, xn, &blk, &cnt));
+        }
+      }
+      phi[b] += total;
+      total -= cross_off(bits, counters, low, high, p, &next[b]);
+    }
+  }
+  acc_add_to_mpz(S2, &plus, 0);
+  acc_add_to_mpz(S2, &minus, 1);
+  mpz_clear(xp.z);
+  Safefree(next);
+  Safefree(phi);
+  Safefree(counters);
+  Safefree(bits);
+}
+
+/* P2 = sum_{y < p <= sqrt(x)} ( pi(x/p) - pi(p) + 1 ) */
+static void lmo_p2(mpz_t P2, lmo_x* X, UV y, UV z,
+                   const uint32_t* primes, UV a, const uint32_t* presieve)
+{
+  UV low, sqrtx, segsize, nwords, nblocks, nbase, b, pi_low, pi_sqrtx = 0;
+  UV *next;
+  uint32_t *bits, *counters, *wbits;
+  acc_t sum = {0,0};
+  xquot xq;
+  mpz_t t;
+
+  mpz_init(t);
+  mpz_sqrt(t, X->x);
+  sqrtx = mpz_get_ui(t);
+  if (sqrtx <= y) { mpz_set_ui(P2, 0); mpz_clear(t); return; }
+
+  segsize = segment_size(z);
+  nwords = segsize / 64;
+  nblocks = nwords / BLOCK_WORDS;
+  New(0, bits, nwords, uint32_t);
+  New(0, wbits, nwords, uint32_t);
+  New(0, counters, nblocks, uint32_t);
+  for (nbase = 2; nbase <= a && (UV)primes[nbase]*primes[nbase] <= z; nbase++)
+    ;
+  nbase--;
+  New(0, next, nbase+1, UV);
+  for (b = 2; b <= nbase; b++)
+    next[b] = (UV)primes[b] * primes[b];
+  mpz_init(xq.z);
+  xq_set(&xq, X, 1);
+
+  pi_low = 1;                             /* The prime 2 */
+  for (low = 0; low <= z; low += segsize) {
+    UV high = low + segsize, total, phigh, plow, blk = 0, cnt = 0;
+
+    presieve_fill(bits, nwords, presieve, low);
+    if (low == 0)                          /* 1 is not prime, 3-13 are */
+      bits[0] = (bits[0] & ~1U) | 0x6E;
+    for (b = PHI_C+1; b <= nbase; b++)
+      (void) cross_off(bits, 0, low, high, primes[b], &next[b]);
+    total = fill_counters(bits, counters, nblocks);
+
+    if (sqrtx >= low && sqrtx < high) {
+      UV sblk = 0, scnt = 0;
+      pi_sqrtx = pi_low + seg_count(bits, counters, low, sqrtx, &sblk, &scnt);
+    }
+
+    /* Primes p in (plow, phigh] have x/p in [low, high) */
+    phigh = (low == 0) ? sqrtx : xq_div(&xq, X, low, sqrtx);
+    plow = xq_div(&xq, X, high, sqrtx);
+    if (plow < y) plow = y;
+    while (phigh > plow) {
+      /* An even window start with phigh inside [wlow, wlow+segsize) */
+      UV wlow = (phigh+2 > segsize) ? (phigh + 2 - segsize) & ~UVCONST(1) : 0, p;
+      if (wlow <= plow) wlow = (plow + 1) & ~UVCONST(1);
+      sieve_window(wbits, wlow, segsize, primes, a);
+      for (p = phigh | 1;  p > plow && p >= wlow;  p -= 2) {
+        UV j = (p - wlow) >> 1;
+        if (p > phigh || !(wbits[j >> 5] & (1U << (j & 31)))) continue;
+        ACC_ADD(sum, pi_low + seg_count(bits, counters, low,
+                                        xq_div(&xq, X, p, UV_MAX), &blk, &cnt));
+      }
+      phigh = (wlow > 0) ? wlow - 1 : 0;
+    }
+    pi_low += total;
+  }
+
+  /* P2 = sum pi(x/p)  -  sum_{a < b <= pi(sqrtx)} (b-1) */
+  mpz_set_ui(P2, 0);
+  acc_add_to_mpz(P2, &sum, 0);
+  mpz_set_uv(t, pi_sqrtx);
+  mpz_mul_ui(t, t, pi_sqrtx-1);
+  mpz_sub_ui(t, t, (a * (a-1)));
+  mpz_tdiv_q_2exp(t, t, 1);
+  mpz_sub(P2, P2, t);
+
+  mpz_clear(xq.z);
+  Safefree(next);
+  Safefree(counters);
+  Safefree(wbits);
+  Safefree(bits);
+  mpz_clear(t);
+}
+
+/******************************************************************************/
+
+void lmo_prime_count(mpz_t count, mpz_t n)
+{
+  UV y, z, a, i, c, *pr;
+  uint32_t *primes, *presieve;
+  int32_t *mlpf;
+  uint16_t *phitab;
+  lmo_x X;
+  mpz_t t, S1, S2, P2;
+  int _verbose = get_verbose_level();
+
+  if (mpz_cmp_ui(n, LMO_MIN_N) < 0) {
+    UV *list = sieve_to_n(mpz_get_ui(n), &a);
+    Safefree(list);
+    mpz_set_ui(count, a);
+    return;
+  }
+
+  mpz_init(t);
+  /* y >= x^(1/3), scaled up by alpha to balance S2 leaves against sieving */
+  {
+    double alpha = (mpz_sizeinbase(n, 2) * 0.30103 - 6.0) / 2.0;
+    UV ycube;
+    if (mpz_root(t, n, 3) == 0) mpz_add_ui(t, t, 1);
+    if (mpz_sizeinbase(t, 2) > 30)
+      croak("prime_count: input is too large");
+    ycube = mpz_get_ui(t);
+    if (alpha < 1.0) alpha = 1.0;
+    y = (UV) (alpha * ycube);
+    if (y > LMO_MAX_Y) y = LMO_MAX_Y;
+    if (y < ycube) y = ycube;
+  }
+  mpz_tdiv_q_ui(t, n, y);
+  if (mpz_sizeinbase(t, 2) > BITS_PER_WORD-4)
+    croak("prime_count: input is too large");
+  z = mpz_get_ui(t);
+
+  mpz_init_set(X.x, n);
+  mpz_init(X.t);
+  X.xw = 0;
+#if HAVE_UINT128
+  X.usempz = (mpz_sizeinbase(n, 2) > 128);
+  if (!X.usempz) {
+    mpz_tdiv_q_2exp(t, n, 64);
+    X.xw = ((uint128_t)mpz_get_ui(t)) << 64;
+    mpz_tdiv_r_2exp(t, n, 64);
+    X.xw += mpz_get_ui(t);
+  }
+#else
+  X.usempz = (mpz_sizeinbase(n, 2) > BITS_PER_WORD);
+  if (!X.usempz) X.xw = mpz_get_ui(n);
+#endif
+
+  /* primes[1..a] are the primes <= y */
+  pr = sieve_to_n(y, &a);
+  New(0, primes, a+1, uint32_t);
+  primes[0] = 0;
+  for (i = 0; i < a; i++)  primes[i+1] = pr[i];
+  Safefree(pr);
+  c = PHI_C;
+
+  /* mlpf[m] = mu(m) * lpf(m), lpf(1) = y+1 (infinity) */
+  New(0, mlpf, y+1, int32_t);
+  for (i = 0; i <= y; i++)  mlpf[i] = 1;
+  for (i = 1; i <= a; i++) {
+    UV p = primes[i], m;
+    for (m = p; m <= y; m += p) {
+      int32_t v = mlpf[m];
+      if (v == 0) continue;
+      if (v == 1 || v == -1) v = (v > 0) ? (int32_t)p : -(int32_t)p;
+      mlpf[m] = -v;
+    }
+    if (p <= y/p)
+      for (m = p*p; m <= y; m += p*p)
+        mlpf[m] = 0;
+  }
+  mlpf[1] = y+1;
+
+  /* phitab[r] = #{1 <= i <= r : gcd(i, 2*3*5*7*11*13) = 1} */
+  New(0, phitab, PHI_PRIMORIAL, uint16_t);
+  phitab[0] = 0;
+  for (i = 1; i < PHI_PRIMORIAL; i++)
+    phitab[i] = phitab[i-1] + ((i%2) && (i%3) && (i%5) && (i%7) && (i%11) && (i%13));
+
+  if (_verbose > 1) gmp_printf("LMO pi(%Zd): y = %"UVuf", x/y = %"UVuf", pi(y) = %"UVuf"\n", n, y, z, a);
+
+  mpz_init_set_ui(S1, 0);
+  mpz_init_set_ui(S2, 0);
+  mpz_init(P2);
+  lmo_s1(S1, &X, y, primes[c], mlpf, phitab);
+  if (_verbose > 1) gmp_printf("LMO S1 = %Zd\n", S1);
+  presieve = make_presieve();
+  lmo_s2(S2, &X, y, z, c, primes, a, mlpf, presieve);
+  if (_verbose > 1) gmp_printf("LMO S2 = %Zd\n", S2);
+  lmo_p2(P2, &X, y, z, primes, a, presieve);
+  if (_verbose > 1) gmp_printf("LMO P2 = %Zd\n", P2);
+
+  /* pi(x) = S1 + S2 + a - 1 - P2 */
+  mpz_add(count, S1, S2);
+  mpz_add_ui(count, count, a);
+  mpz_sub_ui(count, count, 1);
+  mpz_sub(count, count, P2);
+
+  mpz_clear(P2);  mpz_clear(S2);  mpz_clear(S1);
+  Safefree(presieve);
+  Safefree(phitab);
+  Safefree(mlpf);
+  Safefree(primes);
+  mpz_clear(X.t);
+  mpz_clear(X.x);
+  mpz_clear(t);
+}
+
+/* LMO's cost grows like x^(2/3) regardless of the range, while sieving costs
+ * about the width of the range.  Decide which is cheaper. */
+int prime_count_use_lmo(mpz_t low, mpz_t high)
+{
+  int use;
+  mpz_t t, w;
+  if (mpz_cmp_ui(high, LMO_MIN_N) < 0 || mpz_sizeinbase(high, 2) > 88)
+    return 0;
+  mpz_init(t);  mpz_init(w);
+  mpz_sub(w, high, low);
+  mpz_mul(t, high, high);
+  mpz_root(t, t, 3);
+  mpz_mul_ui(t, t, LMO_SIEVE_RATIO);
+  use = (mpz_cmp(w, t) > 0);
+  mpz_clear(w);  mpz_clear(t);
+  return use;
+}
+
+/******************************************************************************/
+/*                                 NTH PRIME                                  */
+/******************************************************************************/
+
+/* Below this index just sieve */
+#define NTH_SIEVE_N     100000
+/* Widest window sieved at once while walking to the nth prime */
+#define NTH_MAX_WINDOW  UVCONST(16777216)
+
+static int _moebius(int k)
+{
+  int p, mu = 1;
+  for (p = 2; p*p <= k; p++) {
+    if (k % p == 0) {
+      k /= p;
+      if (k % p == 0) return 0;
+      mu = -mu;
+    }
+  }
+  return (k > 1) ? -mu : mu;
+}
+
+/* Logarithmic integral using Ramanujan's series */
+static double _li(double x)
+{
+  const double euler_gamma = 0.57721566490153286061;
+  double logx = log(x), sum = 0.0, fact = 1.0, inner = 0.0, pow2 = 1.0;
+  int n;
+  for (n = 1; n < 200; n++) {
+    double term;
+    fact *= logx / n;                     /* (log x)^n / n! */
+    if (n & 1) inner += 1.0 / n;
+    term = fact / pow2 * inner;
+    sum += (n & 1) ? term : -term;
+    pow2 *= 2.0;
+    if (term < 1e-17 * fabs(sum)) break;
+  }
+  return euler_gamma + log(logx) + sqrt(x) * sum;
+}
+
+/* Riemann R(x) = sum mu(k)/k li(x^(1/k)) */
+static double _riemann_r(double x)
+{
+  double sum = 0.0;
+  int k;
+  for (k = 1; k < 200; k++) {
+    double xk = pow(x, 1.0/k);
+    int mu = _moebius(k);
+    if (xk < 2.0) break;
+    if (mu != 0) sum += mu * _li(xk) / k;
+  }
+  return sum;
+}
+
+/* Solve R(x) = n with Newton's method, using R'(x) ~ 1/log(x) */
+static double _inverse_riemann_r(double n)
+{
+  double x = n * (log(n) + log(log(n)) - 1.0);
+  int i;
+  for (i = 0; i < 100; i++) {
+    double d = (_riemann_r(x) - n) * log(x);
+    x -= d;
+    if (fabs(d) < 1.0 || fabs(d) < 1e-15 * x) break;
+  }
+  return x;
+}
+
+void nth_prime(mpz_t p, mpz_t n)
+{
+  mpz_t x, c, t, lo, hi;
+  double logx;
+  UV need, width, np, *list;
+  int iter;
+
+  if (mpz_sgn(n) <= 0) { mpz_set_ui(p, 0); return; }
+
+  if (mpz_cmp_ui(n, NTH_SIEVE_N) < 0) {
+    /* p_k < k (log k + log log k) for k >= 6 */
+    UV k = mpz_get_ui(n);
+    double lk = log(k + 6.0);
+    list = sieve_to_n((UV) ((k + 6) * (lk + log(lk))), &np);
+    mpz_set_ui(p, list[k-1]);
+    Safefree(list);
+    return;
+  }
+
+  mpz_init(x);  mpz_init(c);  mpz_init(t);  mpz_init(lo);  mpz_init(hi);
+
+  /* Estimate, then count exactly.  The estimate is off by about sqrt(x). */
+  mpz_set_d(x, _inverse_riemann_r(mpz_get_d(n)));
+  lmo_prime_count(c, x);
+  if (get_verbose_level() > 1)
+    gmp_printf("nth_prime(%Zd): R^-1 = %Zd, pi = %Zd\n", n, x, c);
+
+  /* If sieving the rest of the way costs more than another count, move the
+   * estimate by (n - pi(x)) log x and count again. */
+  for (iter = 0; iter < 4; iter++) {
+    logx = mpz_logn(x);
+    mpz_sub(t, n, c);
+    mpz_set_d(hi, fabs(mpz_get_d(t)) * logx);
+    mpz_add(hi, hi, x);
+    if (!prime_count_use_lmo(x, hi))
+      break;
+    mpz_set_d(t, mpz_get_d(t) * logx);
+    mpz_add(x, x, t);
+    lmo_prime_count(c, x);
+    if (get_verbose_level() > 1)
+      gmp_printf("nth_prime(%Zd): x = %Zd, pi = %Zd\n", n, x, c);
+  }
+
+  /* Sieve from x to the answer */
+  logx = mpz_logn(x);
+  if (mpz_cmp(c, n) < 0) {
+    /* p is the need'th prime after x */
+    mpz_sub(t, n, c);
+    need = mpz_get_ui(t);
+    while (1) {
+      width = (UV) (need * logx * 1.1) + 1000;
+      if (width > NTH_MAX_WINDOW) width = NTH_MAX_WINDOW;
+      mpz_add_ui(lo, x, 1);
+      mpz_add_ui(hi, x, width);
+      list = sieve_primes(lo, hi, 0, &np);
+      if (np >= need) break;
+      Safefree(list);
+      need -= np;
+      mpz_set(x, hi);
+    }
+    mpz_add_ui(p, lo, list[need-1]);
+  } else {
+    /* p is the need'th prime counting down from x */
+    mpz_sub(t, c, n);
+    need = mpz_get_ui(t) + 1;
+    while (1) {
+      width = (UV) (need * logx * 1.1) + 1000;
+      if (width > NTH_MAX_WINDOW) width = NTH_MAX_WINDOW;
+      mpz_set(hi, x);
+      if (mpz_cmp_ui(hi, width+1) < 0) mpz_set_ui(lo, 2);
+      else                             mpz_sub_ui(lo, hi, width-1);
+      list = sieve_primes(lo, hi, 0, &np);
+      if (np >= need) break;
+      Safefree(list);
+      need -= np;
+      mpz_sub_ui(x, lo, 1);
+    }
+    mpz_add_ui(p, lo, list[np-need]);
+  }
+  Safefree(list);
+
+  mpz_clear(hi);  mpz_clear(lo);  mpz_clear(t);  mpz_clear(c);  mpz_clear(x);
+}
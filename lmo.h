@@ -0,0 +1,16 @@
+#ifndef MPU_LMO_H
+#define MPU_LMO_H
+
+#include <gmp.h>
+#include "ptypes.h"
+
+/* count = pi(n), the number of primes <= n */
+extern void lmo_prime_count(mpz_t count, mpz_t n);
+
+/* p = the nth prime, with nth_prime(1) = 2.  Sets p to 0 if n is 0. */
+extern void nth_prime(mpz_t p, mpz_t n);
+
+/* Is LMO faster than sieving for counting primes in [low,high]? */
+extern int prime_count_use_lmo(mpz_t low, mpz_t high);
+
+#endif
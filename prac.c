@@ -0,0 +1,142 @@
+#include <gmp.h>
+
+#include "ptypes.h"
+#include "prac.h"
+#include "prime_iterator.h"
+
+/*
+ * PRAC Lucas chains, shared by ECM stage 1 and p+1 stage 1.
+ *
+ * "Evaluating recurrences of form X_{m+n} = f(X_m, X_n, X_{m-n}) via
+ *  Lucas chains, Peter L. Montgomery, Dec 1983 (revised Jan 1992).
+ *
+ * Picking the chain means costing one per candidate start r = k/val, which
+ * is several times the integer work of running it, and was redone for every
+ * prime of every curve.  The choice depends only on k, so for primes we keep
+ * the index of the winning val, one nibble per odd number, in chunks of
+ * CHUNK_WIDTH built on first use and published with a compare-and-swap.
+ * All of them together take 4MB.
+ */
+#define NVALS        5
+#define CHUNK_BITS   16
+#define CHUNK_WIDTH  (UVCONST(1) << CHUNK_BITS)
+#define NCHUNKS      (PRAC_LIMIT >> CHUNK_BITS)
+
+/* Weights from ECM, in field multiplications */
+#define ADD 6 /* number of multiplications in an addition */
+#define DUP 5 /* number of multiplications in a double */
+
+static const double val[NVALS] =
+  {1.61803398875, 1.72360679775, 1.618347119656, 1.617914406529,
+   1.58017872826};
+
+/* Extra adds and doubles for each condition, after the step's add */
+static const unsigned char cond_cost[10] =
+  { 0, 2*ADD, DUP, 0, DUP, DUP, 2*ADD+DUP, 2*ADD+DUP, 2*ADD+DUP, DUP };
+
+static unsigned char* chunks[NCHUNKS];
+
+int prac_step(UV* pd, UV* pe)
+{
+  UV d = *pd, e = *pe;
+  int swap = 0, c;
+
+  if (d < e) { UV t = d;  d = e;  e = t;  swap = PRAC_SWAP; }
+  if (4 * d <= 5 * e && ((d + e) % 3) == 0) {
+    d = (2 * d - e) / 3;  e = (e - d) / 2;   c = 1;
+  } else if (4 * d <= 5 * e && (d - e) % 6 == 0) {
+    d = (d - e) / 2;                         c = 2;
+  } else if (d <= 4 * e) {
+    d -= e;                                  c = 3;
+  } else if ((d + e) % 2 == 0) {
+    d = (d - e) / 2;                         c = 4;
+  } else if (d % 2 == 0) {
+    d /= 2;                                  c = 5;
+  } else if (d % 3 == 0) {
+    d = d / 3 - e;                           c = 6;
+  } else if ((d + e) % 3 == 0) {
+    d = (d - 2 * e) / 3;                     c = 7;
+  } else if ((d - e) % 3 == 0) {
+    d = (d - e) / 3;                         c = 8;
+  } else {
+    e /= 2;                                  c = 9;
+  }
+  *pd = d;  *pe = e;
+  return c | swap;
+}
+
+/* Returns the number of mulmods */
+static UV lucas_cost(UV n, double v)
+{
+  UV c, d, e, r;
+
+  r = (UV) ( ((double)n / v) + 0.5 );
+  if (r >= n)
+    return(ADD*n);
+  d = n - r;
+  e = 2 * r - n;
+  c = DUP + ADD;  /* initial double and final add */
+  while (d != e)
+    c += ADD + cond_cost[ prac_step(&d, &e) & 15 ];
+  return(c);
+}
+
+static int best_val(UV k)
+{
+  UV cost, best = ADD * k;
+  int i, bi = 0;
+  for (i = 0; i < NVALS; i++) {
+    cost = lucas_cost(k, val[i]);
+    if (cost < best) { best = cost;  bi = i; }
+  }
+  return bi;
+}
+
+static unsigned char* build_chunk(UV c)
+{
+  unsigned char* tab;
+  UV p, lo = c << CHUNK_BITS, hi = lo + CHUNK_WIDTH;
+  PRIME_ITERATOR(iter);
+
+  CNewz(tab, CHUNK_WIDTH/4, unsigned char);
+  if (tab == 0)  return 0;
+  prime_iterator_setprime(&iter, (lo == 0) ? 2 : lo);    /* odd p only */
+  for (p = prime_iterator_next(&iter); p < hi; p = prime_iterator_next(&iter)) {
+    UV i = (p - lo) >> 1;
+    tab[i >> 1] |= (best_val(p) + 1) << (4 * (i & 1));
+  }
+  prime_iterator_destroy(&iter);
+  return tab;
+}
+
+UV prac_start(UV k)
+{
+  int i = -1;
+
+  if (SHARED_TABLES && k < PRAC_LIMIT && (k & 1)) {
+    UV c = k >> CHUNK_BITS, j = (k & (CHUNK_WIDTH-1)) >> 1;
+    unsigned char* tab = ATOMIC_LOAD(chunks[c]);
+    if (tab == 0) {
+      tab = build_chunk(c);
+      if (tab != 0 && !ATOMIC_CAS(chunks[c], 0, tab)) {
+        CFree(tab);          /* Another thread got there first */
+        tab = ATOMIC_LOAD(chunks[c]);
+      }
+    }
+    if (tab != 0)            /* Not if out of memory */
+      i = ((tab[j >> 1] >> (4 * (j & 1))) & 15) - 1;
+  }
+  if (i < 0)
+    i = best_val(k);
+  return (UV) ( ((double)k / val[i]) + 0.5 );
+}
+
+void prac_global_shutdown(void)
+{
+  UV c;
+  for (c = 0; c < NCHUNKS; c++) {
+    if (chunks[c] != 0)
+      CFree(chunks[c]);
+    chunks[c] = 0;
+  }
+}
@@ -0,0 +1,25 @@
+#ifndef MPU_PRAC_H
+#define MPU_PRAC_H
+
+#include "ptypes.h"
+
+/* Chains for the primes below this are cached */
+#define PRAC_LIMIT  UVCONST(16777216)
+
+/* Set in the result of prac_step when A and B are swapped first */
+#define PRAC_SWAP   16
+
+extern void prac_global_shutdown(void);
+
+/* Montgomery's PRAC Lucas chain for k > 2 is fixed by its start r.  Returns
+ * the r giving the cheapest of a few candidate chains.  For primes below
+ * PRAC_LIMIT this is a table lookup, otherwise it is worked out each call. */
+extern UV prac_start(UV k);
+
+/* One step of the chain.  Start with d = k-r and e = 2r-k after the initial
+ * B=A, C=A, A=2A, and call this until d == e, then finish with A = A+B.
+ * Returns the condition (1-9) of Montgomery's table 4 to apply, ORed with
+ * PRAC_SWAP if A and B must be exchanged before it. */
+extern int prac_step(UV* d, UV* e);
+
+#endif
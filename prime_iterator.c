@@ -200,11 +200,9 @@ static unsigned char* sieve_erat30(UV end)
   max_buf = (end/30) + ((end%30) != 0);
   /* Round up to a word */
   max_buf = ((max_buf + sizeof(UV) - 1) / sizeof(UV)) * sizeof(UV);
-  New(0, mem, max_buf, unsigned char );
-  if (mem == 0) {
-    croak("allocation failure in sieve_erat30: could not alloc %"UVuf" bytes", max_buf);
+  CNew(mem, max_buf, unsigned char );
+  if (mem == 0)
     return 0;
-  }
 
   /* Fill buffer with marked 7, 11, and 13 */
   sieve_prefill(mem, 0, max_buf-1);
@@ -247,8 +245,8 @@ static int sieve_segment(unsigned char* mem, UV startd, UV endd,
   UV startp = 30*startd;
   UV endp = (endd >= (UV_MAX/30))  ?  UV_MAX-2  :  30*endd+29;
 
-  MPUassert( (mem != 0) && (endd >= startd) && (endp >= startp),
-             "sieve_segment bad arguments");
+  if ( (mem == 0) || (endd < startd) || (endp < startp) )
+    return 0;
 
   /* Fill buffer with marked 7, 11, and 13 */
   sieve_prefill(mem, startd, endd);
@@ -261,7 +259,8 @@ static int sieve_segment(unsigned char* mem, UV startd, UV endd,
   } else {
     sieve = sieve_erat30(limit);
   }
-  MPUassert( sieve != 0, "Could not generate base sieve" );
+  if (sieve == 0)
+    return 0;
 
   for (p = 17; p <= limit; p = next_prime_in_sieve(sieve,p))
   {
@@ -313,7 +312,7 @@ static int sieve_segment(unsigned char* mem, UV startd, UV endd,
     }
   }
 
-  if (sieve != prim_sieve)  Safefree(sieve);
+  if (sieve != prim_sieve)  CFree(sieve);
   return 1;
 }
 
@@ -325,23 +324,200 @@ static int sieve_segment(unsigned char* mem, UV startd, UV endd,
 /*****************************************************************************/
 
 /* These sizes are a tradeoff.  For better memory use I think 16k,4k is good.
- * For performance, 32k,16k or 64k,16k is better.  To avoid threading hell,
- * this is just decided statically.  At 24k,16k we handle 736800 numbers in
- * the primary sieve and won't redo for segments until after 5*10^11.  Each
- * segment will store a range of 30*(16384-16) = 491040 numbers.
+ * For performance, 32k,16k or 64k,16k is better.  The primary sieve starts
+ * at 32k, handling 30*(32768-16) = 982560 numbers, and can be resized with
+ * prime_iterator_set_primary_size.  Each segment stores a range of
+ * 30*(24576-16) = 736800 numbers.
  */
 #define PRIMARY_SIZE  (32768-16)
 #define SEGMENT_SIZE  (24576-16)
 #define NSMALL_PRIMES (83970-180)
 
-static const unsigned char* primary_sieve = 0;
-static const UV primary_limit = (30 * PRIMARY_SIZE)-1;
+/* Segments are shared by every iterator.  The first SEGMENT_CACHE_SIZE of
+ * them (to about 3.7*10^8) are sieved on first use, published with a
+ * compare-and-swap, and never modified or freed until shutdown, so readers
+ * need no lock.  Segments past that are private to their iterator.
+ *
+ * The primary sieve is published the same way.  A replaced primary is kept
+ * until shutdown since another thread may still be reading it.
+ *
+ * factor() walks primes on its worker threads, so nothing here croaks and
+ * the tables use CNew.  Without memory for a segment the iterator falls
+ * back to trial division.
+ */
+#define SEGMENT_CACHE_SIZE 512
+
+#define SHARE_SEGMENTS SHARED_TABLES
+
+typedef struct primary_sieve_s {
+  UV                       bytes;
+  UV                       limit;      /* 30*bytes-1 */
+  unsigned char*           sieve;
+  struct primary_sieve_s*  retired;    /* the table this one replaced */
+} primary_sieve_t;
+
+static primary_sieve_t* primary = 0;
+static const unsigned char* segment_cache[SEGMENT_CACHE_SIZE];
 static const uint32_t* small_primes = 0;
 static UV num_small_primes = 0;
 
+/* Prime gap table.  Below 2^32 the primes are walked as a list of gaps,
+ * one byte each (the gap divided by 2, at most 168 in this range), so the
+ * inlined prime_iterator_next is a load and an add.  The table is built
+ * lazily in chunks that follow the segment grid, and chunks are published
+ * and shared like segments.  Each chunk has an index every GAP_BLOCK
+ * numbers so an iterator can be positioned without walking the chunk.
+ */
+#define GAP_CHUNKS   (UVCONST(4294967295) / (30*SEGMENT_SIZE) + 1)
+#define GAP_BLOCK    (30*64)
+#define GAP_NBLOCKS  ((30*SEGMENT_SIZE + GAP_BLOCK - 1) / GAP_BLOCK)
+
+typedef struct {
+  UV              first;     /* the first prime in the chunk */
+  UV              ngaps;
+  unsigned char*  gaps;      /* gaps[i] = (prime[i+1] - prime[i]) / 2 */
+  uint32_t*       index;     /* gap index and offset of the first prime */
+} gap_chunk_t;               /*   in each block, in pairs */
+
+static const gap_chunk_t* gap_chunks[GAP_CHUNKS];
+
+static void free_gap_chunk(const gap_chunk_t* c)
+{
+  CFree(c->gaps);
+  CFree(c->index);
+  CFree(c);
+}
+
+static const gap_chunk_t* get_gap_chunk(UV k)
+{
+  const primary_sieve_t* pr;
+  const gap_chunk_t* pub;
+  gap_chunk_t* c;
+  unsigned char* mem;
+  UV p, q, b, n = 0, start = 30 * k * SEGMENT_SIZE;
+
+  pub = ATOMIC_LOAD(gap_chunks[k]);
+  if (pub != 0)  return pub;
+
+  pr = ATOMIC_LOAD(primary);
+  CNew(mem, SEGMENT_SIZE, unsigned char);
+  if (!sieve_segment(mem, k*SEGMENT_SIZE, (k+1)*SEGMENT_SIZE-1,
+                     (pr == 0) ? 0 : pr->sieve, (pr == 0) ? 0 : pr->limit)) {
+    CFree(mem);
+    return 0;
+  }
+
+  CNewz(c, 1, gap_chunk_t);
+  if (c != 0) {
+    CNew(c->gaps, 8*SEGMENT_SIZE+2, unsigned char);
+    CNew(c->index, 2*GAP_NBLOCKS, uint32_t);
+  }
+  if (c == 0 || c->gaps == 0 || c->index == 0) {
+    if (c != 0)  free_gap_chunk(c);
+    CFree(mem);
+    return 0;
+  }
+  if (k == 0) {              /* The wheel sieve leaves out 3 and 5 */
+    c->first = 3;
+    c->gaps[n++] = 1;
+    c->gaps[n++] = 1;
+    p = 7;
+  } else {
+    c->first = p = next_prime_in_segment(mem, start, SEGMENT_SIZE, start);
+  }
+  b = 0;
+  while (b <= (c->first - start) / GAP_BLOCK) {
+    c->index[2*b] = 0;
+    c->index[2*b+1] = c->first - start;
+    b++;
+  }
+  while ((q = next_prime_in_segment(mem, start, SEGMENT_SIZE, p)) != 0) {
+    c->gaps[n++] = (q - p) >> 1;
+    while (b < GAP_NBLOCKS && b <= (q - start) / GAP_BLOCK) {
+      c->index[2*b] = n;
+      c->index[2*b+1] = q - start;
+      b++;
+    }
+    p = q;
+  }
+  for ( ; b < GAP_NBLOCKS; b++) {        /* No primes:  point past the end */
+    c->index[2*b] = n+1;
+    c->index[2*b+1] = p - start;
+  }
+  CFree(mem);
+  {                           /* Shrinking, so only fails if n+1 == 0 */
+    unsigned char* gaps = c->gaps;
+    CRenew(gaps, n+1, unsigned char);
+    if (gaps != 0)  c->gaps = gaps;
+  }
+  c->ngaps = n;
+
+  if (ATOMIC_CAS(gap_chunks[k], 0, c))
+    return c;
+  free_gap_chunk(c);          /* Someone else published it first */
+  return ATOMIC_LOAD(gap_chunks[k]);
+}
+
+/* Position the iterator on the first prime > n in chunk k or later.
+ * Returns 0 if that is past the gap table, or a chunk can't be built. */
+static int set_gap_position(prime_iterator *iter, UV k, UV n)
+{
+  for ( ; k < GAP_CHUNKS; k++) {
+    const gap_chunk_t* c = get_gap_chunk(k);
+    const unsigned char *g, *end;
+    UV q;
+    if (c == 0)  return 0;
+    g = c->gaps;
+    end = c->gaps + c->ngaps;
+    q = c->first;
+    if (n >= q) {
+      UV b = (n + 1 - 30 * k * SEGMENT_SIZE) / GAP_BLOCK;
+      if (b >= GAP_NBLOCKS || c->index[2*b] > c->ngaps) continue;
+      g += c->index[2*b];
+      q = 30 * k * SEGMENT_SIZE + c->index[2*b+1];
+      while (q <= n && g < end)
+        q += 2 * (UV) *g++;
+      if (q <= n) continue;
+    }
+    iter->p = q;
+    iter->gap = g;
+    iter->gap_end = end;
+    return 1;
+  }
+  return 0;
+}
+
+void prime_iterator_set_primary_size(UV bytes)
+{
+  primary_sieve_t *pr, *old;
+  if (bytes < 1024)  bytes = 1024;
+  if (bytes > UVCONST(1073741824))  bytes = UVCONST(1073741824);
+  CNew(pr, 1, primary_sieve_t);
+  if (pr == 0)  return;
+  pr->bytes = bytes;
+  pr->limit = 30*bytes-1;
+  pr->sieve = sieve_erat30(pr->limit);
+  if (pr->sieve == 0) {        /* Keep the one we have */
+    CFree(pr);
+    return;
+  }
+  do {
+    old = ATOMIC_LOAD(primary);
+    pr->retired = old;
+  } while (!ATOMIC_CAS(primary, old, pr));
+}
+
+UV prime_iterator_get_primary_size(void)
+{
+  const primary_sieve_t* pr = ATOMIC_LOAD(primary);
+  return (pr == 0) ? 0 : pr->bytes;
+}
+
 void prime_iterator_global_startup(void)
 {
-  primary_sieve = sieve_erat30(primary_limit);
+  memset(segment_cache, 0, sizeof(segment_cache));
+  memset(gap_chunks, 0, sizeof(gap_chunks));
+  prime_iterator_set_primary_size(PRIMARY_SIZE);
 #ifdef NSMALL_PRIMES
   {
     UV p;
@@ -357,12 +533,68 @@ void prime_iterator_global_startup(void)
 
 void prime_iterator_global_shutdown(void)
 {
-  if (primary_sieve != 0)  Safefree(primary_sieve);
+  UV k;
+  while (primary != 0) {
+    primary_sieve_t* pr = primary;
+    primary = pr->retired;
+    CFree(pr->sieve);
+    CFree(pr);
+  }
+  for (k = 0; k < SEGMENT_CACHE_SIZE; k++) {
+    if (segment_cache[k] != 0)  CFree(segment_cache[k]);
+    segment_cache[k] = 0;
+  }
+  for (k = 0; k < GAP_CHUNKS; k++) {
+    if (gap_chunks[k] != 0)  free_gap_chunk(gap_chunks[k]);
+    gap_chunks[k] = 0;
+  }
   if (small_primes != 0)   Safefree(small_primes);
-  primary_sieve = 0;
   small_primes = 0;
 }
 
+/* Segment k covers bytes [k*SEGMENT_SIZE, (k+1)*SEGMENT_SIZE) */
+static const unsigned char* get_segment(UV k)
+{
+  const primary_sieve_t* pr;
+  const unsigned char* seg;
+  unsigned char* mem;
+  UV lod = k * SEGMENT_SIZE, hid = lod + SEGMENT_SIZE - 1;
+
+  if (SHARE_SEGMENTS && k < SEGMENT_CACHE_SIZE) {
+    seg = ATOMIC_LOAD(segment_cache[k]);
+    if (seg != 0)  return seg;
+  }
+  pr = ATOMIC_LOAD(primary);
+  CNew(mem, SEGMENT_SIZE, unsigned char);
+  if (!sieve_segment(mem, lod, hid, (pr == 0) ? 0 : pr->sieve, (pr == 0) ? 0 : pr->limit)) {
+    CFree(mem);
+    return 0;
+  }
+  if (SHARE_SEGMENTS && k < SEGMENT_CACHE_SIZE) {
+    if (ATOMIC_CAS(segment_cache[k], 0, mem))
+      return mem;
+    CFree(mem);                   /* Someone else published it first */
+    return ATOMIC_LOAD(segment_cache[k]);
+  }
+  return mem;
+}
+
+static int segment_is_shared(const prime_iterator *iter)
+{
+  UV k = iter->segment_start / (30*SEGMENT_SIZE);
+  return (SHARE_SEGMENTS && k < SEGMENT_CACHE_SIZE
+          && ATOMIC_LOAD(segment_cache[k]) == iter->segment_mem);
+}
+
+static void set_segment(prime_iterator *iter, UV k)
+{
+  if (iter->segment_mem != 0 && !segment_is_shared(iter))
+    CFree(iter->segment_mem);
+  iter->segment_mem = get_segment(k);
+  iter->segment_start = 30 * k * SEGMENT_SIZE;
+  iter->segment_bytes = SEGMENT_SIZE;
+}
+
 #if 0
 void prime_iterator_init(prime_iterator *iter)
 {
@@ -370,21 +602,24 @@ void prime_iterator_init(prime_iterator *iter)
   iter->segment_start = 0;
   iter->segment_bytes = 0;
   iter->segment_mem = 0;
+  iter->gap = iter->gap_end = 0;
 }
 
 prime_iterator prime_iterator_default(void)
 {
-  prime_iterator iter = {2, 0, 0, 0};
+  prime_iterator iter = {2, 0, 0, 0, 0, 0};
   return iter;
 }
 #endif
 
 void prime_iterator_destroy(prime_iterator *iter)
 {
-  if (iter->segment_mem != 0)  Safefree(iter->segment_mem);
+  if (iter->segment_mem != 0 && !segment_is_shared(iter))
+    CFree(iter->segment_mem);
   iter->segment_mem = 0;
   iter->segment_start = 0;
   iter->segment_bytes = 0;
+  iter->gap = iter->gap_end = 0;
   iter->p = 0;
 }
 
@@ -404,6 +639,7 @@ static UV pcount(UV n)
 #endif
 
 void prime_iterator_setprime(prime_iterator *iter, UV n) {
+  iter->gap = iter->gap_end = 0;
   /* Is it inside the current segment? */
   if (    (iter->segment_mem != 0)
        && (n >= iter->segment_start)
@@ -418,28 +654,47 @@ void prime_iterator_setprime(prime_iterator *iter, UV n) {
     UV pc = pcount(n);
     iter->segment_start = pc-1;
     iter->p = (pc == 0)  ?  2  :  small_primes[pc-1];
-  } else
+    return;
+  }
 #endif
-  if (n <= primary_limit) { /* Is it inside the primary cache range? */
-    iter->p = n;
-  } else { /* Sieve this range */
-    UV lod, hid;
-    lod = n/30;
-    hid = lod + SEGMENT_SIZE;
-    New(0, iter->segment_mem, SEGMENT_SIZE, unsigned char );
-    iter->segment_start = lod * 30;
-    iter->segment_bytes = SEGMENT_SIZE;
-    if (!sieve_segment((unsigned char*)iter->segment_mem, lod, hid, primary_sieve, primary_limit))
-      croak("Could not segment sieve");
-    iter->p = n;
+  iter->p = n;       /* The next call finds the table chunk or segment */
+}
+
+static int _is_trial_prime(UV n)
+{
+  UV i = 7;
+  UV limit = (UV)sqrt(n);
+  while (1) {   /* trial division, skipping multiples of 2/3/5 */
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 4;
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 2;
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 4;
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 2;
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 4;
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 6;
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 2;
+    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 6;
   }
+  return 1;
 }
 
-UV prime_iterator_next(prime_iterator *iter)
+/* prime_iterator_next when the inlined gap walk has nothing left */
+UV prime_iterator_next_slow(prime_iterator *iter)
 {
-  UV lod, hid, seg_beg, seg_end;
-  const unsigned char* sieve;
-  UV n = iter->p;
+  const primary_sieve_t* pr;
+  UV k, n = iter->p;
+
+  /* The gap table.  If we walked off the end of a chunk, use the next. */
+  if (SHARE_SEGMENTS && n < UVCONST(4294967295)) {
+    if (n < 2) {
+      iter->p = 2;
+      return 2;
+    }
+    k = (n/30) / SEGMENT_SIZE;
+    if (iter->gap != 0) k++;
+    if (set_gap_position(iter, k, n))
+      return iter->p;
+    iter->gap = iter->gap_end = 0;
+  }
 
 #ifdef NSMALL_PRIMES
   if (n < NSMALL_PRIMES) {
@@ -460,68 +715,43 @@ UV prime_iterator_next(prime_iterator *iter)
 #endif
 
   /* Primary sieve */
-  if (primary_sieve != 0 && n < 30*PRIMARY_SIZE) {
-    n = next_prime_in_segment(primary_sieve, 0, PRIMARY_SIZE, iter->p);
+  pr = ATOMIC_LOAD(primary);
+  if (pr != 0 && n < 30*pr->bytes) {
+    n = next_prime_in_segment(pr->sieve, 0, pr->bytes, iter->p);
     if (n > 0) {
       iter->p = n;
       return n;
     }
   }
 
-  sieve = iter->segment_mem;
-  /* Current segment */
-  if (sieve != 0) {
-    seg_beg = iter->segment_start;
-    seg_end = iter->segment_start + 30*iter->segment_bytes - 1;
-    n = next_prime_in_segment(sieve, seg_beg, iter->segment_bytes, iter->p);
+  /* The segment holding p, then following segments */
+  k = (iter->p / 30) / SEGMENT_SIZE;
+  if (iter->segment_mem == 0 || iter->segment_start != 30*k*SEGMENT_SIZE)
+    set_segment(iter, k);
+  while (iter->segment_mem != 0) {
+    UV seg_beg = iter->segment_start;
+    n = next_prime_in_segment(iter->segment_mem, seg_beg, iter->segment_bytes,
+                              (iter->p < seg_beg) ? seg_beg : iter->p);
     if (n > 0) {
       iter->p = n;
       return n;
     }
-    /* Not found in this segment */
-    lod = (seg_end+1)/30;
-  } else {
-    lod = PRIMARY_SIZE;
-    New(0, sieve, SEGMENT_SIZE, unsigned char );
-  }
-
-  hid = lod + SEGMENT_SIZE - 1;
-  iter->segment_start = lod * 30;
-  iter->segment_bytes = SEGMENT_SIZE;
-  seg_beg = iter->segment_start;
-  seg_end = iter->segment_start + 30*iter->segment_bytes - 1;
-
-  if (!sieve_segment((unsigned char*)sieve, lod, hid, primary_sieve, primary_limit))
-    croak("Could not segment sieve from %"UVuf" to %"UVuf, seg_beg, seg_end);
-  iter->segment_mem = sieve;
-
-  n = next_prime_in_segment(sieve, seg_beg, iter->segment_bytes, seg_beg);
-  if (n > 0) {
-    iter->p = n;
-    return n;
+    set_segment(iter, ++k);
   }
-  croak("MPU: segment size too small, could not find prime\n");
-}
 
-static int _is_trial_prime(UV n)
-{
-  UV i = 7;
-  UV limit = (UV)sqrt(n);
-  while (1) {   /* trial division, skipping multiples of 2/3/5 */
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 4;
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 2;
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 4;
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 2;
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 4;
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 6;
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 2;
-    if (i > limit) break;  if ((n % i) == 0) return 0;  i += 6;
-  }
-  return 1;
+  /* Out of memory for the segment, so trial divide */
+  n = iter->p;
+  do {
+    n++;
+  } while (!masktab30[n % 30] || !_is_trial_prime(n));
+  iter->p = n;
+  return n;
 }
 
 int prime_iterator_isprime(prime_iterator *iter, UV n)
 {
+  const primary_sieve_t* pr;
+  UV k;
   if (n < 11) {
     switch (n) {
       case 2: case 3: case 5: case 7:  return 1;  break;
@@ -531,14 +761,19 @@ int prime_iterator_isprime(prime_iterator *iter, UV n)
   }
 
   /* Primary sieve */
-  if (primary_sieve != 0 && n <= primary_limit) {
+  pr = ATOMIC_LOAD(primary);
+  if (pr != 0 && n <= pr->limit) {
     UV d = n/30;
     UV m = n - d*30;
     unsigned char mtab = masktab30[m];
-    return mtab && !(primary_sieve[d] & mtab);
+    return mtab && !(pr->sieve[d] & mtab);
   }
 
-  /* Current segment */
+  /* The segment holding n, sieving it if it is below 2^32 */
+  k = (n/30) / SEGMENT_SIZE;
+  if (k < GAP_CHUNKS &&
+      (iter->segment_mem == 0 || iter->segment_start != 30*k*SEGMENT_SIZE))
+    set_segment(iter, k);
   if (iter->segment_mem != 0) {
     int isp = is_prime_in_segment(iter->segment_mem, iter->segment_start, iter->segment_bytes, n);
     if (isp >= 0) return isp;
@@ -556,6 +791,7 @@ int prime_iterator_isprime(prime_iterator *iter, UV n)
 
 UV* sieve_to_n(UV n, UV* count)
 {
+  const primary_sieve_t* pr;
   UV pi_max, max_buf, i, p, pi;
   const unsigned char* sieve;
   UV* primes;
@@ -580,10 +816,13 @@ UV* sieve_to_n(UV n, UV* count)
   primes[pi++] = 11; primes[pi++] = 13; primes[pi++] = 17; primes[pi++] = 19;
   primes[pi++] = 23; primes[pi++] = 29;
 
-  if (primary_sieve != 0 && n < 30*PRIMARY_SIZE)
-    sieve = primary_sieve;
+  pr = ATOMIC_LOAD(primary);
+  if (pr != 0 && n <= pr->limit)
+    sieve = pr->sieve;
   else
     sieve = sieve_erat30(n);
+  if (sieve == 0)
+    croak("sieve_to_n: could not allocate a sieve to %"UVuf, n);
   max_buf = (n/30) + ((n%30) != 0);
   for (i = 1, p = 30;   i < max_buf;   i++, p += 30) {
     UV c = sieve[i];
@@ -597,7 +836,7 @@ UV* sieve_to_n(UV n, UV* count)
     if (!(c & 128)) primes[pi++] = p+29;
   }
   while (pi > 0 && primes[pi-1] > n) pi--;
-  if (sieve != primary_sieve) Safefree(sieve);
+  if (pr == 0 || sieve != pr->sieve) CFree(sieve);
   if (count != 0) *count = pi;
   return primes;
 }
@@ -8,15 +8,28 @@ typedef struct {
   UV segment_start;
   UV segment_bytes;
   const unsigned char* segment_mem;
+  const unsigned char* gap;         /* next entry in the prime gap table */
+  const unsigned char* gap_end;
 } prime_iterator;
 
-#define PRIME_ITERATOR(i)  prime_iterator i = {2, 0, 0, 0}
+#define PRIME_ITERATOR(i)  prime_iterator i = {2, 0, 0, 0, 0, 0}
 
 extern void prime_iterator_global_startup(void);
 extern void prime_iterator_global_shutdown(void);
 
+/* Replace the primary sieve with one of the given size in bytes (each byte
+ * covers 30 numbers).  Safe while other iterators are running. */
+extern void prime_iterator_set_primary_size(UV bytes);
+extern UV prime_iterator_get_primary_size(void);
+
 extern void prime_iterator_destroy(prime_iterator *iter);
-extern UV prime_iterator_next(prime_iterator *iter);
+extern UV prime_iterator_next_slow(prime_iterator *iter);
+static INLINE UV prime_iterator_next(prime_iterator *iter)
+{
+  if (iter->gap < iter->gap_end)
+    return (iter->p += 2 * (UV) *iter->gap++);
+  return prime_iterator_next_slow(iter);
+}
 extern void prime_iterator_setprime(prime_iterator *iter, UV n);
 extern int prime_iterator_isprime(prime_iterator *iter, UV n);
 
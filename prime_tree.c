@@ -0,0 +1,427 @@
+#include <gmp.h>
+
+#include "ptypes.h"
+#include "prime_tree.h"
+#include "prime_iterator.h"
+#include "gmp_main.h"
+#include "utility.h"
+
+/*
+ * Trial division by remainder trees, with the prime products cached.
+ *
+ * Tier t holds the primes in [2^(t+10), 2^(t+11)), and tier 0 those below
+ * 2^11.  A tier is split into TREE_LEAVES leaves of equal width, and the
+ * leaf products are multiplied up into a product tree stored in heap order:
+ * node 0 is the whole tier and node i has children 2i+1 and 2i+2.  A range
+ * of primes is covered by the fewest nodes whose leaves touch it, so asking
+ * for part of a tier needs no new products.
+ *
+ * One number is tested against a node with gcd(n, node).  GMP first reduces
+ * the larger argument modulo the smaller, so this is the remainder step in
+ * whichever direction fits.  A batch reduces each node down a product tree
+ * of the inputs instead, which is Bernstein's remainder tree.  Only when a
+ * gcd is not 1 do we look at individual primes.
+ *
+ * Tiers are built on first use, published with a compare-and-swap, and kept
+ * until shutdown.  All of them together take about 15MB.
+ */
+#define TREE_TIERS   14
+#define TREE_LEAVES  16
+#define TREE_NODES   (2*TREE_LEAVES-1)
+
+#define GCD_DELAY    8
+
+#define TIER_LO(t)   ( ((t) == 0) ? 0 : (UVCONST(1) << ((t)+10)) )
+#define TIER_HI(t)   ( UVCONST(1) << ((t)+11) )
+
+typedef struct {
+  UV    lo;
+  UV    width;                 /* of each leaf */
+  mpz_t node[TREE_NODES];
+} prime_tree_t;
+
+static prime_tree_t* tiers[TREE_TIERS];
+
+static prime_tree_t* build_tier(int t)
+{
+  prime_tree_t* tr;
+  mpz_t* words;
+  UV p, nwords, ninit, nalloc;
+  int i, j;
+  PRIME_ITERATOR(iter);
+
+  New(0, tr, 1, prime_tree_t);
+  tr->lo = TIER_LO(t);
+  tr->width = (TIER_HI(t) - tr->lo) / TREE_LEAVES;
+
+  /* Each leaf is the product of words, each a product of a few primes */
+  nalloc = 1024;
+  ninit = 0;
+  New(0, words, nalloc, mpz_t);
+  if (t == 0) {
+    p = 2;
+  } else {
+    prime_iterator_setprime(&iter, tr->lo);
+    p = prime_iterator_next(&iter);
+  }
+  for (j = 0; j < TREE_LEAVES; j++) {
+    UV end = tr->lo + (j+1) * tr->width;
+    for (nwords = 0; p < end; nwords++) {
+      unsigned long w = 1;
+      while (p < end && w <= ULONG_MAX / p) {
+        w *= p;
+        p = prime_iterator_next(&iter);
+      }
+      if (nwords >= nalloc) {
+        nalloc *= 2;
+        Renew(words, nalloc, mpz_t);
+      }
+      if (nwords >= ninit)
+        mpz_init(words[ninit++]);
+      mpz_set_ui(words[nwords], w);
+    }
+    mpz_init_set_ui(tr->node[TREE_LEAVES-1+j], 1);
+    if (nwords > 0) {
+      mpz_product(words, 0, nwords-1);
+      mpz_set(tr->node[TREE_LEAVES-1+j], words[0]);
+    }
+  }
+  for (i = TREE_LEAVES-2; i >= 0; i--) {
+    mpz_init(tr->node[i]);
+    mpz_mul(tr->node[i], tr->node[2*i+1], tr->node[2*i+2]);
+  }
+  while (ninit > 0)
+    mpz_clear(words[--ninit]);
+  Safefree(words);
+  prime_iterator_destroy(&iter);
+  return tr;
+}
+
+static void free_tier(prime_tree_t* tr)
+{
+  int i;
+  for (i = 0; i < TREE_NODES; i++)
+    mpz_clear(tr->node[i]);
+  Safefree(tr);
+}
+
+/* The tree for tier t.  *owned is set if the caller must free it. */
+static prime_tree_t* get_tier(int t, int* owned)
+{
+  prime_tree_t* tr = ATOMIC_LOAD(tiers[t]);
+  *owned = 0;
+  if (tr != 0)
+    return tr;
+  tr = build_tier(t);
+  if (!SHARED_TABLES) {
+    *owned = 1;
+    return tr;
+  }
+  if (ATOMIC_CAS(tiers[t], 0, tr))
+    return tr;
+  free_tier(tr);             /* Another thread got there first */
+  return ATOMIC_LOAD(tiers[t]);
+}
+
+void prime_tree_global_shutdown(void)
+{
+  int t;
+  for (t = 0; t < TREE_TIERS; t++) {
+    if (tiers[t] != 0)
+      free_tier(tiers[t]);
+    tiers[t] = 0;
+  }
+}
+
+/* Node i covers leaves [first,first+count).  Store into list, in increasing
+ * order, the nodes covering the leaves that touch [from,to]. */
+static int cover_nodes(const prime_tree_t* tr, int i, int first, int count,
+                       UV from, UV to, int* list)
+{
+  UV lo = tr->lo + first * tr->width;
+  UV hi = lo + count * tr->width - 1;
+  if (hi < from || lo > to)
+    return 0;
+  if (count == 1 || (lo >= from && hi <= to)) {
+    list[0] = i;
+    return 1;
+  }
+  {
+    int n = cover_nodes(tr, 2*i+1, first, count/2, from, to, list);
+    return n + cover_nodes(tr, 2*i+2, first+count/2, count/2, from, to, list+n);
+  }
+}
+
+static void node_range(const prime_tree_t* tr, int i, UV* lo, UV* hi)
+{
+  int first = i, count = 1;
+  while (first < TREE_LEAVES-1) {     /* Walk down the leftmost path */
+    first = 2*first+1;
+    count *= 2;
+  }
+  first -= TREE_LEAVES-1;
+  *lo = tr->lo + first * tr->width;
+  *hi = *lo + count * tr->width - 1;
+}
+
+/* The smallest prime p in [from,to] dividing g, or 0 */
+static UV first_prime_divisor(mpz_t g, UV from, UV to)
+{
+  UV p;
+  PRIME_ITERATOR(iter);
+  if (from <= 2) {
+    if (to >= 2 && mpz_even_p(g))
+      return 2;
+    from = 3;
+  }
+  prime_iterator_setprime(&iter, from-1);
+  for (p = prime_iterator_next(&iter); p <= to; p = prime_iterator_next(&iter))
+    if (mpz_divisible_ui_p(g, p))
+      break;
+  prime_iterator_destroy(&iter);
+  return (p <= to) ? p : 0;
+}
+
+/* Factor of g inside node i of tr, restricted to [from,to] */
+static UV node_factor(mpz_t g, const prime_tree_t* tr, int i, UV from, UV to)
+{
+  UV lo, hi;
+  node_range(tr, i, &lo, &hi);
+  if (from < lo) from = lo;
+  if (to > hi) to = hi;
+  return first_prime_divisor(g, from, to);
+}
+
+/* The nodes covering [from,to] in increasing order, over all tiers.  Tiers
+ * that are not shared are returned in owned[] for the caller to free. */
+typedef struct {
+  int            nnodes;
+  prime_tree_t*  tree[TREE_TIERS*TREE_NODES];
+  int            node[TREE_TIERS*TREE_NODES];
+  prime_tree_t*  owned[TREE_TIERS];
+  int            nowned;
+} node_list_t;
+
+static void gather_nodes(node_list_t* L, UV from, UV to)
+{
+  int t, i;
+  L->nnodes = L->nowned = 0;
+  for (t = 0; t < TREE_TIERS && TIER_LO(t) <= to; t++) {
+    prime_tree_t* tr;
+    int owned, nnodes, list[TREE_NODES];
+    if (TIER_HI(t) <= from)
+      continue;
+    tr = get_tier(t, &owned);
+    if (owned)
+      L->owned[L->nowned++] = tr;
+    nnodes = cover_nodes(tr, 0, 0, TREE_LEAVES, from, to, list);
+    for (i = 0; i < nnodes; i++) {
+      L->tree[L->nnodes] = tr;
+      L->node[L->nnodes++] = list[i];
+    }
+  }
+}
+
+static void release_nodes(node_list_t* L)
+{
+  while (L->nowned > 0)
+    free_tier(L->owned[--L->nowned]);
+}
+
+/* The smallest prime in [from,to] dividing g, searching nodes [first,last) */
+static UV nodes_factor(mpz_t g, const node_list_t* L, int first, int last,
+                       UV from, UV to, mpz_t t)
+{
+  UV f = 0;
+  int i;
+  for (i = first; f == 0 && i < last; i++) {
+    mpz_gcd(t, g, L->tree[i]->node[L->node[i]]);
+    if (mpz_cmp_ui(t, 1) != 0)
+      f = node_factor(t, L->tree[i], L->node[i], from, to);
+  }
+  return f;
+}
+
+UV prime_tree_factor(mpz_t n, UV from, UV to)
+{
+  UV f = 0, log2n = mpz_sizeinbase(n, 2), pbits = 0;
+  int i, first;
+  node_list_t L;
+  mpz_t acc, g, r;
+
+  if (to >= PRIME_TREE_LIMIT)
+    to = PRIME_TREE_LIMIT-1;
+  if (from > to)
+    return 0;
+  gather_nodes(&L, from, to);
+  mpz_init_set_ui(acc, 1);  mpz_init(g);  mpz_init(r);
+
+  /* Multiply nodes together mod n, with one gcd after the nodes add up to
+   * GCD_DELAY times the size of n.  A gcd costs several reductions. */
+  for (i = 0, first = 0; f == 0 && i < L.nnodes; i++) {
+    mpz_srcptr node = L.tree[i]->node[L.node[i]];
+    pbits += mpz_sizeinbase(node, 2);
+    if (mpz_sizeinbase(node, 2) > log2n) {
+      mpz_tdiv_r(r, node, n);
+      node = r;
+    }
+    mpz_mul(acc, acc, node);
+    if (mpz_sizeinbase(acc, 2) > log2n)
+      mpz_tdiv_r(acc, acc, n);
+    if (i == L.nnodes-1 || pbits >= GCD_DELAY*log2n) {
+      mpz_gcd(g, n, acc);
+      if (mpz_cmp_ui(g, 1) != 0)
+        f = nodes_factor(g, &L, first, i+1, from, to, r);
+      mpz_set_ui(acc, 1);
+      first = i+1;
+      pbits = 0;
+    }
+  }
+
+  release_nodes(&L);
+  mpz_clear(acc);  mpz_clear(g);  mpz_clear(r);
+  return f;
+}
+
+/* Append to *list every prime in [from,to] dividing g, which divides node i.
+ * A child whose gcd with g is 1 is skipped, so only the leaves holding a
+ * divisor are scanned. */
+static void node_divisors(mpz_t g, const prime_tree_t* tr, int i, UV from,
+                          UV to, UV** list, UV* nlist, UV* nalloc)
+{
+  if (i < TREE_LEAVES-1) {
+    int c;
+    mpz_t t;
+    mpz_init(t);
+    for (c = 2*i+1; c <= 2*i+2; c++) {
+      mpz_gcd(t, g, tr->node[c]);
+      if (mpz_cmp_ui(t, 1) != 0)
+        node_divisors(t, tr, c, from, to, list, nlist, nalloc);
+    }
+    mpz_clear(t);
+  } else {
+    UV lo, hi, p;
+    node_range(tr, i, &lo, &hi);
+    if (from < lo) from = lo;
+    if (to > hi) to = hi;
+    while (mpz_cmp_ui(g, 1) != 0 && (p = first_prime_divisor(g, from, to)) != 0) {
+      if (*nlist >= *nalloc) {
+        *nalloc *= 2;
+        Renew(*list, *nalloc, UV);
+      }
+      (*list)[(*nlist)++] = p;
+      mpz_divexact_ui(g, g, p);
+      from = p+1;
+    }
+  }
+}
+
+UV prime_tree_divisors(mpz_t n, UV from, UV to, UV** list)
+{
+  UV nlist = 0, nalloc = 64;
+  int i;
+  node_list_t L;
+  mpz_t g;
+
+  New(0, *list, nalloc, UV);
+  if (to >= PRIME_TREE_LIMIT)
+    to = PRIME_TREE_LIMIT-1;
+  if (from > to)
+    return 0;
+  gather_nodes(&L, from, to);
+  mpz_init(g);
+  for (i = 0; i < L.nnodes; i++) {
+    mpz_gcd(g, n, L.tree[i]->node[L.node[i]]);
+    if (mpz_cmp_ui(g, 1) != 0)
+      node_divisors(g, L.tree[i], L.node[i], from, to, list, &nlist, &nalloc);
+  }
+  release_nodes(&L);
+  mpz_clear(g);
+  return nlist;
+}
+
+void prime_tree_factor_batch(UV* f, mpz_t* n, UV nn, UV from, UV to)
+{
+  UV i;
+  int k;
+  node_list_t L;
+  mpz_t *P, *r, g, t;
+
+  for (i = 0; i < nn; i++)
+    f[i] = 0;
+  if (to >= PRIME_TREE_LIMIT)
+    to = PRIME_TREE_LIMIT-1;
+  if (nn == 0 || from > to)
+    return;
+  gather_nodes(&L, from, to);
+  mpz_init(g);  mpz_init(t);
+
+  /* The product of every prime in range, reduced mod each input */
+  New(0, P, L.nnodes, mpz_t);
+  for (k = 0; k < L.nnodes; k++)
+    mpz_init_set(P[k], L.tree[k]->node[L.node[k]]);
+  mpz_product(P, 0, L.nnodes-1);
+  New(0, r, nn, mpz_t);
+  for (i = 0; i < nn; i++)
+    mpz_init(r[i]);
+  mpz_remainder_tree(r, P[0], n, nn);
+  for (k = 0; k < L.nnodes; k++)
+    mpz_clear(P[k]);
+  Safefree(P);
+
+  for (i = 0; i < nn; i++) {
+    mpz_gcd(g, r[i], n[i]);
+    if (mpz_cmp_ui(g, 1) != 0)
+      f[i] = nodes_factor(g, &L, 0, L.nnodes, from, to, t);
+    mpz_clear(r[i]);
+  }
+  Safefree(r);
+  release_nodes(&L);
+  mpz_clear(g);  mpz_clear(t);
+}
+
+/* Bernstein's batch smoothness test.  With P the product of the primes up to
+ * B and r = P mod n, the B-smooth part of n is gcd(n, r^(2^e) mod n) once
+ * 2^e is at least log2(n), as no prime power dividing n has a larger
+ * exponent.  The remainders for all inputs come from one remainder tree. */
+void batch_smooth_parts(mpz_t* s, mpz_t* n, UV nn, UV B)
+{
+  mpz_t P, *m, *r;
+  UV i, nm, *idx;
+
+  New(0, idx, nn, UV);
+  for (i = 0, nm = 0; i < nn; i++) {
+    if (B >= 2 && mpz_cmp_ui(n[i], 1) > 0)
+      idx[nm++] = i;
+    else
+      mpz_set_ui(s[i], mpz_sgn(n[i]) ? 1 : 0);
+  }
+  if (nm == 0)
+    { Safefree(idx); return; }
+
+  /* Copies, as s may be the same array as n */
+  New(0, m, nm, mpz_t);
+  New(0, r, nm, mpz_t);
+  for (i = 0; i < nm; i++) {
+    mpz_init_set(m[i], n[idx[i]]);
+    mpz_init(r[i]);
+  }
+  mpz_init(P);
+  _GMP_primorial(P, B);
+  mpz_remainder_tree(r, P, m, nm);
+  mpz_clear(P);
+
+  for (i = 0; i < nm; i++) {
+    UV e, bits = mpz_sizeinbase(m[i], 2);
+    for (e = 1; e < bits && mpz_sgn(r[i]); e *= 2) {
+      mpz_mul(r[i], r[i], r[i]);
+      mpz_tdiv_r(r[i], r[i], m[i]);
+    }
+    mpz_gcd(s[idx[i]], r[i], m[i]);
+    mpz_clear(r[i]);
+    mpz_clear(m[i]);
+  }
+  Safefree(r);
+  Safefree(m);
+  Safefree(idx);
+}
@@ -0,0 +1,29 @@
+#ifndef MPU_PRIME_TREE_H
+#define MPU_PRIME_TREE_H
+
+#include <gmp.h>
+#include "ptypes.h"
+
+/* The cached product trees hold the primes below this */
+#define PRIME_TREE_LIMIT  UVCONST(16777216)
+
+extern void prime_tree_global_shutdown(void);
+
+/* Returns the smallest prime p with from <= p <= to that divides n, or 0.
+ * Primes at or above PRIME_TREE_LIMIT are not examined. */
+extern UV prime_tree_factor(mpz_t n, UV from, UV to);
+
+/* The same for nn inputs at once using a remainder tree.  f[i] is set to the
+ * smallest prime in [from,to] dividing n[i], or 0. */
+extern void prime_tree_factor_batch(UV* f, mpz_t* n, UV nn, UV from, UV to);
+
+/* Every prime p with from <= p <= to that divides n, in increasing order.
+ * *list is allocated with New and must be freed by the caller.  Returns the
+ * number of primes found. */
+extern UV prime_tree_divisors(mpz_t n, UV from, UV to, UV** list);
+
+/* s[i] = the largest divisor of n[i] whose prime factors are all <= B.
+ * s and n may be the same array. */
+extern void batch_smooth_parts(mpz_t* s, mpz_t* n, UV nn, UV B);
+
+#endif
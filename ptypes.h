@@ -89,6 +89,14 @@
 
 #endif
 
+/* Native 128-bit integers (gcc and clang on 64-bit targets) */
+#if BITS_PER_WORD == 64 && defined(__SIZEOF_INT128__)
+  #define HAVE_UINT128 1
+  typedef unsigned __int128 uint128_t;
+#else
+  #define HAVE_UINT128 0
+#endif
+
 #define MAXBIT        (BITS_PER_WORD-1)
 #define NWORDS(bits)  ( ((bits)+BITS_PER_WORD-1) / BITS_PER_WORD )
 #define NBYTES(bits)  ( ((bits)+8-1) / 8 )
@@ -103,4 +111,41 @@
   #define INLINE
 #endif
 
+/* Lazily built tables shared by all threads are published with a
+ * compare-and-swap and never changed afterwards, so readers need no lock.
+ * Without the gcc/clang atomic builtins that is only safe when perl is not
+ * threaded, and SHARED_TABLES is 0 to say each caller builds its own. */
+#if defined(__ATOMIC_ACQUIRE)
+  #define ATOMIC_LOAD(v)       __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+  #define ATOMIC_STORE(v, n)   __atomic_store_n(&(v), (n), __ATOMIC_RELEASE)
+  #define ATOMIC_CAS(v, o, n)  __sync_bool_compare_and_swap(&(v), (o), (n))
+  #define SHARED_TABLES 1
+#else
+  #define ATOMIC_LOAD(v)       (v)
+  #define ATOMIC_STORE(v, n)   ((v) = (n))
+  #define ATOMIC_CAS(v, o, n)  (((v) == (o)) ? ((v) = (n), 1) : 0)
+  #ifdef USE_ITHREADS
+    #define SHARED_TABLES 0
+  #else
+    #define SHARED_TABLES 1
+  #endif
+#endif
+
+/* factor() may run stages on POSIX worker threads, which read the shared
+ * tables, so it needs the atomics as well. */
+#if defined(__ATOMIC_ACQUIRE) && !defined(_WIN32)
+  #define HAVE_WORKER_THREADS 1
+#else
+  #define HAVE_WORKER_THREADS 0
+#endif
+
+/* Code that runs on those workers, and the shared tables it may publish,
+ * uses the C library's allocator.  Perl's may need the interpreter of the
+ * thread that calls it, and whatever one allocates it must free.  These
+ * return 0 when out of memory rather than croak, so callers check. */
+#define CNew(mem, size, type)     mem = (type*) malloc((size)*sizeof(type))
+#define CNewz(mem, size, type)    mem = (type*) calloc(size, sizeof(type))
+#define CRenew(mem, size, type)   mem = (type*) realloc(mem, (size)*sizeof(type))
+#define CFree(mem)                free((void*)(mem))
+
 #endif
@@ -75,6 +75,7 @@
   /* static int prime_iterator_isprime(mpz_t *iter, UV n) {int isp; mpz_t t; mpz_init_set_ui(t, n); isp = mpz_probab_prime_p(t, 10); mpz_clear(t); return isp;} */
   static int _verbose = 0;
   static int get_verbose_level(void) { return _verbose; }
+  static int effort_spend(UV ops) { return 0; }
 #else
   #include "ptypes.h"
   #include "simpqs.h"
@@ -1124,6 +1125,9 @@ static int mainRoutine(
     while (relsFound < relSought)
     {
         int polyindex;
+        /* Each A sieves 2^(s-1) polynomials, updating every root for each */
+        if (effort_spend((UV)numPrimes << (s-1)))
+          break;
         mpz_set_ui(A,1);
         for (i = 0; i < s-1; )
         {
@@ -1346,6 +1350,19 @@ static int mainRoutine(
     mpz_clear(q);  mpz_clear(r);
     mpz_clear(Bdivp2); mpz_clear(nsqrtdiv);
 
+    if (relsFound < relSought) {   /* Out of effort, give up */
+      if (verbose>3) printf("# qs stopped after %lu relations\n", relsFound);
+      destroyMat(m, relSought);
+      Safefree(relations);
+      for (i = 0; i < (int)relsFound; i++)
+        mpz_clear(XArr[i]);
+      Safefree(XArr);
+      mpz_clear(temp);  mpz_clear(temp2);  mpz_clear(temp3);  mpz_clear(temp4);
+      mpz_tdiv_q_ui(n,n,multiplier);
+      mpz_set(farray[0], n);
+      return 1;
+    }
+
     /* Do the matrix algebra step */
 
     numRelations = gaussReduce(m, numPrimes, relSought);
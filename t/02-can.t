@@ -33,6 +33,8 @@ my @functions = qw(
                      sieve_primes
                      sieve_twin_primes
                      sieve_prime_cluster
+                     twin_prime_count
+                     prime_cluster_count
                      sieve_range
                      next_prime
                      prev_prime
@@ -46,10 +48,21 @@ my @functions = qw(
                      ecm_factor
                      qs_factor
                      factor
+                     factor_with_status
+                     set_factor_strategy
+                     get_factor_strategy
+                     set_factor_cache
+                     factor_cache_stats
+                     set_factor_threads
+                     set_effort_budget
+                     effort_exhausted
+                     smooth_parts
+                     smooth_factors
                      sigma
                      chinese
                      moebius
                      prime_count
+                     nth_prime
                      primorial
                      pn_primorial
                      factorial
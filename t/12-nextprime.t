@@ -3,9 +3,10 @@ use strict;
 use warnings;
 
 use Test::More;
+use Config;
 use Math::Prime::Util::GMP qw/next_prime prev_prime/;
 
-plan tests => 2 + 3*2 + 6 + 1 + 148 + 148 + 1 + 2;
+plan tests => 2 + 3*2 + 6 + 1 + 148 + 148 + 1 + 2 + 4 + 1;
 
 my @small_primes = qw/
 2 3 5 7 11 13 17 19 23 29 31 37 41 43 47 53 59 61 67 71 73 79 83 89 97
@@ -88,3 +89,31 @@ is( next_prime('87567547898934657346596012842304861297462937562349058673456'),
 is( prev_prime('1353175074828899034888345292712068768032725991919855436631156'),
                '1353175074828899034888345292712068768032725991919855436630917',
     "prev_prime(1353....31156) = 1353....30917");
+
+{
+  my $it = Math::Prime::Util::GMP::PrimeIterator->new();
+  my @p = ($it->value, map { $it->next } 1 .. $#small_primes);
+  is_deeply( \@p, \@small_primes, "PrimeIterator walks forward over small primes" );
+  my @r = map { $it->prev } 1 .. $#small_primes+1;
+  is_deeply( \@r, [reverse(@small_primes[0..$#small_primes-1]), 0], "PrimeIterator walks back to 0" );
+}
+{
+  my $n = '87567547898934657346596012842304861297462937562349058673456';
+  my $it = Math::Prime::Util::GMP::PrimeIterator->new($n);
+  my(@exp, @got);
+  my $p = next_prime($n);
+  push @got, $it->value;   push @exp, $p;
+  for (1 .. 300) { push @got, $it->next;  push @exp, $p = next_prime($p); }
+  is_deeply( \@got, \@exp, "PrimeIterator->next matches next_prime for 300 primes" );
+  @got = @exp = ();
+  for (1 .. 400) { push @got, $it->prev;  push @exp, $p = prev_prime($p); }
+  is_deeply( \@got, \@exp, "PrimeIterator->prev matches prev_prime for 400 primes" );
+}
+
+SKIP: {
+  skip "no ithreads", 1 unless $Config::Config{useithreads} && eval { require threads; 1 };
+  my $it = Math::Prime::Util::GMP::PrimeIterator->new(100);
+  my $t = threads->create(sub { ref($it) });
+  my $clone = $t->join;
+  is( "$clone " . $it->next, "SCALAR 103", "PrimeIterator is not cloned into new threads" );
+}
@@ -3,7 +3,7 @@ use strict;
 use warnings;
 
 use Test::More;
-use Math::Prime::Util::GMP qw/prime_count/;
+use Math::Prime::Util::GMP qw/prime_count sieve_primes/;
 
 my %pivals = (
                    1 => 0,
@@ -12,6 +12,13 @@ my %pivals = (
                 1000 => 168,
                10000 => 1229,
                65535 => 6542,
+           200000000 => 11078937,
+);
+
+# One argument, large enough to use LMO
+my %bigpivals = (
+          10000000000 => 455052511,
+        1000000000000 => 37607912018,
 );
 
 # Generated with:
@@ -77,7 +84,8 @@ my @tests = (
 );
 
 
-plan tests => 4 + scalar (keys %pivals) + scalar @tests;
+plan tests => 4 + scalar (keys %pivals) + scalar (keys %bigpivals)
+           + scalar @tests + 2;
 
 
 # TODO: error cases
@@ -89,8 +97,19 @@ while (my($n, $pin) = each (%pivals)) {
   is( prime_count(2, $n), $pin, "Pi($n) = $pin" );
 }
 
+while (my($n, $pin) = each (%bigpivals)) {
+  is( prime_count($n), $pin, "Pi($n) = $pin" );
+}
+is( prime_count(1000000000, 2000000000), 47374753, "prime_count(1e9,2e9) = 47374753" );
+
 foreach my $t (@tests) {
   is( prime_count($t->[0], $t->[1]),
       $t->[2],
       "prime_count($t->[0],$t->[1]) = $t->[2]" );
 }
+
+{
+  my($lo, $hi) = ("100000000000000000000", "100000000000000300000");
+  my @p = sieve_primes($lo, $hi);
+  is( prime_count($lo, $hi), scalar(@p), "prime_count($lo,$hi) matches sieve_primes" );
+}
@@ -0,0 +1,37 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+
+use Test::More;
+use Math::Prime::Util::GMP qw/nth_prime prime_count prev_prime/;
+
+my %nthprimes = (
+                   1 => 2,
+                   2 => 3,
+                   3 => 5,
+                  10 => 29,
+                 100 => 541,
+                1000 => 7919,
+               10000 => 104729,
+              100000 => 1299709,
+             1000000 => 15485863,
+            10000000 => 179424673,
+           100000000 => 2038074743,
+          1000000000 => 22801763489,
+         10000000000 => 252097800623,
+);
+
+my @counts = (100003, 5000011, 987654321, "12345678901");
+
+plan tests => 1 + scalar (keys %nthprimes) + scalar @counts;
+
+is( nth_prime(0), 0, "nth_prime(0) = 0" );
+while (my($n, $nth) = each (%nthprimes)) {
+  is( nth_prime($n), $nth, "nth_prime($n) = $nth" );
+}
+
+# The nth prime is the largest prime <= x where n = pi(x)
+foreach my $x (@counts) {
+  my $n = prime_count($x);
+  is( nth_prime($n), prev_prime($x+1), "nth_prime(prime_count($x)) = prev_prime($x+1)" );
+}
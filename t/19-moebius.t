@@ -15,6 +15,7 @@ my %totients = (
      123456 => 41088,
      123457 => 123456,
   123456789 => 82260072,
+  "11492111704869163932886734762249" => "7659492930013605887119376664000",
 );
 my @A000010 = (0,1,1,2,2,4,2,6,4,6,4,10,4,12,6,8,8,16,6,18,8,12,10,22,8,20,12,18,12,28,8,30,16,20,16,24,12,36,18,24,16,40,12,42,20,24,22,46,16,42,20,32,24,52,18,40,24,36,28,58,16,60,30,36,32,48,20,66,32,44);
 #@totients{0..$#A000010} = @A000010;
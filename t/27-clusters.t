@@ -3,7 +3,8 @@ use strict;
 use warnings;
 
 use Test::More;
-use Math::Prime::Util::GMP qw/sieve_prime_cluster is_prime sieve_primes sieve_twin_primes/;
+use Math::Prime::Util::GMP qw/sieve_prime_cluster is_prime sieve_primes sieve_twin_primes
+                                  prime_cluster_count twin_prime_count/;
 use Math::BigInt try => "GMP,Pari";
 my $extra = defined $ENV{EXTENDED_TESTING} && $ENV{EXTENDED_TESTING};
 
@@ -51,7 +52,7 @@ my @high_check = (
 #[4,6,10,16,18,24,28,30,34,40,46,48,54,58,60,66);   # A257375
 #[6,12,16,18,22,28,30,36,40,42,46,48);   # A214947
 
-plan tests => scalar(@tests) + 2 + 2 * scalar(@patterns) + scalar(@high_check);
+plan tests => scalar(@tests) + 2 + 4 * scalar(@patterns) + 2 + scalar(@high_check);
 
 for my $t (@tests) {
   my($what, $tuple, $range, $expect) = @$t;
@@ -84,6 +85,7 @@ for my $pat (@patterns) {
   my $num = scalar(@tuple);
 
   is_deeply( \@sieve, \@tuple, "Pattern [@pat] $num in range $sbeg .. $send");
+  is( prime_cluster_count($sbeg,$send,@pat), $num, "Pattern [@pat] count $num in range $sbeg .. $send");
 }
 for my $pat (@patterns) {
   my @pat = @$pat;
@@ -93,8 +95,12 @@ for my $pat (@patterns) {
   my $num = scalar(@tuple);
 
   is_deeply( \@sieve, \@tuple, "Pattern [@pat] $num in range $mbeg .. $mend");
+  is( prime_cluster_count($mbeg,$mend,@pat), $num, "Pattern [@pat] count $num in range $mbeg .. $mend");
 }
 
+is( twin_prime_count($sbeg,$send), scalar(@{$small->[1]}), "twin_prime_count $sbeg .. $send" );
+is( twin_prime_count($mbeg,$mend), scalar(@{$large->[1]}), "twin_prime_count $mbeg .. $mend" );
+
 for my $test (@high_check) {
   my($n,$name,$cl) = @$test;
   my $delta = Math::BigInt->new(1000000);
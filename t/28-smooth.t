@@ -0,0 +1,52 @@
+#!/usr/bin/env perl
+use strict;
+use warnings;
+
+use Test::More;
+use Math::Prime::Util::GMP qw/smooth_parts smooth_factors vecprod/;
+use Math::BigInt try => "GMP,Pari";
+
+my @small = (0, 1, 2, 10, 11, 12, 97, 1000, 1001, 248832*13, 2**31*101);
+
+# 2^200 * 3 * 5^3 * 1000003 * (2^127-1)
+my $big = Math::BigInt->new(2)->bpow(200) * 375 * 1000003
+        * Math::BigInt->new("170141183460469231731687303715884105727");
+my $bigpart = Math::BigInt->new(2)->bpow(200) * 375;
+
+# Random inputs with known smooth parts
+srand(11);
+my @primes = (2,3,5,7,11,13,97,101,997,1009,65521,65537,999983,1000003);
+my(@rand, @randpart);
+for (1 .. 300) {
+  my($n, $part) = (Math::BigInt->new(1), Math::BigInt->new(1));
+  for (1 .. 1+int(rand(12))) {
+    my $p = $primes[int(rand(@primes))];
+    $n *= $p;
+    $part *= $p if $p <= 1000;
+  }
+  push @rand, "$n";
+  push @randpart, "$part";
+}
+
+plan tests => 4 + 3 + 1;
+
+is_deeply( [smooth_parts(10, @small)],
+           [0, 1, 2, 10, 1, 12, 1, 1000, 7, 248832, 2**31],
+           "smooth_parts(10, ...)" );
+is_deeply( [smooth_parts(1, @small)],
+           [0, (1) x (@small-1)],
+           "smooth_parts(1, ...) is 1 except for 0" );
+is_deeply( [smooth_parts(1000, "$big")], ["$bigpart"],
+           "smooth part of 2^200 * 375 * 1000003 * (2^127-1)" );
+is_deeply( [smooth_parts(1000, @rand)], \@randpart,
+           "smooth_parts(1000, ...) for 300 random products" );
+
+is_deeply( [smooth_factors(10, 0, 1, 1001, 248832*13)],
+           [[], [], [7], [(2) x 10, (3) x 5]],
+           "smooth_factors(10, ...)" );
+is_deeply( [smooth_factors(1000, "$big")], [[(2) x 200, 3, 5, 5, 5]],
+           "smooth factors of 2^200 * 375 * 1000003 * (2^127-1)" );
+is_deeply( [map { vecprod(@$_) } smooth_factors(1000, @rand)], \@randpart,
+           "smooth_factors(1000, ...) multiply to the smooth parts" );
+
+is_deeply( [smooth_parts(1000)], [], "smooth_parts with no inputs" );
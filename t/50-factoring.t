@@ -3,7 +3,7 @@ use strict;
 use warnings;
 
 use Test::More;
-use Math::Prime::Util::GMP qw/factor is_prime sigma/;
+use Math::Prime::Util::GMP qw/factor is_prime sigma totient factor_with_status primorial sieve_primes set_factor_strategy get_factor_strategy set_effort_budget effort_exhausted/;
 
 my %sigmas = (
   0 => [2,1,1,1],
@@ -24,7 +24,16 @@ my %sigmas = (
 plan tests => 0 + 57
                 + 24
                 + 2
-                + 6    # individual tets for factoring methods
+                + 12   # individual tets for factoring methods
+                + 8    # save and resume
+                + 6    # ECM curve families
+                + 4    # trial division past a word
+                + 6    # factoring strategy
+                + 7    # effort budget
+                + 6    # factor status
+                + 4    # factor cache
+                + 3    # worker threads
+                + 2    # thousands of factors
                 + 7*7  # factor extra tests
                 + 8    # factor in scalar context
                 + scalar(keys %sigmas)
@@ -132,6 +141,13 @@ is_deeply( [ factor('823543') ], [qw/7 7 7 7 7 7 7/], "factor 7^7" );
 # is_deeply( [ factor('148675665359980297048795508874724049089546782584077934753925649') ], ['1234567890123493', '1234567890123493', '9876543210987701', '9876543210987701'], "factor(1234567890123493^2 * 9876543210987701^2)" );
 
 
+# Trial division of inputs larger than a word, inside and past the cached
+# prime product trees.  The cofactor is 2^127-1.
+is_deeply( [ Math::Prime::Util::GMP::trial_factor('712222393424816055467369076404039830808305709', 3000) ], ['2039', '349299849644343332745154034528710069057531'], "trial factor 2039 * 2053 * M127" );
+is_deeply( [ Math::Prime::Util::GMP::trial_factor('6807199030605740702093554393600810292453101094629', 2000000) ], ['40009', '170141693884019613139382498777795253379317181'], "trial factor 40009 * 1000003 * M127" );
+is_deeply( [ Math::Prime::Util::GMP::trial_factor('2854516369241729531307617463537217748773030968302309', 1000002) ], ['2854516369241729531307617463537217748773030968302309'], "trial factor stops before 1000003" );
+is_deeply( [ Math::Prime::Util::GMP::trial_factor('47890816774057807781273163039197840717039921650463677', 16777300) ], ['16777259', '2854507805718312376370488352072161532288434103'], "trial factor past the product trees" );
+
 #diag "factor 105-bit number with p-1";
 Math::Prime::Util::GMP::_GMP_set_verbose(4);
 is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::pminus1_factor('22095311209999409685885162322219') ], ['3916587618943361', '5641469912004779'], "p-1 factors 22095311209999409685885162322219" );
@@ -140,6 +156,19 @@ Math::Prime::Util::GMP::_GMP_set_verbose(0);
 is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::pplus1_factor('22095311209999409685885162322219') ], ['3916587618943361', '5641469912004779'], "p+1 factors 22095311209999409685885162322219" );
 
 is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::ecm_factor('16049407357301026788959025956634678743968244330856613525782006075043') ], [qw/99151111 161868154531329727500068314480456792299263740280798402004613/], "ECM factors p8*p60" );
+{
+  my $n = '16049407357301026788959025956634678743968244330856613525782006075043';
+  my @f = qw/99151111 161868154531329727500068314480456792299263740280798402004613/;
+  is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::ecm_factor($n, 0, 0, 'edwards') ], \@f, "ECM on Edwards curves factors p8*p60" );
+  is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::ecm_factor($n, 0, 0, 'suyama') ], \@f, "ECM on Suyama curves factors p8*p60" );
+  is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::ecm_factor($n, 0, 0, 'affine') ], \@f, "ECM on affine curves factors p8*p60" );
+  ok( !eval { Math::Prime::Util::GMP::ecm_factor($n, 2000, 1, 'weierstrass'); 1 }, "ecm_factor rejects unknown curve families" );
+  set_factor_strategy(['ecm_suyama', 0, 0, 5000, 100]);
+  is_deeply( [ factor($n) ], \@f, "factor with only ecm_suyama in the strategy" );
+  set_factor_strategy(['ecm_affine', 0, 0, 20000, 100]);
+  is_deeply( [ factor($n) ], \@f, "factor with only ecm_affine in the strategy" );
+  set_factor_strategy();
+}
 
 is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::qs_factor('22095311209999409685885162322219') ], ['3916587618943361', '5641469912004779'], "QS factors 22095311209999409685885162322219" );
 
@@ -148,6 +177,97 @@ is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::holf_factor('185486767418172
 
 # Test stage 2 of pminus1
 is_deeply( [ sort {$a<=>$b} Math::Prime::Util::GMP::pminus1_factor('23113042053749572861737011', 100, 100000) ], ['694059980329', '33301217054459'], "p-1 factors 23113042053749572861737011 in stage 2");
+is_deeply( [ Math::Prime::Util::GMP::pminus1_factor('4501891000000000000000000000256607787', 1000, 100000) ], ['4501891', '1000000000000000000000000000057'], "p-1 stage 2 with small giant steps");
+is_deeply( [ Math::Prime::Util::GMP::pminus1_factor('280013000000000000000000000015960741', 1000, 50000000) ], ['280013', '1000000000000000000000000000057'], "p-1 stage 2 with large giant steps");
+is_deeply( [ Math::Prime::Util::GMP::pminus1_factor('90000103000000000000000000005130005871', 1000, 20000000) ], ['90000103', '1000000000000000000000000000057'], "p-1 polynomial stage 2");
+is_deeply( [ Math::Prime::Util::GMP::pplus1_factor('570464294399000000000000000032516464780743', 200, 200) ], ['570464294399', '1000000000000000000000000000057'], "p+1 stage 1 with prime powers");
+is_deeply( [ Math::Prime::Util::GMP::pplus1_factor('1400587000000000000000000000079833459', 1000, 100000) ], ['1400587', '1000000000000000000000000000057'], "p+1 stage 2");
+is_deeply( [ Math::Prime::Util::GMP::pplus1_factor('60000067000000000000000000003420003819', 1000, 20000000) ], ['60000067', '1000000000000000000000000000057'], "p+1 polynomial stage 2");
+
+{
+  my $n = "17790414163000000000000000000000000000658245324031";
+  my $s = Math::Prime::Util::GMP::pminus1_save($n, 1000);
+  like( $s, qr/^METHOD=P-1; B1=1000; N=$n; X=0x[0-9a-f]+; X0=0x2; CHECKSUM=\d+;/, "pminus1_save line" );
+  is_deeply( [ Math::Prime::Util::GMP::resume_factor($s, 10000) ], ['17790414163', '1000000000000000000000000000000000000037'], "resume_factor finds p-1 factor in stage 2" );
+  is( Math::Prime::Util::GMP::resume_save($s, 5000), Math::Prime::Util::GMP::pminus1_save($n, 5000), "resume_save extends p-1 stage 1" );
+  is( Math::Prime::Util::GMP::resume_save(Math::Prime::Util::GMP::ecm_save($n, 2000, 12345), 4000), Math::Prime::Util::GMP::ecm_save($n, 4000, 12345), "resume_save extends ECM stage 1" );
+  my $e = Math::Prime::Util::GMP::ecm_save($n, 1000, 8);
+  is_deeply( [ Math::Prime::Util::GMP::resume_factor($e, 1000) ], [$n], "ECM sigma 8 finds nothing in stage 1" );
+  is_deeply( [ Math::Prime::Util::GMP::resume_factor($e, 100000) ], ['17790414163', '1000000000000000000000000000000000000037'], "resume_factor finds ECM factor in stage 2" );
+  my ($line, @f) = Math::Prime::Util::GMP::pminus1_save($n, 10000);
+  is_deeply( [$line =~ /^METHOD=P-1; B1=10000;/ ? 1 : 0, @f], [1, '17790414163', '1000000000000000000000000000000000000037'], "pminus1_save returns a factor found in stage 1" );
+  (my $nosum = $s) =~ s/CHECKSUM=\d+; //;
+  ok( !eval { Math::Prime::Util::GMP::resume_factor($nosum); 1 }, "resume_factor rejects a line with no checksum" );
+}
+
+{
+  my @default = get_factor_strategy();
+  set_factor_strategy(@default);
+  is_deeply( [get_factor_strategy()], \@default, "factor strategy round trip" );
+  my @over = grep { $_->[5] > $default[-1][5] } @default;
+  is( scalar(@over), 0, "last resort ECM stage has the largest cost" );
+  set_factor_strategy(['pminus1', 0, 0, 100, 100000]);
+  is_deeply( [ factor('23113042053749572861737011') ], ['694059980329', '33301217054459'], "factor with only p-1 in the strategy" );
+  set_factor_strategy(['power'], ['pbrent', 200, 0]);
+  is_deeply( [ factor('22095311209999409685885162322219') ], ['22095311209999409685885162322219'], "factor leaves composites no stage applies to" );
+  ok( !eval { set_factor_strategy(['nfs']); 1 }, "set_factor_strategy rejects unknown methods" );
+  set_factor_strategy();
+  is_deeply( [get_factor_strategy()], \@default, "set_factor_strategy() restores the default" );
+}
+
+set_effort_budget(0, 1);
+is_deeply( [ factor('22095311209999409685885162322219') ], ['22095311209999409685885162322219'], "factor stops when out of effort" );
+is_deeply( [ factor_with_status('22095311209999409685885162322219') ], [['22095311209999409685885162322219',1,0]], "factor_with_status marks unfactored composites" );
+ok( effort_exhausted(), "effort_exhausted after running out" );
+is_deeply( [ factor(12) ], [2,2,3], "the next call starts the budget over" );
+ok( !eval { totient('22095311209999409685885162322219'); 1 }, "totient croaks rather than use a partial factorization" );
+set_effort_budget(0, 1_000_000);
+{
+  # One curve to B1 = 10^9 would run for hours if it were not cut short
+  my $n = '300000000000000000000000000000000000003740000000000000000000000000000000000001331';
+  my @f = Math::Prime::Util::GMP::ecm_factor($n, 1_000_000_000, 1);
+  ok( "@f" eq $n && effort_exhausted(), "ECM stops inside a curve when out of effort" );
+}
+set_effort_budget();
+is_deeply( [ factor('22095311209999409685885162322219') ], ['3916587618943361', '5641469912004779'], "factor works again with no budget" );
+ok( !effort_exhausted(), "no budget is never exhausted" );
+is_deeply( [ factor_with_status(1) ], [], "factor_with_status(1)" );
+is_deeply( [ factor_with_status(12) ], [[2,2,2],[3,1,2]], "factor_with_status(12)" );
+is_deeply( [ factor_with_status('1531152734928447706924981823957245071') ], [[3,1,2],[23,1,2],[1483,1,2],['14963330645171339987735219677673',1,1]], "factor_with_status with a probable prime" );
+is_deeply( [ factor_with_status('19352485729316803443325848218189') ], [[4001,2,2],['1208925819614629174706189',1,1]], "factor_with_status with the square of the trial limit" );
+is_deeply( [ factor('11492111704869163932886734762249') ], [(3) x 50, 4001, 4001], "factor(3^50 * 4001^2)" );
+
+{
+  my $n = '1531152734928447706924981823957245071';
+  Math::Prime::Util::GMP::set_factor_cache(10);
+  my @f = factor($n);
+  is_deeply( [ factor($n) ], \@f, "factor from the cache" );
+  is( totient($n), '975728864710332737920238204741635776', "totient from the cache" );
+  is_deeply( [ Math::Prime::Util::GMP::factor_cache_stats() ], [2,1,1], "factor cache hits, misses, and entries" );
+  Math::Prime::Util::GMP::set_factor_cache(0);
+  is_deeply( [ Math::Prime::Util::GMP::factor_cache_stats() ], [0,0,0], "factor cache off" );
+}
+
+{
+  # p-1 finds the first two primes together, so two composites are left
+  my $n = '97142328942566659369473469014807249307983821132079175455136180091176851669097';
+  my @f = ('1858491134779944239', '24890219281508668231', '30000000000000000797', '70000000000000000789');
+  my $nthreads = Math::Prime::Util::GMP::set_factor_threads(4);
+  ok( $nthreads == 1 || $nthreads == 4, "set_factor_threads returns the threads used" );
+  is_deeply( [ factor($n) ], \@f, "factor with worker threads" );
+  set_effort_budget(0, 200000);
+  my @status = map { $_->[2] } factor_with_status($n);
+  set_effort_budget();
+  ok( effort_exhausted() == 0 && (grep { $_ == 0 } @status), "worker threads charge the caller's effort budget" );
+  Math::Prime::Util::GMP::set_factor_threads(1);
+}
+
+{
+  my @p = sieve_primes(2, 30000);
+  is_deeply( [ factor(primorial(30000)) ], \@p, "factor(primorial(30000))" );
+  my $n = primorial(3000) . "0" x 500;
+  is( scalar factor($n), 430+1000, "factor(primorial(3000) * 10^500)" );
+}
 
 #diag "extra tests for each method";
 extra_factor_test("prho_factor",   sub {Math::Prime::Util::GMP::prho_factor(shift)});
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <time.h>
 #include <gmp.h>
 
 #include "ptypes.h"
@@ -17,8 +18,73 @@ static int _verbose = 0;
 int get_verbose_level(void) { return _verbose; }
 void set_verbose_level(int level) { _verbose = level; }
 
+/* The effort budget.  Long running loops call effort_spend every so often
+ * with the work done since the last call, and give up when it returns 1.
+ * Each thread has its own, and the count starts over with effort_begin at
+ * every top level call, so one call running out does not stop later ones.
+ * Worker threads started for a call adopt the caller's budget, so the
+ * count is updated with a compare-and-swap. */
+#if defined(_MSC_VER)
+  #define BUDGET_TLS __declspec(thread)
+#elif defined(__GNUC__)
+  #define BUDGET_TLS __thread
+#else
+  #define BUDGET_TLS
+#endif
+typedef struct {
+  UV     seconds;        /* limits, 0 for none */
+  UV     ops;
+  time_t deadline;       /* for the current call */
+  UV     spent;
+  int    over;
+} effort_budget_t;
+static BUDGET_TLS effort_budget_t _own_budget;
+static BUDGET_TLS effort_budget_t* _adopted = 0;
+#define BUDGET  ((_adopted != 0) ? _adopted : &_own_budget)
+
+void set_effort_budget(UV seconds, UV ops) {
+  _own_budget.seconds = seconds;
+  _own_budget.ops = ops;
+  effort_begin();
+}
+void effort_begin(void) {
+  effort_budget_t* b = BUDGET;
+  b->deadline = (b->seconds > 0) ? time(NULL) + (time_t)b->seconds : 0;
+  b->spent = 0;
+  b->over = 0;
+}
+void* effort_share(void) { return BUDGET; }
+void effort_adopt(void* budget) { _adopted = (effort_budget_t*) budget; }
+int effort_spend(UV ops) {
+  effort_budget_t* b = BUDGET;
+  if (ATOMIC_LOAD(b->over)) return 1;
+  if (b->ops > 0) {
+    UV spent, next;
+    do {
+      spent = ATOMIC_LOAD(b->spent);
+      next = (ops > b->ops - spent) ? b->ops : spent + ops;
+    } while (!ATOMIC_CAS(b->spent, spent, next));
+    if (next >= b->ops) ATOMIC_STORE(b->over, 1);
+  }
+  if (b->deadline > 0 && time(NULL) >= b->deadline)
+    ATOMIC_STORE(b->over, 1);
+  return ATOMIC_LOAD(b->over);
+}
+int effort_exhausted(void) { return ATOMIC_LOAD(BUDGET->over); }
+
 static gmp_randstate_t _randstate;
 gmp_randstate_t* get_randstate(void) { return &_randstate; }
+/* A seed for a private state, drawn from the shared one under a spin lock
+ * since factor() worker threads call this. */
+static int _randlock = 0;
+unsigned long get_random_seed(void) {
+  unsigned long seed;
+  while (!ATOMIC_CAS(_randlock, 0, 1))
+    ;
+  seed = gmp_urandomb_ui(_randstate, 32);
+  ATOMIC_CAS(_randlock, 1, 0);
+  return seed;
+}
 void init_randstate(unsigned long seed) {
 #if (__GNU_MP_VERSION > 4) || (__GNU_MP_VERSION == 4 && __GNU_MP_VERSION_MINOR >= 2)
   /* MT was added in GMP 4.2 released in 2006. */
@@ -90,6 +156,40 @@ int mpz_divmod(mpz_t r, mpz_t a, mpz_t b, mpz_t n, mpz_t t)
   return 1;
 }
 
+/* Montgomery's trick: r[i] = 1/a[i] mod n with one inversion and three
+ * mulmods per element.  c is na initialized temporaries, r may be a.
+ * Returns 1 on success.  Otherwise r is untouched and g = gcd(a[i],n) for
+ * an a[i] not invertible, preferring a proper factor of n to n itself. */
+int mpz_invert_batch(mpz_t* r, mpz_t* a, UV na, mpz_t n, mpz_t* c, mpz_t g)
+{
+  UV i;
+  if (na == 0) return 1;
+  mpz_mod(c[0], a[0], n);
+  for (i = 1; i < na; i++)
+    mpz_mulmod(c[i], c[i-1], a[i], n, c[i]);
+  if (!mpz_invert(g, c[na-1], n)) {
+    int found = 0;
+    for (i = 0; i < na && found != 2; i++) {
+      mpz_gcd(c[0], a[i], n);
+      if (mpz_cmp_ui(c[0], 1) == 0) continue;
+      if (!found || mpz_cmp(c[0], n) != 0) {
+        mpz_set(g, c[0]);
+        found = (mpz_cmp(g, n) != 0) ? 2 : 1;
+      }
+    }
+    return 0;
+  }
+  /* g = 1/(a[0]...a[i]), so 1/a[i] = g * c[i-1] */
+  for (i = na-1; i > 0; i--) {
+    mpz_mulmod(c[i], g, a[i], n, c[i]);
+    mpz_mulmod(r[i], g, c[i-1], n, r[i]);
+    mpz_swap(g, c[i]);
+  }
+  mpz_set(r[0], g);
+  mpz_set_ui(g, 1);
+  return 1;
+}
+
 /* set x to sqrt(a) mod p.  Returns 0 if a is not a square root mod p
  * See Cohen section 1.5 and http://www.math.vt.edu/people/brown/doc/sqrts.pdf
  */
@@ -534,6 +634,59 @@ void mpz_product(mpz_t* A, UV a, UV b) {
   }
 }
 
+/* r[i] = a mod m[i] for each of the nm positive moduli, using a remainder
+ * tree.  The moduli are taken in groups whose product is about the size of
+ * a.  Larger groups only copy a further down, and use more memory. */
+void mpz_remainder_tree(mpz_t* r, mpz_t a, mpz_t* m, UV nm)
+{
+  mpz_t *xtree[BITS_PER_WORD+1], *rtree[BITS_PER_WORD+1];
+  UV i, first, last, size[BITS_PER_WORD+1];
+  UV target = mpz_sizeinbase(a, 2);
+  int k, depth;
+
+  if (target < 4096) target = 4096;
+  for (first = 0; first < nm; first = last) {
+    UV bits = 0;
+    for (last = first; last < nm && bits < target; last++)
+      bits += mpz_sizeinbase(m[last], 2);
+
+    /* Product tree of the group.  Level 0 is the moduli themselves. */
+    xtree[0] = m + first;
+    size[0] = last - first;
+    for (depth = 0; size[depth] > 1; depth++) {
+      UV nodes = (size[depth]+1) / 2;
+      New(0, xtree[depth+1], nodes, mpz_t);
+      for (i = 0; i < nodes; i++) {
+        mpz_init(xtree[depth+1][i]);
+        if (2*i+1 < size[depth])
+          mpz_mul(xtree[depth+1][i], xtree[depth][2*i], xtree[depth][2*i+1]);
+        else
+          mpz_set(xtree[depth+1][i], xtree[depth][2*i]);
+      }
+      size[depth+1] = nodes;
+    }
+
+    /* Remainders top down, freeing each level once it has been used */
+    rtree[0] = r + first;
+    for (k = depth; k > 0; k--) {
+      New(0, rtree[k], size[k], mpz_t);
+      for (i = 0; i < size[k]; i++)
+        mpz_init(rtree[k][i]);
+    }
+    mpz_tdiv_r(rtree[depth][0], a, xtree[depth][0]);
+    for (k = depth-1; k >= 0; k--) {
+      for (i = 0; i < size[k]; i++)
+        mpz_tdiv_r(rtree[k][i], rtree[k+1][i/2], xtree[k][i]);
+      for (i = 0; i < size[k+1]; i++) {
+        mpz_clear(rtree[k+1][i]);
+        mpz_clear(xtree[k+1][i]);
+      }
+      Safefree(rtree[k+1]);
+      Safefree(xtree[k+1]);
+    }
+  }
+}
+
 
 #if 0
 /* Simple polynomial multiplication */
@@ -751,9 +904,31 @@ void polyz_mulmod(mpz_t* pr, mpz_t* px, mpz_t *py, long *dr, long dx, long dy, m
 }
 #endif
 #if 1
+/* Kronecker substitution: pack each poly into one integer with a slot of
+ * whole limbs per coefficient, multiply, and unpack.  Packing goes through
+ * limb buffers so it is linear in the size. */
+static void polyz_pack(mpz_t p, mpz_t* px, long dx, UV nl, mpz_t mod, mpz_t t)
+{
+  mp_limb_t* buf;
+  long i;
+  Newz(0, buf, (dx+1)*nl, mp_limb_t);
+  for (i = 0; i <= dx; i++) {
+    if (mpz_sgn(px[i]) >= 0 && mpz_cmp(px[i], mod) < 0) {
+      mpz_export(buf + i*nl, NULL, -1, sizeof(mp_limb_t), 0, 0, px[i]);
+    } else {
+      mpz_mod(t, px[i], mod);
+      mpz_export(buf + i*nl, NULL, -1, sizeof(mp_limb_t), 0, 0, t);
+    }
+  }
+  mpz_import(p, (dx+1)*nl, -1, sizeof(mp_limb_t), 0, 0, buf);
+  Safefree(buf);
+}
+
 void polyz_mulmod(mpz_t* pr, mpz_t* px, mpz_t *py, long *dr, long dx, long dy, mpz_t mod)
 {
-  UV i, bits, r;
+  UV i, bits, r, nl;
+  size_t count;
+  mp_limb_t* buf;
   mpz_t p, p2, t;
 
   mpz_init(p); mpz_init(t);
@@ -762,33 +937,27 @@ void polyz_mulmod(mpz_t* pr, mpz_t* px, mpz_t *py, long *dr, long dx, long dy, m
   mpz_mul(t, mod, mod);
   mpz_mul_ui(t, t, r);
   bits = mpz_sizeinbase(t, 2);
-  mpz_set_ui(p, 0);
+  nl = (bits + 8*sizeof(mp_limb_t) - 1) / (8*sizeof(mp_limb_t));
 
   /* Create big integers p and p2 from px and py, with padding */
-  {
-    for (i = 0; i <= (UV)dx; i++) {
-      mpz_mul_2exp(p, p, bits);
-      mpz_add(p, p, px[dx-i]);
-    }
-  }
+  polyz_pack(p, px, dx, nl, mod, t);
   if (px == py) {
-    mpz_pow_ui(p, p, 2);
+    mpz_mul(p, p, p);
   } else {
-    mpz_init_set_ui(p2, 0);
-    for (i = 0; i <= (UV)dy; i++) {
-      mpz_mul_2exp(p2, p2, bits);
-      mpz_add(p2, p2, py[dy-i]);
-    }
+    mpz_init(p2);
+    polyz_pack(p2, py, dy, nl, mod, t);
     mpz_mul(p, p, p2);
     mpz_clear(p2);
   }
 
   /* Pull out parts of result p to pr */
+  Newz(0, buf, r*nl, mp_limb_t);
+  mpz_export(buf, &count, -1, sizeof(mp_limb_t), 0, 0, p);
   for (i = 0; i < r; i++) {
-    mpz_tdiv_r_2exp(t, p, bits);
-    mpz_tdiv_q_2exp(p, p, bits);
+    mpz_import(t, nl, -1, sizeof(mp_limb_t), 0, 0, buf + i*nl);
     mpz_mod(pr[i], t, mod);
   }
+  Safefree(buf);
 
   mpz_clear(p); mpz_clear(t);
 }
@@ -959,6 +1128,223 @@ void polyz_pow_polymod(mpz_t* pres,  mpz_t* pn,  mpz_t* pmod,
   Safefree(pX);
 }
 
+/* Fast multipoint evaluation with a subproduct tree (von zur Gathen and
+ * Gerhard, section 10.1).  Node i is the monic product of (x - r) over its
+ * roots, with children 2i+1 and 2i+2 splitting the roots in half.  A poly
+ * is reduced modulo the root node and then down the tree, so its values at
+ * the leaves come from O(log n) levels of multiplication.  Each reduction
+ * divides by a monic node using a precomputed inverse of the reversed node
+ * as a power series, which takes two multiplications.
+ *
+ * Coefficients are kept as arrays of mpz_t, lowest degree first. */
+
+static mpz_t* polyz_alloc(long d)
+{
+  mpz_t* p;
+  long i;
+  New(0, p, d+1, mpz_t);
+  for (i = 0; i <= d; i++)
+    mpz_init(p[i]);
+  return p;
+}
+
+static void polyz_free(mpz_t* p, long d)
+{
+  long i;
+  for (i = 0; i <= d; i++)
+    mpz_clear(p[i]);
+  Safefree(p);
+}
+
+/* pr = the first k coefficients of 1/pf as a power series, with pf[0] = 1.
+ * Newton's iteration g = g + g(1 - f g), doubling the precision each time. */
+static void polyz_inverse_series(mpz_t* pr, mpz_t* pf, long df, long k, mpz_t mod)
+{
+  mpz_t *pe, *pt;
+  long i, prec, dt, de;
+
+  pe = polyz_alloc(2*k);
+  pt = polyz_alloc(3*k);
+  mpz_set_ui(pr[0], 1);
+  for (prec = 1; prec < k; ) {
+    long nprec = (2*prec < k) ? 2*prec : k;
+    long dfx = (df < nprec-1) ? df : nprec-1;
+    polyz_mulmod(pt, pf, pr, &dt, dfx, prec-1, mod);    /* f g */
+    for (i = 0; i < nprec; i++) {                       /* e = 1 - f g */
+      if (i <= dt)  mpz_neg(pe[i], pt[i]);
+      else          mpz_set_ui(pe[i], 0);
+    }
+    mpz_add_ui(pe[0], pe[0], 1);
+    for (de = nprec-1; de > 0 && mpz_sgn(pe[de]) == 0; de--) ;
+    for (i = 0; i <= de; i++)
+      mpz_mod(pe[i], pe[i], mod);
+    polyz_mulmod(pt, pr, pe, &dt, prec-1, de, mod);     /* g e */
+    for (i = prec; i < nprec; i++) {
+      if (i <= dt)  mpz_set(pr[i], pt[i]);
+      else          mpz_set_ui(pr[i], 0);
+    }
+    prec = nprec;
+  }
+  polyz_free(pe, 2*k);
+  polyz_free(pt, 3*k);
+}
+
+static void polyz_tree_build(polyz_tree_t* T, long i, long lo, long hi, mpz_t* roots, mpz_t mod)
+{
+  long d = hi - lo;
+  T->deg[i] = d;
+  T->node[i] = polyz_alloc(d);
+  if (d == 1) {
+    mpz_neg(T->node[i][0], roots[lo]);
+    mpz_mod(T->node[i][0], T->node[i][0], mod);
+    mpz_set_ui(T->node[i][1], 1);
+  } else {
+    long mid = lo + d/2, dr;
+    polyz_tree_build(T, 2*i+1, lo, mid, roots, mod);
+    polyz_tree_build(T, 2*i+2, mid, hi, roots, mod);
+    polyz_mulmod(T->node[i], T->node[2*i+1], T->node[2*i+2], &dr,
+                 T->deg[2*i+1], T->deg[2*i+2], mod);
+  }
+}
+
+/* The inverse of reversed node i, to the precision reducing a poly of
+ * degree below pdeg needs. */
+static void polyz_tree_inverses(polyz_tree_t* T, long i, long pdeg, mpz_t mod)
+{
+  long d = T->deg[i], k = pdeg - d, j;
+  T->ninv[i] = k;
+  T->inv[i] = 0;
+  if (k > 0) {
+    mpz_t* rev = polyz_alloc(d);
+    for (j = 0; j <= d; j++)
+      mpz_set(rev[j], T->node[i][d-j]);
+    T->inv[i] = polyz_alloc(k-1);
+    polyz_inverse_series(T->inv[i], rev, d, k, mod);
+    polyz_free(rev, d);
+  }
+  if (d > 1) {
+    polyz_tree_inverses(T, 2*i+1, d, mod);
+    polyz_tree_inverses(T, 2*i+2, d, mod);
+  }
+}
+
+void polyz_tree_init(polyz_tree_t* T, mpz_t* roots, long nroots, long maxdeg, mpz_t mod)
+{
+  long size = 1, i;
+  while (size < nroots) size *= 2;
+  T->nroots = nroots;
+  T->nnodes = 2*size;
+  New(0, T->node, T->nnodes, mpz_t*);
+  New(0, T->inv, T->nnodes, mpz_t*);
+  New(0, T->deg, T->nnodes, long);
+  New(0, T->ninv, T->nnodes, long);
+  for (i = 0; i < T->nnodes; i++) {
+    T->node[i] = T->inv[i] = 0;
+    T->deg[i] = T->ninv[i] = -1;
+  }
+  polyz_tree_build(T, 0, 0, nroots, roots, mod);
+  polyz_tree_inverses(T, 0, maxdeg+1, mod);
+}
+
+void polyz_tree_destroy(polyz_tree_t* T)
+{
+  long i;
+  for (i = 0; i < T->nnodes; i++) {
+    if (T->node[i] != 0)  polyz_free(T->node[i], T->deg[i]);
+    if (T->inv[i] != 0)   polyz_free(T->inv[i], T->ninv[i]-1);
+  }
+  Safefree(T->node);
+  Safefree(T->inv);
+  Safefree(T->deg);
+  Safefree(T->ninv);
+}
+
+/* pr = pa mod node i, for pa of degree da below deg + ninv.  Returns the
+ * degree of pr, which has room for deg coefficients. */
+static long polyz_tree_rem(mpz_t* pr, mpz_t* pa, long da, polyz_tree_t* T, long i, mpz_t mod)
+{
+  long d = T->deg[i], k = da - d + 1, j, dq, dt;
+  mpz_t *prev, *pq, *pt;
+
+  if (k <= 0) {
+    for (j = 0; j <= da; j++)
+      mpz_set(pr[j], pa[j]);
+    return da;
+  }
+  if (k > T->ninv[i])
+    croak("polyz_tree_rem: degree %ld too large", da);
+  /* The quotient reversed is rev(a) / rev(node) mod x^k */
+  prev = polyz_alloc(k-1);
+  pq = polyz_alloc(2*k);
+  pt = polyz_alloc(da+1);
+  for (j = 0; j < k; j++)
+    mpz_set(prev[j], pa[da-j]);
+  polyz_mulmod(pq, prev, T->inv[i], &dq, k-1, k-1, mod);
+  for (j = 0; j < k; j++)
+    mpz_set(prev[k-1-j], pq[j]);
+  /* r = a - q node, of which only the low d coefficients are needed */
+  polyz_mulmod(pt, prev, T->node[i], &dt, k-1, d, mod);
+  for (j = 0; j < d; j++) {
+    mpz_sub(pr[j], pa[j], pt[j]);
+    mpz_mod(pr[j], pr[j], mod);
+  }
+  polyz_free(prev, k-1);
+  polyz_free(pq, 2*k);
+  polyz_free(pt, da+1);
+  return d-1;
+}
+
+static void polyz_tree_descend(mpz_t* vals, mpz_t* pa, long da, polyz_tree_t* T, long i, long lo, mpz_t mod)
+{
+  long d = T->deg[i], dr;
+  mpz_t* pr;
+  if (d == 1) {
+    if (da == 0) {
+      mpz_set(vals[lo], pa[0]);
+    } else {                         /* a mod (x - r) = a(r) */
+      mpz_t* t = polyz_alloc(0);
+      polyz_tree_rem(t, pa, da, T, i, mod);
+      mpz_set(vals[lo], t[0]);
+      polyz_free(t, 0);
+    }
+    return;
+  }
+  pr = polyz_alloc(d-1);
+  dr = polyz_tree_rem(pr, pa, da, T, i, mod);
+  polyz_tree_descend(vals, pr, dr, T, 2*i+1, lo, mod);
+  polyz_tree_descend(vals, pr, dr, T, 2*i+2, lo + T->deg[2*i+1], mod);
+  polyz_free(pr, d-1);
+}
+
+void polyz_tree_eval(mpz_t* vals, mpz_t* pa, long da, polyz_tree_t* T, mpz_t mod)
+{
+  polyz_tree_descend(vals, pa, da, T, 0, 0, mod);
+}
+
+void polyz_from_roots(mpz_t* pr, mpz_t* roots, long nroots, mpz_t mod)
+{
+  polyz_tree_t T;
+  long i;
+  T.nroots = nroots;
+  {
+    long size = 1;
+    while (size < nroots) size *= 2;
+    T.nnodes = 2*size;
+  }
+  New(0, T.node, T.nnodes, mpz_t*);
+  New(0, T.deg, T.nnodes, long);
+  for (i = 0; i < T.nnodes; i++)
+    T.node[i] = 0;
+  polyz_tree_build(&T, 0, 0, nroots, roots, mod);
+  for (i = 0; i <= nroots; i++)
+    mpz_set(pr[i], T.node[0][i]);
+  for (i = 0; i < T.nnodes; i++)
+    if (T.node[i] != 0)
+      polyz_free(T.node[i], T.deg[i]);
+  Safefree(T.node);
+  Safefree(T.deg);
+}
+
 void polyz_gcd(mpz_t* pres, mpz_t* pa, mpz_t* pb, long* dres, long da, long db, mpz_t MODN)
 {
   long i;
@@ -8,7 +8,21 @@
 extern int get_verbose_level(void);
 extern void set_verbose_level(int level);
 
+/* Cooperative cancellation.  The budget is a wall clock limit in seconds
+ * and a count of roughly modular multiplications, 0 meaning no limit.  It
+ * belongs to the calling thread and applies to each top level call, which
+ * starts it over with effort_begin. */
+extern void set_effort_budget(UV seconds, UV ops);
+extern void effort_begin(void);
+extern int  effort_spend(UV ops);     /* 1 if the budget is used up */
+extern int  effort_exhausted(void);
+/* A worker thread charges its caller's budget after adopting the handle
+ * from effort_share, and goes back to its own with effort_adopt(0). */
+extern void* effort_share(void);
+extern void effort_adopt(void* budget);
+
 extern gmp_randstate_t* get_randstate(void);
+extern unsigned long get_random_seed(void);   /* safe from any thread */
 extern void init_randstate(unsigned long seed);
 extern void clear_randstate(void);
 
@@ -21,6 +35,8 @@ int is_primitive_root(mpz_t a, mpz_t b, int nprime);
 #undef mpz_divmod
 extern int mpz_divmod(mpz_t r, mpz_t a, mpz_t b, mpz_t n, mpz_t t);
 
+extern int mpz_invert_batch(mpz_t* r, mpz_t* a, UV na, mpz_t n, mpz_t* c, mpz_t g);
+
 /* s = sqrt(a) mod p */
 extern int sqrtmod(mpz_t s, mpz_t a, mpz_t p);
 extern int sqrtmod_t(mpz_t s, mpz_t a, mpz_t p,
@@ -41,6 +57,7 @@ extern UV mpz_order_ui(UV r, mpz_t n, UV limit);
 
 extern void mpz_arctan(mpz_t r, unsigned long base, mpz_t pow, mpz_t t1, mpz_t t2);
 extern void mpz_product(mpz_t* A, UV a, UV b);
+extern void mpz_remainder_tree(mpz_t* r, mpz_t a, mpz_t* m, UV nm);
 
 extern void poly_mod_mul(mpz_t* px, mpz_t* py, UV r, mpz_t mod, mpz_t t1, mpz_t t2, mpz_t t3);
 extern void poly_mod_pow(mpz_t *pres, mpz_t *pn, mpz_t power, UV r, mpz_t mod);
@@ -56,6 +73,21 @@ extern void polyz_div(mpz_t *pq, mpz_t *pr, mpz_t *pn, mpz_t *pd,
 extern void polyz_pow_polymod(mpz_t* pres,  mpz_t* pn,  mpz_t* pmod,
                               long *dres,   long   dn,  long   dmod,
                               mpz_t power, mpz_t NMOD);
+/* A subproduct tree over a set of roots, for evaluating polys of degree up
+ * to maxdeg at all of them at once. */
+typedef struct {
+  long    nroots;
+  long    nnodes;
+  mpz_t** node;      /* monic product of (x - r) over the node's roots */
+  long*   deg;
+  mpz_t** inv;       /* 1/reverse(node) to ninv terms */
+  long*   ninv;
+} polyz_tree_t;
+extern void polyz_tree_init(polyz_tree_t* T, mpz_t* roots, long nroots, long maxdeg, mpz_t mod);
+extern void polyz_tree_eval(mpz_t* vals, mpz_t* pa, long da, polyz_tree_t* T, mpz_t mod);
+extern void polyz_tree_destroy(polyz_tree_t* T);
+/* pr (nroots+1 coefficients) = the product of (x - r) over the roots */
+extern void polyz_from_roots(mpz_t* pr, mpz_t* roots, long nroots, mpz_t mod);
 extern void polyz_gcd(mpz_t* pres, mpz_t* pa, mpz_t* pb, long* dres, long da, long db, mpz_t MODN);
 
 extern void polyz_root_deg1(mpz_t root, mpz_t* pn, mpz_t NMOD);
@@ -6,7 +6,7 @@ then
 fi
 
 cp -p ptypes.h standalone/
-cp -p ecpp.[ch] bls75.[ch] aks.[ch] ecm.[ch] prime_iterator.[ch] standalone/
+cp -p ecpp.[ch] bls75.[ch] aks.[ch] ecm.[ch] prac.[ch] prime_iterator.[ch] prime_tree.[ch] standalone/
 cp -p gmp_main.[ch] factor.[ch] small_factor.[ch] utility.[ch] standalone/
 cp -p primality.[ch] standalone/
 cp -p xt/expr.[ch] xt/expr-impl.h standalone/
@@ -33,17 +33,17 @@ static int _GMP_simpqs(mpz_t n, mpz_t* farray) { return 0; }
 #endif
 EOSIMPQSH
 
-# gcc -O3 -fomit-frame-pointer -DSTANDALONE -DSTANDALONE_ECPP ecpp.c bls75.c aks.c primality.c ecm.c prime_iterator.c gmp_main.c small_factor.c utility.c expr.c -o ecpp-dj -lgmp -lm
+# gcc -O3 -fomit-frame-pointer -DSTANDALONE -DSTANDALONE_ECPP ecpp.c bls75.c aks.c primality.c ecm.c prac.c prime_iterator.c prime_tree.c gmp_main.c small_factor.c utility.c expr.c -o ecpp-dj -lgmp -lm -lpthread
 
 cat << 'EOM' > standalone/Makefile
 TARGET = ecpp-dj
 CC = gcc
 DEFINES = -DSTANDALONE -DSTANDALONE_ECPP
 CFLAGS = -O3 -g -Wall $(DEFINES)
-LIBS = -lgmp -lm
+LIBS = -lgmp -lm -lpthread
 
-OBJ = ecpp.o bls75.o aks.o primality.o ecm.o prime_iterator.o gmp_main.o \
-      small_factor.o factor.o utility.o expr.o
+OBJ = ecpp.o bls75.o aks.o primality.o ecm.o prac.o prime_iterator.o prime_tree.o \
+      gmp_main.o small_factor.o factor.o utility.o expr.o
 HEADERS = ptypes.h class_poly_data.h
 
 .PHONY: default all clean